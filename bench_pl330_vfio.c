@@ -0,0 +1,676 @@
+#include "pl330_vfio_driver/pl330_vfio.h"
+#include "pl330_vfio_driver/pl330_model.h"
+#include "pl330_vfio_driver/pl330_trace.h"
+
+#include <linux/vfio.h>
+#include <linux/types.h>
+#include <linux/perf_event.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include <time.h>
+
+/*
+ * Throughput and latency sweep
+ *
+ * For every transfer size, burst size/length, number of channels and
+ * completion mode, every channel copies its own buffer iterations times.
+ * One line of CSV is written for every configuration:
+ *
+ * size,burst_size,burst_len,channels,mode,iterations,gbps,
+ * p50_ns,p99_ns,p999_ns,cycles_per_req,cpu_ns_per_req
+ *
+ * latencies go from the submit to the callback of a request, cycles are
+ * counted on the submitting and on the irq thread (-1 if perf events are
+ * not available), cpu time on the whole process. COMPLETION_POLL
+ * completes in the submitter: there every channel gets a submitting
+ * thread of its own, so that the channels run at once.
+ *
+ * With -t, built with make TRACE=1, the events of the driver are
+ * traced and dumped to the file at the end, see pl330_trace2json.
+ * */
+
+#define VFIO_CONTAINER "/dev/vfio/vfio"
+
+#define VFIO_DMA_MAP_FLAG_EXEC		(1 << 2)
+
+#define IOVA_BASE			0x0
+#define IOVA_SIZE			0x80000000ULL
+
+#define SIZE_MIN			4
+#define SIZE_MAX_DEF			(16 << 20)
+#define ITERATIONS_DEF			1000
+// iterations are reduced for big sizes, to move about this many bytes
+#define BYTES_PER_CONF			(256 << 20)
+#define MIN_ITERATIONS			16
+
+#define SLOT_SIZE			4096
+#define NUM_SLOTS			64
+
+// a submit that makes no progress for this long gives up
+#define SUBMIT_TIMEOUT_NS		1000000000ULL
+
+static const uint burst_sizes[] = {1, 4, 8, 16};
+static const uint burst_lens[] = {1, 4, 16};
+static const uint channel_counts[] = {1, 2, 4, 8};
+static const enum completion_mode modes[] = {
+	COMPLETION_IRQ,
+	COMPLETION_POLL,
+	COMPLETION_HYBRID,
+};
+static const char *mode_names[] = {"irq", "poll", "hybrid"};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+struct bench_req {
+	u64 submit_ns;
+	u64 done_ns;
+};
+
+struct bench_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint pending;
+
+	// cycles counter of the irq thread, opened on its first callback
+	pid_t irq_tid;
+};
+
+static struct bench_state bench = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static u64 now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 cpu_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cycles_counter(pid_t tid)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+static long long read_counter(int fd)
+{
+	long long val;
+
+	if(fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val)) {
+		return -1;
+	}
+
+	return val;
+}
+
+static void bench_callback(void *user_data)
+{
+	struct bench_req *req = user_data;
+
+	req->done_ns = now_ns();
+
+	pthread_mutex_lock(&bench.lock);
+	if(!bench.irq_tid) {
+		bench.irq_tid = syscall(SYS_gettid);
+	}
+	if(!--bench.pending) {
+		pthread_cond_signal(&bench.cond);
+	}
+	pthread_mutex_unlock(&bench.lock);
+}
+
+static void poll_callback(void *user_data)
+{
+	struct bench_req *req = user_data;
+
+	req->done_ns = now_ns();
+}
+
+static void vfio_irqfd_init(int device, unsigned int index, int fd)
+{
+	struct vfio_irq_set *irq_set;
+	int32_t *pfd;
+	int ret, argsz;
+
+	argsz = sizeof(*irq_set) + sizeof(*pfd);
+	irq_set = malloc(argsz);
+
+	if (!irq_set) {
+		printf("Failure in %s allocating memory\n", __func__);
+		exit(1);
+	}
+
+	irq_set->argsz = argsz;
+	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set->index = index;
+	irq_set->start = 0;
+	irq_set->count = 1;
+	pfd = (int32_t *)&irq_set->data;
+	*pfd = fd;
+
+	ret = ioctl(device, VFIO_DEVICE_SET_IRQS, irq_set);
+	free(irq_set);
+
+	if (ret) {
+		printf("Failure in %s for IRQ %d\n", __func__, index);
+		exit(1);
+	}
+}
+
+/*
+ * open the container, the group and the device, map the registers
+ * and route the device irqs to the driver
+ * */
+static int vfio_setup(const char *group_path, const char *device_name,
+			int *container_out, struct pl330_status **pl330,
+			uint *num_irqs)
+{
+	int container, group, device, irqfd;
+	struct vfio_group_status group_status = { .argsz = sizeof(group_status) };
+	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+	struct vfio_region_info reg = { .argsz = sizeof(reg) };
+	uchar *base_regs;
+	uint i;
+
+	container = open(VFIO_CONTAINER, O_RDWR);
+	if (container < 0 ||
+			ioctl(container, VFIO_GET_API_VERSION) != VFIO_API_VERSION) {
+		fprintf(stderr, "Unknown API version\n");
+		return -1;
+	}
+
+	group = open(group_path, O_RDWR);
+	ioctl(group, VFIO_GROUP_GET_STATUS, &group_status);
+	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		fprintf(stderr, "Group is not viable\n");
+		return -1;
+	}
+
+	ioctl(group, VFIO_GROUP_SET_CONTAINER, &container);
+	ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU);
+
+	device = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, device_name);
+	if (device < 0 || ioctl(device, VFIO_DEVICE_GET_INFO, &device_info)) {
+		fprintf(stderr, "Could not get VFIO device\n");
+		return -1;
+	}
+
+	reg.index = 0;
+	if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &reg)) {
+		fprintf(stderr, "Couldn't get region %d info\n", reg.index);
+		return -1;
+	}
+
+	base_regs = (uchar *)mmap(NULL, reg.size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, device, reg.offset);
+	if (base_regs == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map the registers\n");
+		return -1;
+	}
+
+	*pl330 = pl330_vfio_init(base_regs);
+
+	// an irq line for every channel event
+	*num_irqs = device_info.num_irqs;
+	for (i = 0; i < device_info.num_irqs; i++) {
+		irqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (irqfd < 0) {
+			return -1;
+		}
+		vfio_irqfd_init(device, i, irqfd);
+		if (pl330_vfio_add_irq(*pl330, irqfd, i)) {
+			close(irqfd);
+			*num_irqs = i;
+			break;
+		}
+	}
+
+	*container_out = container;
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+static inline u64 percentile(u64 *sorted, uint n, uint per_mille)
+{
+	return sorted[(u64)(n - 1) * per_mille / 1000];
+}
+
+/*
+ * submit conf, retrying while the requests in flight can still free a
+ * slot or a place in the queue of the channel. Returns -1 if the
+ * request is rejected for good or the completions are stuck
+ * */
+static int submit_retry(struct pl330_status *pl330, struct req_config *conf)
+{
+	u64 deadline = now_ns() + SUBMIT_TIMEOUT_NS;
+
+	while(pl330_vfio_submit(pl330, conf)) {
+		if(!pl330_vfio_inflight(pl330) || now_ns() > deadline) {
+			return -1;
+		}
+		sched_yield();
+	}
+
+	return 0;
+}
+
+/*
+ * submitting thread of a channel in COMPLETION_POLL
+ * */
+struct poll_worker {
+	pthread_t thread;
+	struct pl330_status *pl330;
+	struct req_config conf;
+	struct bench_req *reqs; // one per iteration
+	uint iterations;
+	long long cycles; // of the thread, -1 if not counted
+	int ret;
+};
+
+static void *poll_worker_func(void *arg)
+{
+	struct poll_worker *w = arg;
+	long long c0, c1;
+	uint it;
+	int fd;
+
+	fd = cycles_counter(0);
+	c0 = read_counter(fd);
+
+	for(it = 0; it < w->iterations; it++) {
+		w->conf.user_data = &w->reqs[it];
+		w->reqs[it].submit_ns = now_ns();
+		if(submit_retry(w->pl330, &w->conf)) {
+			w->ret = -1;
+			break;
+		}
+	}
+
+	c1 = read_counter(fd);
+	w->cycles = c0 >= 0 && c1 >= 0 ? c1 - c0 : -1;
+	if(fd >= 0) {
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * COMPLETION_POLL on num_chans channels, a thread each. Returns -1 if
+ * a request couldn't be submitted, the cycles of the threads in cycles
+ * (-1 if not counted)
+ * */
+static int run_polled(struct pl330_status *pl330, struct req_config *conf,
+		int *chans, struct pl330_dma_buf *src,
+		struct pl330_dma_buf *dst, struct bench_req *reqs,
+		uint num_chans, uint iterations, long long *cycles)
+{
+	struct poll_worker workers[MANAGER_ID];
+	uint c, n;
+	int ret = 0;
+
+	for(n = 0; n < num_chans; n++) {
+		struct poll_worker *w = &workers[n];
+
+		w->pl330 = pl330;
+		w->conf = *conf;
+		w->conf.chan_id = chans[n];
+		w->conf.iova_src = src[n].iova;
+		w->conf.iova_dst = dst[n].iova;
+		w->conf.callback = poll_callback;
+		w->reqs = &reqs[n * iterations];
+		w->iterations = iterations;
+		w->ret = 0;
+		if(pthread_create(&w->thread, NULL, poll_worker_func, w)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	*cycles = 0;
+	for(c = 0; c < n; c++) {
+		pthread_join(workers[c].thread, NULL);
+		ret |= workers[c].ret;
+		if(workers[c].cycles < 0 || *cycles < 0) {
+			*cycles = -1;
+		} else {
+			*cycles += workers[c].cycles;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * run one configuration, returns -1 if it can't be run
+ * */
+static int run_conf(struct pl330_status *pl330, FILE *out,
+		struct pl330_dma_buf *src,
+		struct pl330_dma_buf *dst, u64 size, uint burst_size,
+		uint burst_len, uint num_chans, enum completion_mode mode,
+		uint iterations)
+{
+	struct req_config conf;
+	struct bench_req *reqs;
+	u64 *lat;
+	int chans[MANAGER_ID];
+	int self_fd, irq_fd = -1;
+	long long cycles = -1, c0_self, c0_irq = 0, c1_self, c1_irq = 0;
+	u64 t0, t1, cpu0, cpu1;
+	uint it, c, n;
+	double gbps;
+	int ret = 0;
+
+	pl330_vfio_mem2mem_defconfig(pl330, &conf);
+	conf.size = size;
+	conf.src_burst_size = conf.dst_burst_size = burst_size;
+	conf.src_burst_len = conf.dst_burst_len = burst_len;
+	conf.burst_auto = false;
+	conf.c_mode = mode;
+	conf.callback = bench_callback;
+
+	if(pl330_vfio_cmds_len(pl330, &conf) < 0 ||
+			pl330_vfio_cmds_len(pl330, &conf) > SLOT_SIZE) {
+		return -1;
+	}
+
+	for(n = 0; n < num_chans; n++) {
+		chans[n] = pl330_vfio_request_channel(pl330);
+		if(chans[n] < 0) {
+			break;
+		}
+	}
+	if(n < num_chans) {
+		while(n--) {
+			pl330_vfio_release_channel(pl330, chans[n]);
+		}
+		return -1;
+	}
+
+	reqs = malloc(iterations * num_chans * sizeof(*reqs));
+	lat = malloc(iterations * num_chans * sizeof(*lat));
+
+	self_fd = cycles_counter(0);
+	if(bench.irq_tid) {
+		irq_fd = cycles_counter(bench.irq_tid);
+	}
+	c0_self = read_counter(self_fd);
+	if(irq_fd >= 0) {
+		c0_irq = read_counter(irq_fd);
+	}
+	cpu0 = cpu_ns();
+	t0 = now_ns();
+
+	if(mode == COMPLETION_POLL) {
+		ret = run_polled(pl330, &conf, chans, src, dst, reqs,
+					num_chans, iterations, &cycles);
+		if(ret) {
+			fprintf(stderr, "Could not submit size %llu, "
+				"burst %u x %u, %u channels, %s\n",
+				size, burst_size, burst_len, num_chans,
+				mode_names[mode]);
+			goto out;
+		}
+	}
+
+	for(it = 0; mode != COMPLETION_POLL && it < iterations; it++) {
+		pthread_mutex_lock(&bench.lock);
+		bench.pending = num_chans;
+		pthread_mutex_unlock(&bench.lock);
+
+		for(c = 0; c < num_chans; c++) {
+			struct bench_req *req = &reqs[it * num_chans + c];
+
+			conf.chan_id = chans[c];
+			conf.iova_src = src[c].iova;
+			conf.iova_dst = dst[c].iova;
+			conf.user_data = req;
+
+			req->submit_ns = now_ns();
+			if(submit_retry(pl330, &conf)) {
+				fprintf(stderr, "Could not submit size %llu, "
+					"burst %u x %u, %u channels, %s\n",
+					size, burst_size, burst_len,
+					num_chans, mode_names[mode]);
+				ret = -1;
+				break;
+			}
+		}
+
+		// the requests submitted complete anyway
+		pthread_mutex_lock(&bench.lock);
+		bench.pending -= num_chans - c;
+		while(bench.pending) {
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		}
+		pthread_mutex_unlock(&bench.lock);
+
+		if(ret) {
+			goto out;
+		}
+	}
+
+	t1 = now_ns();
+	cpu1 = cpu_ns();
+	c1_self = read_counter(self_fd);
+	if(irq_fd >= 0) {
+		c1_irq = read_counter(irq_fd);
+	}
+	// the submitters of COMPLETION_POLL have counted their own
+	if(mode != COMPLETION_POLL && c0_self >= 0 && c1_self >= 0) {
+		cycles = (c1_self - c0_self) + (c1_irq - c0_irq);
+	}
+
+	n = iterations * num_chans;
+	for(c = 0; c < n; c++) {
+		lat[c] = reqs[c].done_ns - reqs[c].submit_ns;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+	gbps = (double)size * n / (t1 - t0);
+
+	fprintf(out, "%llu,%u,%u,%u,%s,%u,%.3f,%llu,%llu,%llu,%lld,%llu\n",
+			size, burst_size, burst_len, num_chans,
+			mode_names[mode], iterations, gbps,
+			(unsigned long long)percentile(lat, n, 500),
+			(unsigned long long)percentile(lat, n, 990),
+			(unsigned long long)percentile(lat, n, 999),
+			cycles < 0 ? -1 : cycles / n,
+			(unsigned long long)((cpu1 - cpu0) / n));
+	fflush(out);
+
+out:
+	if(self_fd >= 0) {
+		close(self_fd);
+	}
+	if(irq_fd >= 0) {
+		close(irq_fd);
+	}
+	free(reqs);
+	free(lat);
+
+	for(c = 0; c < num_chans; c++) {
+		pl330_vfio_release_channel(pl330, chans[c]);
+	}
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-o out.csv] [-s max_size] [-i iterations]"
+			" [-t trace.bin] /dev/vfio/${group_id} device_id\n",
+									name);
+	fprintf(stderr, "       %s [-o out.csv] [-s max_size] [-i iterations]"
+			" [-t trace.bin] -m (on the software model)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct pl330_iommu *mmu;
+	struct pl330_model *model = NULL;
+	struct pl330_status *pl330 = NULL;
+	struct pl330_dma_buf src[MANAGER_ID], dst[MANAGER_ID];
+	FILE *out = stdout;
+	const char *trace = NULL;
+	bool use_model = false;
+	int container = -1;
+	u64 size, max_size = SIZE_MAX_DEF;
+	uint iterations = ITERATIONS_DEF, num_irqs, iters;
+	uint s, l, c, m, i;
+	int opt;
+
+	while((opt = getopt(argc, argv, "o:s:i:t:m")) != -1) {
+		switch(opt) {
+		case 'm':
+			use_model = true;
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if(!out) {
+				perror("fopen");
+				return 1;
+			}
+			break;
+		case 's':
+			max_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			trace = optarg;
+			pl330_trace_enable(true);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(argc - optind != (use_model ? 0 : 2) || max_size < SIZE_MIN ||
+			!iterations) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if(!use_model && vfio_setup(argv[optind], argv[optind + 1],
+					&container, &pl330, &num_irqs)) {
+		return 1;
+	}
+
+	mmu = pl330_vfio_iommu_init(container, IOVA_BASE, IOVA_SIZE,
+				VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE
+						| VFIO_DMA_MAP_FLAG_EXEC);
+
+	if(use_model && mmu) {
+		model = pl330_model_create(mmu, MODEL_NUM_CHANNELS);
+		if(!model) {
+			fprintf(stderr, "Could not create the model\n");
+			return 1;
+		}
+		pl330 = pl330_vfio_init_model(model);
+		for(num_irqs = 0; num_irqs < MODEL_NUM_CHANNELS; num_irqs++) {
+			pl330_vfio_add_irq(pl330, pl330_model_irq_eventfd(model,
+						num_irqs), num_irqs);
+		}
+	}
+
+	if(!mmu || pl330_vfio_cmds_pool_init(pl330, mmu, SLOT_SIZE,
+							NUM_SLOTS)) {
+		fprintf(stderr, "Could not map DMA memory\n");
+		return 1;
+	}
+
+	for(i = 0; i < MANAGER_ID; i++) {
+		if(pl330_vfio_dma_alloc(mmu, max_size, &src[i]) ||
+				pl330_vfio_dma_alloc(mmu, max_size, &dst[i])) {
+			fprintf(stderr, "Could not map DMA memory\n");
+			return 1;
+		}
+		memset(src[i].vaddr, i + 1, max_size);
+	}
+
+	pl330_vfio_start_irq_handler(pl330);
+
+	fprintf(out, "size,burst_size,burst_len,channels,mode,iterations,gbps,"
+			"p50_ns,p99_ns,p999_ns,cycles_per_req,cpu_ns_per_req\n");
+
+	for(size = SIZE_MIN; size <= max_size; size *= 4) {
+		iters = BYTES_PER_CONF / size;
+		if(iters > iterations) {
+			iters = iterations;
+		}
+		if(iters < MIN_ITERATIONS) {
+			iters = MIN_ITERATIONS;
+		}
+
+		for(s = 0; s < ARRAY_SIZE(burst_sizes); s++)
+		for(l = 0; l < ARRAY_SIZE(burst_lens); l++)
+		for(c = 0; c < ARRAY_SIZE(channel_counts); c++)
+		for(m = 0; m < ARRAY_SIZE(modes); m++) {
+			// events of the channels without an irq line are lost
+			if(modes[m] != COMPLETION_POLL &&
+					channel_counts[c] > num_irqs) {
+				continue;
+			}
+
+			run_conf(pl330, out, src, dst, size, burst_sizes[s],
+					burst_lens[l], channel_counts[c],
+					modes[m], iters);
+		}
+	}
+
+	if(trace && pl330_trace_dump(trace)) {
+		fprintf(stderr, "Could not write the trace\n");
+	}
+
+	pl330_vfio_remove(pl330);
+	if(model) {
+		pl330_model_destroy(model);
+	}
+	pl330_vfio_iommu_destroy(mmu);
+
+	if(out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
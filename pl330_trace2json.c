@@ -0,0 +1,269 @@
+#include "pl330_vfio_driver/pl330_trace.h"
+
+#include <linux/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/*
+ * Trace converter
+ *
+ * Turns a dump of pl330_trace_dump() into the Chrome trace event format,
+ * to be opened with chrome://tracing or ui.perfetto.dev:
+ *
+ * - one process "pl330 <ctrl>" for every controller, one track for each
+ *   of its channels with a slice from every DMAGO to the end of its
+ *   program: the gaps between the slices are the channel sitting idle
+ * - the process "threads" with a track for every thread of the driver:
+ *   program generation and callbacks as slices, irq wakeups and
+ *   INTCLR writes as instant events
+ *
+ * timestamps are in microseconds from the first record.
+ * */
+
+#define NUM_CTRLS	256
+#define NUM_CHANS	256
+
+// the process of the threads, the controllers follow
+#define THREADS_PID	0
+
+struct event {
+	struct pl330_trace_rec rec;
+	__u32 tid;
+	__u64 seq; // order in the dump, for the records at the same ns
+};
+
+static int cmp_event(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if(x->rec.ns != y->rec.ns) {
+		return x->rec.ns < y->rec.ns ? -1 : 1;
+	}
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static struct event *read_dump(FILE *in, size_t *num)
+{
+	struct pl330_trace_header header;
+	struct pl330_trace_thread thread;
+	struct event *events, *tmp;
+	size_t n = 0, len = 1;
+	__u32 t, i;
+
+	// a dump can have no records at all
+	events = malloc(len * sizeof(*events));
+	if(!events) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	if(fread(&header, sizeof(header), 1, in) != 1 ||
+			memcmp(header.magic, PL330_TRACE_MAGIC,
+						sizeof(header.magic)) ||
+			header.rec_size != sizeof(struct pl330_trace_rec)) {
+		fprintf(stderr, "Not a trace dump\n");
+		free(events);
+		return NULL;
+	}
+
+	for(t = 0; t < header.num_threads; t++) {
+		if(fread(&thread, sizeof(thread), 1, in) != 1) {
+			goto truncated;
+		}
+
+		if(n + thread.count > len) {
+			len = n + thread.count;
+			tmp = realloc(events, len * sizeof(*events));
+			if(!tmp) {
+				fprintf(stderr, "Out of memory\n");
+				free(events);
+				return NULL;
+			}
+			events = tmp;
+		}
+
+		for(i = 0; i < thread.count; i++, n++) {
+			if(fread(&events[n].rec, sizeof(events[n].rec), 1,
+								in) != 1) {
+				goto truncated;
+			}
+			events[n].tid = thread.tid;
+			events[n].seq = n;
+		}
+	}
+
+	*num = n;
+
+	return events;
+
+truncated:
+	fprintf(stderr, "Truncated trace dump\n");
+	free(events);
+
+	return NULL;
+}
+
+static void print_event(FILE *out, bool *first, const char *name,
+		const char *ph, uint pid, uint tid, __u64 ns,
+		const char *arg_name, __s64 arg)
+{
+	fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%u,"
+			"\"tid\":%u,\"ts\":%llu.%03llu", *first ? "" : ",",
+			name, ph, pid, tid, ns / 1000, ns % 1000);
+	// instant events on their thread only
+	if(!strcmp(ph, "i")) {
+		fprintf(out, ",\"s\":\"t\"");
+	}
+	if(arg_name) {
+		fprintf(out, ",\"args\":{\"%s\":%lld}", arg_name, arg);
+	}
+	fprintf(out, "}");
+
+	*first = false;
+}
+
+static void print_names(FILE *out, bool *first, bool *ctrl_seen)
+{
+	uint c;
+
+	fprintf(out, "%s\n{\"name\":\"process_name\",\"ph\":\"M\","
+			"\"pid\":%u,\"args\":{\"name\":\"threads\"}}",
+			*first ? "" : ",", THREADS_PID);
+	*first = false;
+
+	for(c = 0; c < NUM_CTRLS; c++) {
+		if(ctrl_seen[c]) {
+			fprintf(out, ",\n{\"name\":\"process_name\","
+				"\"ph\":\"M\",\"pid\":%u,"
+				"\"args\":{\"name\":\"pl330 %u\"}}",
+				THREADS_PID + 1 + c, c);
+		}
+	}
+}
+
+static void convert(FILE *out, struct event *events, size_t num)
+{
+	static bool running[NUM_CTRLS][NUM_CHANS];
+	static bool ctrl_seen[NUM_CTRLS];
+	struct pl330_trace_rec *rec;
+	bool first = true;
+	__u64 base = num ? events[0].rec.ns : 0, ns;
+	uint pid;
+	size_t i;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	for(i = 0; i < num; i++) {
+		rec = &events[i].rec;
+		ns = rec->ns - base;
+		pid = THREADS_PID + 1 + rec->ctrl;
+		ctrl_seen[rec->ctrl] = true;
+
+		switch(rec->type) {
+		case PL330_TRACE_GEN_BEGIN:
+			print_event(out, &first, "gen", "B", THREADS_PID,
+					events[i].tid, ns, "chan", rec->chan);
+			break;
+		case PL330_TRACE_GEN_END:
+			print_event(out, &first, "gen", "E", THREADS_PID,
+					events[i].tid, ns, "len",
+					(__s32)rec->arg);
+			break;
+		case PL330_TRACE_CB_BEGIN:
+			print_event(out, &first, "callback", "B", THREADS_PID,
+					events[i].tid, ns, "chan", rec->chan);
+			break;
+		case PL330_TRACE_CB_END:
+			print_event(out, &first, "callback", "E", THREADS_PID,
+					events[i].tid, ns, NULL, 0);
+			break;
+		case PL330_TRACE_IRQ:
+			print_event(out, &first, "irq", "i", THREADS_PID,
+					events[i].tid, ns, "lines", rec->arg);
+			break;
+		case PL330_TRACE_INTCLR:
+			print_event(out, &first, "INTCLR", "i", THREADS_PID,
+					events[i].tid, ns, "events", rec->arg);
+			break;
+		case PL330_TRACE_GO:
+			// a program left open by a lost record ends here
+			if(running[rec->ctrl][rec->chan]) {
+				print_event(out, &first, "program", "E", pid,
+						rec->chan, ns, NULL, 0);
+			}
+			print_event(out, &first, "program", "B", pid,
+					rec->chan, ns, "iova", rec->arg);
+			running[rec->ctrl][rec->chan] = true;
+			break;
+		case PL330_TRACE_CHUNK:
+		case PL330_TRACE_DONE:
+			// the DMAGO may have been overwritten in the ring
+			if(running[rec->ctrl][rec->chan]) {
+				print_event(out, &first, "program", "E", pid,
+						rec->chan, ns,
+						rec->type == PL330_TRACE_DONE ?
+						"bytes" : NULL, rec->arg);
+			}
+			running[rec->ctrl][rec->chan] = false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	print_names(out, &first, ctrl_seen);
+
+	fprintf(out, "\n]}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s trace.bin [out.json]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct event *events;
+	FILE *in, *out = stdout;
+	size_t num;
+
+	if(argc != 2 && argc != 3) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	in = fopen(argv[1], "r");
+	if(!in) {
+		perror("fopen");
+		return 1;
+	}
+
+	events = read_dump(in, &num);
+	fclose(in);
+	if(!events) {
+		return 1;
+	}
+
+	if(argc == 3) {
+		out = fopen(argv[2], "w");
+		if(!out) {
+			perror("fopen");
+			return 1;
+		}
+	}
+
+	// the threads are in the dump one after the other
+	qsort(events, num, sizeof(*events), cmp_event);
+	convert(out, events, num);
+
+	if(out != stdout) {
+		fclose(out);
+	}
+	free(events);
+
+	return 0;
+}
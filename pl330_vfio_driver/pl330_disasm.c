@@ -0,0 +1,354 @@
+#include "pl330_disasm.h"
+#include "pl330_vfio.h"
+
+#include <linux/types.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define INS_TEXT_LEN		64
+#define INS_MAX_SIZE		DMAMOV_SIZE
+
+/*
+ * a decoded instruction
+ * */
+struct dec_ins {
+	uchar op;
+	uint size;
+	char text[INS_TEXT_LEN];
+
+	// DMALP and DMALPEND only
+	int lc;		// loop counter register, -1 otherwise
+	bool forever;	// DMALPEND of a loop without DMALP
+	uint jump;	// DMALPEND backward jump
+};
+
+static const char *cond_suffix[] = {"", "S", "", "B"};
+static const char *dmamov_regs[] = {"SAR", "CCR", "DAR"};
+
+/*
+ * "inc burst 16x16" for the source or destination half of CCR
+ * */
+static void ccr_half_text(char *buf, size_t len, uint ccr, uint shift)
+{
+	uint bsize = 1 << ((ccr >> (CCR_SRCBURSTSIZE_SHIFT + shift)) & 0x7);
+	uint blen = ((ccr >> (CCR_SRCBURSTLEN_SHIFT + shift)) & 0xf) + 1;
+
+	snprintf(buf, len, "%s %ux%u",
+			(ccr >> (CCR_SRCINC_SHIFT + shift)) & 0x1 ?
+						"inc" : "fixed",
+			bsize, blen);
+}
+
+/*
+ * decode the instruction at p, left bytes long at most.
+ * Returns 0, -1 if it's unknown or uses reserved encodings;
+ * ins->size is set anyway, the caller checks it against left.
+ * */
+static int decode(const uchar *p, uint left, struct dec_ins *ins)
+{
+	uchar op = p[0];
+	uchar arg = left > 1 ? p[1] : 0;
+	char src[16], dst[16];
+	uint imm;
+
+	memset(ins, 0, sizeof(*ins));
+	ins->op = op;
+	ins->size = 1;
+	ins->lc = -1;
+
+	// one byte
+	switch(op) {
+	case DMAEND:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAEND");
+		return 0;
+	case DMAKILL:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAKILL");
+		return 0;
+	case DMANOP:
+		snprintf(ins->text, INS_TEXT_LEN, "DMANOP");
+		return 0;
+	case DMARMB:
+		snprintf(ins->text, INS_TEXT_LEN, "DMARMB");
+		return 0;
+	case DMAWMB:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAWMB");
+		return 0;
+	case DMASTZ:
+		snprintf(ins->text, INS_TEXT_LEN, "DMASTZ");
+		return 0;
+	case DMALD:
+	case DMALD | 0x1:
+	case DMALD | 0x3:
+		snprintf(ins->text, INS_TEXT_LEN, "DMALD%s",
+						cond_suffix[op & 0x3]);
+		return 0;
+	case DMAST:
+	case DMAST | 0x1:
+	case DMAST | 0x3:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAST%s",
+						cond_suffix[op & 0x3]);
+		return 0;
+	}
+
+	// two bytes
+	ins->size = 2;
+	switch(op) {
+	case DMALP:
+	case DMALP | (1 << 1):
+		ins->lc = (op >> 1) & 0x1;
+		snprintf(ins->text, INS_TEXT_LEN, "DMALP lc%d, %u",
+							ins->lc, arg + 1);
+		return 0;
+	case DMALDP:
+	case DMALDP | (1 << 1):
+		snprintf(ins->text, INS_TEXT_LEN, "DMALDP%s P%u",
+				cond_suffix[op & 0x3], arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMASTP:
+	case DMASTP | (1 << 1):
+		snprintf(ins->text, INS_TEXT_LEN, "DMASTP%s P%u",
+				cond_suffix[op & 0x3], arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMAWFP:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAWFPS P%u", arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMAWFP | 0x1:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAWFP P%u, periph",
+								arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMAWFP | (1 << 1):
+		snprintf(ins->text, INS_TEXT_LEN, "DMAWFPB P%u", arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMAFLUSHP:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAFLUSHP P%u", arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMASEV:
+		snprintf(ins->text, INS_TEXT_LEN, "DMASEV E%u", arg >> 3);
+		return arg & 0x7 ? -1 : 0;
+	case DMAWFE:
+		snprintf(ins->text, INS_TEXT_LEN, "DMAWFE E%u%s", arg >> 3,
+						arg & (1 << 1) ? ", invalid" : "");
+		return arg & 0x5 ? -1 : 0;
+	}
+
+	if((op & 0xe8) == DMALPEND) {
+		// bs without x is reserved
+		if((op & 0x3) == (1 << 1)) {
+			return -1;
+		}
+		ins->lc = (op >> 2) & 0x1;
+		ins->forever = !(op & (1 << 4));
+		ins->jump = arg;
+		snprintf(ins->text, INS_TEXT_LEN, "DMALPEND%s%s lc%d, -%u",
+				ins->forever ? "FE" : "",
+				cond_suffix[op & 0x3], ins->lc, arg);
+		return 0;
+	}
+
+	// three bytes
+	ins->size = DMAADDH_SIZE;
+	switch(op) {
+	case DMAADDH:
+	case DMAADDH | (1 << 1):
+	case DMAADNH:
+	case DMAADNH | (1 << 1):
+		imm = left >= DMAADDH_SIZE ? p[1] | (p[2] << 8) : 0;
+		snprintf(ins->text, INS_TEXT_LEN, "%s %s, 0x%04x",
+				(op & ~(1 << 1)) == DMAADDH ?
+						"DMAADDH" : "DMAADNH",
+				op & (1 << 1) ? "DAR" : "SAR", imm);
+		return 0;
+	}
+
+	// six bytes
+	ins->size = DMAMOV_SIZE;
+	imm = left >= DMAMOV_SIZE ? *((uint *)&p[2]) : 0;
+	switch(op) {
+	case DMAMOV:
+		if(arg > _DAR) {
+			return -1;
+		}
+		if(arg == _CCR) {
+			ccr_half_text(src, sizeof(src), imm, 0);
+			ccr_half_text(dst, sizeof(dst), imm, DST_SHIFT);
+			snprintf(ins->text, INS_TEXT_LEN,
+					"DMAMOV CCR, 0x%08x ; %s -> %s",
+					imm, src, dst);
+		} else {
+			snprintf(ins->text, INS_TEXT_LEN, "DMAMOV %s, 0x%08x",
+						dmamov_regs[arg], imm);
+		}
+		return 0;
+	case DMAGO:
+	case DMAGO | (1 << 1):
+		snprintf(ins->text, INS_TEXT_LEN, "DMAGO C%u, 0x%08x%s",
+				arg & 0x7, imm, op & (1 << 1) ? ", ns" : "");
+		return arg & ~0x7 ? -1 : 0;
+	}
+
+	ins->size = 1;
+
+	return -1;
+}
+
+__u32 pl330_disasm(FILE *out, const __u8 *cmds, __u32 len)
+{
+	struct dec_ins ins;
+	char raw[3 * INS_MAX_SIZE + 1];
+	uint off = 0, i;
+
+	while(off < len) {
+		if(decode(&cmds[off], len - off, &ins) ||
+				ins.size > len - off) {
+			fprintf(out, "%04x:  %02x                 <bad>\n",
+							off, cmds[off]);
+			break;
+		}
+
+		for(i = 0; i < ins.size; i++) {
+			sprintf(&raw[3 * i], "%02x ", cmds[off + i]);
+		}
+		fprintf(out, "%04x:  %-18s %s\n", off, raw, ins.text);
+
+		off += ins.size;
+	}
+
+	return off;
+}
+
+static void check_fail(uint off, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "pl330 check: %04x: ", off);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * DMALP not closed yet
+ * */
+struct open_loop {
+	int lc;
+	uint start; // first instruction of the body
+};
+
+int pl330_prog_check(const __u8 *cmds, __u32 len)
+{
+	struct open_loop loops[2];
+	struct dec_ins ins;
+	uchar *starts;
+	uint off = 0, target, depth = 0, i;
+	int ret = -1;
+
+	// where the instructions start, forever loops must jump there
+	starts = calloc(len ? len : 1, 1);
+	if(!starts) {
+		check_fail(0, "out of memory");
+		return -1;
+	}
+
+	while(off < len) {
+		if(decode(&cmds[off], len - off, &ins)) {
+			check_fail(off, "unknown instruction 0x%02x", cmds[off]);
+			goto out;
+		}
+		if(ins.size > len - off) {
+			check_fail(off, "%s cut by the end of the program",
+								ins.text);
+			goto out;
+		}
+		starts[off] = 1;
+
+		if((ins.op & ~(1 << 1)) == DMAGO) {
+			check_fail(off, "DMAGO in a channel program");
+			goto out;
+		}
+
+		if((ins.op & ~(1 << 1)) == DMALP) {
+			for(i = 0; i < depth; i++) {
+				if(loops[i].lc == ins.lc) {
+					check_fail(off, "lc%d already used by "
+						"the loop at %04x", ins.lc,
+						loops[i].start - DMALP_SIZE);
+					goto out;
+				}
+			}
+			loops[depth].lc = ins.lc;
+			loops[depth].start = off + ins.size;
+			depth++;
+		}
+
+		if(ins.lc >= 0 && ins.forever) {
+			if(!ins.jump || ins.jump > off) {
+				check_fail(off, "%s jumps out of the program",
+								ins.text);
+				goto out;
+			}
+		} else if(ins.lc >= 0 && (ins.op & ~(1 << 1)) != DMALP) {
+			if(!depth || loops[depth - 1].lc != ins.lc) {
+				check_fail(off, "%s without a DMALP on lc%d",
+							ins.text, ins.lc);
+				goto out;
+			}
+			target = loops[depth - 1].start;
+			if(off - target > 0xff) {
+				check_fail(off, "loop body of %u bytes, longer "
+					"than a DMALPEND jump", off - target);
+				goto out;
+			}
+			if(off - ins.jump != target) {
+				check_fail(off, "%s jumps to %04x, the loop "
+					"starts at %04x", ins.text,
+					off - ins.jump, target);
+				goto out;
+			}
+			depth--;
+		}
+
+		off += ins.size;
+
+		if(ins.op == DMAEND) {
+			if(depth) {
+				check_fail(off - DMAEND_SIZE,
+					"DMAEND inside the loop at %04x",
+					loops[depth - 1].start - DMALP_SIZE);
+				goto out;
+			}
+			if(off != len) {
+				check_fail(off, "%u bytes after DMAEND",
+								len - off);
+				goto out;
+			}
+			break;
+		}
+	}
+
+	if(!len || ins.op != DMAEND) {
+		check_fail(off, "the program doesn't end with DMAEND");
+		goto out;
+	}
+
+	// forever loops, now that all the instructions are known
+	for(off = 0; off < len; off += ins.size) {
+		decode(&cmds[off], len - off, &ins);
+		if(ins.lc >= 0 && ins.forever && !starts[off - ins.jump]) {
+			check_fail(off, "%s jumps inside an instruction",
+								ins.text);
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(starts);
+
+	return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef PL330_DISASM_H
+#define PL330_DISASM_H
+
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * Microcode decoder and static checks
+ *
+ * pl330_disasm() prints a channel program back as instructions, one per
+ * line with its offset and bytes. pl330_prog_check() looks for what
+ * would otherwise show up only as a hung or faulting channel:
+ * 	instructions that don't decode or are cut by the end of the program
+ * 	instructions a channel thread can't execute (DMAGO)
+ * 	DMALPEND without a DMALP on the same loop counter, or not
+ * 	jumping back exactly to the first instruction of its loop
+ * 	loop bodies longer than a DMALPEND jump can reach
+ * 	nested loops on the same loop counter, loops left open
+ * 	programs not ending with DMAEND, or with bytes after it
+ *
+ * Built with PL330_CHECKED (make CHECKED=1), the driver checks every
+ * program returned by generate_cmds_from_request().
+ * */
+
+/*
+ * returns the number of bytes decoded, less than len if
+ * an instruction doesn't decode
+ * */
+__u32 pl330_disasm(FILE *out, const __u8 *cmds, __u32 len);
+
+/*
+ * returns 0 if the len bytes of cmds are a valid channel program,
+ * -1 otherwise; the first problem found is reported on stderr
+ * */
+int pl330_prog_check(const __u8 *cmds, __u32 len);
+
+#endif
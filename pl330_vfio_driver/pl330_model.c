@@ -0,0 +1,711 @@
+#include "pl330_model.h"
+#include "pl330_vfio.h"
+
+#include <linux/types.h>
+#include <errno.h>
+#include <error.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/*
+ * IOVA range last translated, most accesses fall in the same mapping
+ * */
+struct model_window {
+	u64 iova;
+	u64 len;
+	uchar *vaddr;
+};
+
+struct model_channel {
+	struct pl330_model *model;
+	uint id;
+	pthread_t thread;
+
+	// protected by the model lock
+	bool go;
+	bool exit;
+	// set by DMAKILL, checked before every instruction
+	bool kill;
+
+	u64 pc;
+	uint sar;
+	uint dar;
+	uint ccr;
+	uint lc[2];
+	enum request_type req_flag;
+
+	// MFIFO, data loaded and not stored yet
+	uchar *fifo;
+	uint fifo_head;
+	uint fifo_cnt;
+
+	struct model_window prog_win;
+	struct model_window data_win;
+};
+
+struct pl330_model {
+	uint regs[MODEL_REGS_SIZE / sizeof(uint)];
+
+	struct pl330_iommu *mmu;
+	uint num_channels;
+	uint fifo_size;
+
+	int irq_efd[MODEL_NUM_EVENTS];
+
+	// requests posted and not acknowledged yet, by peripheral
+	uint periph_reqs[MODEL_NUM_PERIPHS];
+	bool periph_burst[MODEL_NUM_PERIPHS];
+
+	// debug interface and interrupt registers
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct model_channel chans[MODEL_NUM_CHANNELS];
+};
+
+static inline uint get_reg(struct pl330_model *model, uint offset)
+{
+	return __atomic_load_n(&model->regs[offset / sizeof(uint)],
+							__ATOMIC_ACQUIRE);
+}
+
+static inline void set_reg(struct pl330_model *model, uint offset, uint val)
+{
+	__atomic_store_n(&model->regs[offset / sizeof(uint)], val,
+							__ATOMIC_RELEASE);
+}
+
+static inline void set_state(struct model_channel *ch, uint state)
+{
+	set_reg(ch->model, CSR(ch->id), state << CSR_CHANNEL_STATUS_SH);
+}
+
+static uchar *translate(struct pl330_model *model, struct model_window *win,
+						u64 iova, uint len)
+{
+	if(iova < win->iova || iova + len > win->iova + win->len) {
+		win->vaddr = pl330_vfio_iova_to_vaddr(model->mmu, iova,
+								&win->len);
+		if(!win->vaddr || win->len < len) {
+			win->len = 0;
+			return NULL;
+		}
+		win->iova = iova;
+	}
+
+	return win->vaddr + (iova - win->iova);
+}
+
+/*
+ * raise event: it becomes active in INT_EVENT_RIS and, if its
+ * interrupt is enabled, the irq line fires
+ * */
+static void raise_event(struct pl330_model *model, uint event)
+{
+	uint ris, inten;
+
+	pthread_mutex_lock(&model->lock);
+
+	ris = get_reg(model, INT_EVENT_RIS) | (1 << event);
+	inten = get_reg(model, INTEN);
+	set_reg(model, INT_EVENT_RIS, ris);
+	set_reg(model, INTMIS, ris & inten);
+	pthread_cond_broadcast(&model->cond);
+
+	pthread_mutex_unlock(&model->lock);
+
+	if(inten & (1 << event)) {
+		eventfd_write(model->irq_efd[event], 1);
+	}
+}
+
+/*
+ * DMAWFE: wait for the event to be active, then clear it
+ * */
+static void wait_event(struct model_channel *ch, uint event)
+{
+	struct pl330_model *model = ch->model;
+	uint ris;
+
+	set_state(ch, WAIT_EVENT);
+
+	pthread_mutex_lock(&model->lock);
+	while(!(get_reg(model, INT_EVENT_RIS) & (1 << event)) &&
+			!__atomic_load_n(&ch->kill, __ATOMIC_ACQUIRE)) {
+		pthread_cond_wait(&model->cond, &model->lock);
+	}
+
+	ris = get_reg(model, INT_EVENT_RIS) & ~(1 << event);
+	set_reg(model, INT_EVENT_RIS, ris);
+	set_reg(model, INTMIS, ris & get_reg(model, INTEN));
+	pthread_mutex_unlock(&model->lock);
+
+	set_state(ch, EXECUTING);
+}
+
+static inline void ccr_fields(uint ccr, uint shift, uint *burst_size,
+					uint *burst_len, bool *inc)
+{
+	*inc = (ccr >> shift) & 0x1;
+	*burst_size = 1 << ((ccr >> (shift + 1)) & 0x7);
+	*burst_len = ((ccr >> (shift + 4)) & 0xf) + 1;
+}
+
+static int fifo_push(struct model_channel *ch, uchar *src, uint len)
+{
+	struct pl330_model *model = ch->model;
+	uint tail, first;
+
+	if(ch->fifo_cnt + len > model->fifo_size) {
+		return -1;
+	}
+
+	tail = (ch->fifo_head + ch->fifo_cnt) % model->fifo_size;
+	first = model->fifo_size - tail < len ? model->fifo_size - tail : len;
+	memcpy(ch->fifo + tail, src, first);
+	memcpy(ch->fifo, src + first, len - first);
+	ch->fifo_cnt += len;
+
+	return 0;
+}
+
+static int fifo_pop(struct model_channel *ch, uchar *dst, uint len)
+{
+	struct pl330_model *model = ch->model;
+	uint first;
+
+	if(ch->fifo_cnt < len) {
+		return -1;
+	}
+
+	first = model->fifo_size - ch->fifo_head < len ?
+				model->fifo_size - ch->fifo_head : len;
+	memcpy(dst, ch->fifo + ch->fifo_head, first);
+	memcpy(dst + first, ch->fifo, len - first);
+	ch->fifo_head = (ch->fifo_head + len) % model->fifo_size;
+	ch->fifo_cnt -= len;
+
+	return 0;
+}
+
+/*
+ * a burst from SAR to the MFIFO
+ * */
+static int do_load(struct model_channel *ch)
+{
+	uint burst_size, burst_len, i;
+	uchar *ptr;
+	bool inc;
+
+	ccr_fields(ch->ccr, CCR_SRCINC_SHIFT, &burst_size, &burst_len, &inc);
+
+	if(inc) {
+		ptr = translate(ch->model, &ch->data_win, ch->sar,
+						burst_size * burst_len);
+		if(!ptr || fifo_push(ch, ptr, burst_size * burst_len)) {
+			return -1;
+		}
+		ch->sar += burst_size * burst_len;
+		return 0;
+	}
+
+	// fixed address, every beat reads the same data
+	ptr = translate(ch->model, &ch->data_win, ch->sar, burst_size);
+	for(i = 0; i < burst_len; i++) {
+		if(!ptr || fifo_push(ch, ptr, burst_size)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * a burst from the MFIFO to DAR
+ * */
+static int do_store(struct model_channel *ch)
+{
+	uint burst_size, burst_len, i;
+	uchar *ptr;
+	bool inc;
+
+	ccr_fields(ch->ccr, CCR_DSTINC_SHIFT, &burst_size, &burst_len, &inc);
+
+	if(inc) {
+		ptr = translate(ch->model, &ch->data_win, ch->dar,
+						burst_size * burst_len);
+		if(!ptr || fifo_pop(ch, ptr, burst_size * burst_len)) {
+			return -1;
+		}
+		ch->dar += burst_size * burst_len;
+		return 0;
+	}
+
+	ptr = translate(ch->model, &ch->data_win, ch->dar, burst_size);
+	for(i = 0; i < burst_len; i++) {
+		if(!ptr || fifo_pop(ch, ptr, burst_size)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * conditional instructions (x bit set) are executed only if their
+ * bs bit matches the request flag of the channel
+ * */
+static inline bool cond_holds(struct model_channel *ch, uchar ins)
+{
+	if(!(ins & (1 << 0))) {
+		return true;
+	}
+
+	return ((ins >> 1) & 0x1) == ch->req_flag;
+}
+
+/*
+ * DMAWFP: wait for a request of the peripheral, the request flag
+ * comes from the instruction or, for DMAWFP P, from the peripheral
+ * */
+static void wait_periph(struct model_channel *ch, uchar ins, uint periph)
+{
+	struct pl330_model *model = ch->model;
+
+	set_state(ch, WAIT_PERIPH);
+
+	pthread_mutex_lock(&model->lock);
+	while(!model->periph_reqs[periph] &&
+			!__atomic_load_n(&ch->kill, __ATOMIC_ACQUIRE)) {
+		pthread_cond_wait(&model->cond, &model->lock);
+	}
+
+	if(ins & 0x1) {
+		ch->req_flag = model->periph_burst[periph] ? BURST : SINGLE;
+	} else {
+		ch->req_flag = ins & (1 << 1) ? BURST : SINGLE;
+	}
+	pthread_mutex_unlock(&model->lock);
+
+	set_state(ch, EXECUTING);
+}
+
+static inline void ack_periph(struct model_channel *ch, uint periph)
+{
+	struct pl330_model *model = ch->model;
+
+	pthread_mutex_lock(&model->lock);
+	if(model->periph_reqs[periph]) {
+		model->periph_reqs[periph]--;
+	}
+	pthread_mutex_unlock(&model->lock);
+}
+
+// returned by step() when a jump has already moved the pc
+#define STEP_JUMP		0x100
+
+/*
+ * execute one instruction, returns its size, 0 if the
+ * program is over, -1 on fault
+ * */
+static int step(struct model_channel *ch, uchar *ins)
+{
+	uint *reg, imm;
+
+	switch(ins[0]) {
+	case DMAEND:
+	case DMAKILL:
+		return 0;
+	case DMALD:
+	case DMALD | 0x1:
+	case DMALD | 0x3:
+		if(cond_holds(ch, ins[0]) && do_load(ch)) {
+			return -1;
+		}
+		return DMALD_SIZE;
+	case DMAST:
+	case DMAST | 0x1:
+	case DMAST | 0x3:
+		if(cond_holds(ch, ins[0]) && do_store(ch)) {
+			return -1;
+		}
+		return DMAST_SIZE;
+	case DMARMB:
+	case DMAWMB:
+	case DMANOP:
+		// data is moved synchronously, nothing to wait for
+		return 1;
+	case DMALP:
+	case DMALP | (1 << 1):
+		ch->lc[(ins[0] >> 1) & 0x1] = ins[1];
+		return DMALP_SIZE;
+	case DMALPEND | (1 << 4):
+	case DMALPEND | (1 << 4) | 0x1:
+	case DMALPEND | (1 << 4) | 0x3:
+	case DMALPEND | (1 << 4) | (1 << 2):
+	case DMALPEND | (1 << 4) | (1 << 2) | 0x1:
+	case DMALPEND | (1 << 4) | (1 << 2) | 0x3:
+		reg = &ch->lc[(ins[0] >> 2) & 0x1];
+		if(!cond_holds(ch, ins[0]) || !*reg) {
+			return DMALPEND_SIZE;
+		}
+		(*reg)--;
+		// back to the first instruction of the loop
+		ch->pc -= ins[1];
+		return STEP_JUMP;
+	case DMALPEND:
+	case DMALPEND | (1 << 2):
+		// loop forever, until DMAKILL
+		ch->pc -= ins[1];
+		return STEP_JUMP;
+	case DMASEV:
+		raise_event(ch->model, ins[1] >> 3);
+		return DMASEV_SIZE;
+	case DMAWFE:
+		wait_event(ch, ins[1] >> 3);
+		return DMAWFE_SIZE;
+	case DMAWFP:
+	case DMAWFP | 0x1:
+	case DMAWFP | (1 << 1):
+		wait_periph(ch, ins[0], ins[1] >> 3);
+		return DMAWFP_SIZE;
+	case DMALDP:
+	case DMALDP | (1 << 1):
+		if(cond_holds(ch, ins[0])) {
+			if(do_load(ch)) {
+				return -1;
+			}
+			ack_periph(ch, ins[1] >> 3);
+		}
+		return DMALDP_SIZE;
+	case DMASTP:
+	case DMASTP | (1 << 1):
+		if(cond_holds(ch, ins[0])) {
+			if(do_store(ch)) {
+				return -1;
+			}
+			ack_periph(ch, ins[1] >> 3);
+		}
+		return DMASTP_SIZE;
+	case DMAFLUSHP:
+		// the requests of the model are never stale
+		return DMAFLUSHP_SIZE;
+	case DMAADDH:
+	case DMAADDH | (1 << 1):
+	case DMAADNH:
+	case DMAADNH | (1 << 1):
+		reg = ins[0] & (1 << 1) ? &ch->dar : &ch->sar;
+		imm = ins[1] | (ins[2] << 8);
+		// DMAADNH extends the immediate with ones, a negative value
+		*reg += (ins[0] & ~(1 << 1)) == DMAADNH ? 0xffff0000 | imm : imm;
+		return DMAADDH_SIZE;
+	case DMAMOV:
+		switch(ins[1]) {
+		case _SAR:
+			ch->sar = *((uint *)&ins[2]);
+			break;
+		case _CCR:
+			ch->ccr = *((uint *)&ins[2]);
+			break;
+		case _DAR:
+			ch->dar = *((uint *)&ins[2]);
+			break;
+		default:
+			return -1;
+		}
+		return DMAMOV_SIZE;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * instruction size from its first byte
+ * */
+static uint ins_size(uchar ins)
+{
+	switch(ins) {
+	case DMAMOV:
+		return DMAMOV_SIZE;
+	case DMAGO:
+	case DMAGO | (1 << 1):
+		return DMAGO_SIZE;
+	case DMAADDH:
+	case DMAADDH | (1 << 1):
+	case DMAADNH:
+	case DMAADNH | (1 << 1):
+		return DMAADDH_SIZE;
+	}
+
+	if((ins & 0xe0) == 0x20 || ins == DMASEV) {
+		// loops, events and peripheral instructions
+		return 2;
+	}
+
+	return 1;
+}
+
+static void run_program(struct model_channel *ch)
+{
+	struct pl330_model *model = ch->model;
+	uchar *ins;
+	int ret;
+
+	ch->fifo_head = ch->fifo_cnt = 0;
+	ch->req_flag = SINGLE;
+	ch->prog_win.len = ch->data_win.len = 0;
+
+	while(1) {
+		if(__atomic_load_n(&ch->kill, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		ins = translate(model, &ch->prog_win, ch->pc, 1);
+		if(ins) {
+			ins = translate(model, &ch->prog_win, ch->pc,
+							ins_size(ins[0]));
+		}
+		if(!ins) {
+			set_state(ch, FAULTING);
+			break;
+		}
+
+		ret = step(ch, ins);
+		if(ret < 0) {
+			set_state(ch, FAULTING);
+			break;
+		}
+		if(!ret) {
+			set_state(ch, STOPPED);
+			break;
+		}
+		if(ret == STEP_JUMP) {
+			continue;
+		}
+		ch->pc += ret;
+	}
+
+	set_reg(model, SAR(ch->id), ch->sar);
+	set_reg(model, DAR(ch->id), ch->dar);
+	set_reg(model, CCR(ch->id), ch->ccr);
+	set_reg(model, LC0(ch->id), ch->lc[0]);
+	set_reg(model, LC1(ch->id), ch->lc[1]);
+	set_reg(model, CPC(ch->id), ch->pc);
+
+	if(__atomic_load_n(&ch->kill, __ATOMIC_ACQUIRE)) {
+		set_state(ch, STOPPED);
+	}
+}
+
+static void *channel_thread_func(void *arg)
+{
+	struct model_channel *ch = arg;
+	struct pl330_model *model = ch->model;
+
+	pthread_mutex_lock(&model->lock);
+
+	while(1) {
+		while(!ch->go && !ch->exit) {
+			pthread_cond_wait(&model->cond, &model->lock);
+		}
+		if(ch->exit) {
+			break;
+		}
+		ch->go = false;
+
+		pthread_mutex_unlock(&model->lock);
+		run_program(ch);
+		pthread_mutex_lock(&model->lock);
+	}
+
+	pthread_mutex_unlock(&model->lock);
+
+	return NULL;
+}
+
+/*
+ * instruction written in DBGINST0/1, executed when DBGCMD is written
+ * */
+static void exec_debug(struct pl330_model *model)
+{
+	uint inst0 = get_reg(model, DBGINST0);
+	uint inst1 = get_reg(model, DBGINST1);
+	uchar ins = (inst0 >> 16) & 0xff;
+	uchar chan_id = (inst0 >> 24) & 0x7;
+	struct model_channel *ch;
+
+	if(inst0 & (1 << 0)) {
+		// channel thread, only DMAKILL is allowed
+		chan_id = (inst0 >> 8) & 0x7;
+		if(ins != DMAKILL || chan_id >= model->num_channels) {
+			return;
+		}
+		ch = &model->chans[chan_id];
+		__atomic_store_n(&ch->kill, true, __ATOMIC_RELEASE);
+		if(!ch->go && shift_and_mask(get_reg(model, CSR(chan_id)),
+				CSR_CHANNEL_STATUS_SH, CSR_CHANNEL_STATUS_MK)
+							== FAULTING) {
+			set_state(ch, STOPPED);
+		}
+		pthread_cond_broadcast(&model->cond);
+		return;
+	}
+
+	if((ins & ~(1 << 1)) != DMAGO || chan_id >= model->num_channels) {
+		return;
+	}
+
+	ch = &model->chans[chan_id];
+	if(shift_and_mask(get_reg(model, CSR(chan_id)), CSR_CHANNEL_STATUS_SH,
+				CSR_CHANNEL_STATUS_MK) != STOPPED) {
+		return;
+	}
+
+	ch->pc = inst1;
+	ch->kill = false;
+	ch->go = true;
+	set_state(ch, EXECUTING);
+	pthread_cond_broadcast(&model->cond);
+}
+
+void pl330_model_reg_write(struct pl330_model *model, uint offset, uint val)
+{
+	uint ris;
+
+	pthread_mutex_lock(&model->lock);
+
+	switch(offset) {
+	case DBGCMD:
+		exec_debug(model);
+		break;
+	case INTCLR:
+		ris = get_reg(model, INT_EVENT_RIS) &
+				~(val & get_reg(model, INTEN));
+		set_reg(model, INT_EVENT_RIS, ris);
+		set_reg(model, INTMIS, ris & get_reg(model, INTEN));
+		break;
+	case INTEN:
+		set_reg(model, INTEN, val);
+		set_reg(model, INTMIS, get_reg(model, INT_EVENT_RIS) & val);
+		break;
+	default:
+		set_reg(model, offset, val);
+		break;
+	}
+
+	pthread_mutex_unlock(&model->lock);
+}
+
+struct pl330_model *pl330_model_create(struct pl330_iommu *mmu,
+						uint num_channels)
+{
+	struct pl330_model *model;
+	uint i, width;
+
+	if(!num_channels || num_channels > MODEL_NUM_CHANNELS) {
+		return NULL;
+	}
+
+	model = malloc(sizeof(*model));
+	if(!model) {
+		return NULL;
+	}
+	memset(model, 0, sizeof(*model));
+
+	model->mmu = mmu;
+	model->num_channels = num_channels;
+	model->fifo_size = MODEL_BUF_DEPTH * MODEL_BUS_WIDTH / 8;
+	pthread_mutex_init(&model->lock, NULL);
+	pthread_cond_init(&model->cond, NULL);
+
+	for(width = 0; (8 << width) < MODEL_BUS_WIDTH; width++) {
+		;
+	}
+
+	set_reg(model, CR(0), CR0_PERIF_REQ_SUPP |
+			((num_channels - 1) << CR0_NUM_CHANNELS_SH) |
+			((MODEL_NUM_PERIPHS - 1) << CR0_NUM_PERIF_REQ_SH) |
+			((MODEL_NUM_EVENTS - 1) << CR0_NUM_EVENT_SHIFT));
+	set_reg(model, CRD, (width << CRD_BUS_WIDTH_SHIFT) |
+			((MODEL_BUF_DEPTH - 1) << CRD_BUF_DEPTH_SHIFT));
+
+	for(i = 0; i < MODEL_NUM_EVENTS; i++) {
+		model->irq_efd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(model->irq_efd[i] < 0) {
+			error(-1, errno, "model: unable to create eventfd");
+		}
+	}
+
+	for(i = 0; i < num_channels; i++) {
+		struct model_channel *ch = &model->chans[i];
+
+		ch->model = model;
+		ch->id = i;
+		ch->fifo = malloc(model->fifo_size);
+		set_state(ch, STOPPED);
+
+		if(pthread_create(&ch->thread, NULL, channel_thread_func, ch)) {
+			error(-1, errno, "model: unable to create channel thread");
+		}
+	}
+
+	return model;
+}
+
+void pl330_model_destroy(struct pl330_model *model)
+{
+	uint i;
+
+	pthread_mutex_lock(&model->lock);
+	for(i = 0; i < model->num_channels; i++) {
+		model->chans[i].exit = true;
+		__atomic_store_n(&model->chans[i].kill, true, __ATOMIC_RELEASE);
+	}
+	pthread_cond_broadcast(&model->cond);
+	pthread_mutex_unlock(&model->lock);
+
+	for(i = 0; i < model->num_channels; i++) {
+		pthread_join(model->chans[i].thread, NULL);
+		free(model->chans[i].fifo);
+	}
+
+	for(i = 0; i < MODEL_NUM_EVENTS; i++) {
+		close(model->irq_efd[i]);
+	}
+
+	free(model);
+}
+
+uchar *pl330_model_regs(struct pl330_model *model)
+{
+	return (uchar *)model->regs;
+}
+
+void pl330_model_periph_request(struct pl330_model *model, uint periph,
+								bool burst)
+{
+	if(periph >= MODEL_NUM_PERIPHS) {
+		return;
+	}
+
+	pthread_mutex_lock(&model->lock);
+	model->periph_reqs[periph]++;
+	model->periph_burst[periph] = burst;
+	pthread_cond_broadcast(&model->cond);
+	pthread_mutex_unlock(&model->lock);
+}
+
+int pl330_model_irq_eventfd(struct pl330_model *model, uint event)
+{
+	if(event >= MODEL_NUM_EVENTS) {
+		return -1;
+	}
+
+	return model->irq_efd[event];
+}
@@ -0,0 +1,71 @@
+#ifndef PL330_MODEL_H
+#define PL330_MODEL_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+#include "pl330_vfio_dma.h"
+
+/*
+ * Software model of the PL330
+ *
+ * The model provides a register block that takes the place of the
+ * VFIO mmap of the device (see pl330_vfio_init_model()). Instructions
+ * written to the debug interface are executed right away; every channel
+ * started by DMAGO runs its program on a thread of its own, fetching the
+ * microcode and moving the data through the IOVAs of mmu.
+ *
+ * Events with their interrupt enabled in INTEN write to the eventfd of
+ * their irq line, to be added with pl330_vfio_add_irq().
+ *
+ * Peripherals are request lines only: whoever plays the device posts
+ * its requests with pl330_model_periph_request(), the data goes to and
+ * from the IOVA the program uses as device address.
+ *
+ * Events without their interrupt enabled stay active in INT_EVENT_RIS
+ * until a DMAWFE waiting for them clears them.
+ *
+ * Supported instructions: DMAMOV, DMALP, DMALPEND, DMALD, DMAST,
+ * DMARMB, DMAWMB, DMANOP, DMASEV, DMAWFE, DMAEND, DMAKILL, DMAWFP,
+ * DMALDP, DMASTP, DMAFLUSHP, DMAADDH, DMAADNH. Anything else moves the
+ * channel to the faulting state.
+ * */
+
+#define MODEL_NUM_CHANNELS	8
+#define MODEL_NUM_EVENTS	32
+#define MODEL_NUM_PERIPHS	32
+#define MODEL_BUS_WIDTH		64 // bits
+#define MODEL_BUF_DEPTH		64 // lines of the MFIFO
+#define MODEL_REGS_SIZE		0x1000
+
+struct pl330_model;
+
+struct pl330_model *pl330_model_create(struct pl330_iommu *mmu,
+						__u32 num_channels);
+void pl330_model_destroy(struct pl330_model *model);
+
+/*
+ * base of the register block
+ * */
+__u8 *pl330_model_regs(struct pl330_model *model);
+
+/*
+ * eventfd of the irq line of event
+ * */
+int pl330_model_irq_eventfd(struct pl330_model *model, __u32 event);
+
+/*
+ * the peripheral asks for a transfer: a DMAWFP waiting for periph
+ * returns, the DMALDP/DMASTP that follows acknowledges the request.
+ * Requests add up, DMAFLUSHP doesn't drop them.
+ * */
+void pl330_model_periph_request(struct pl330_model *model, __u32 periph,
+								bool burst);
+
+/*
+ * every register write of the driver goes through here
+ * */
+void pl330_model_reg_write(struct pl330_model *model, __u32 offset,
+							__u32 val);
+
+#endif
@@ -0,0 +1,176 @@
+#include "pl330_trace.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+
+#define RING_MASK	(PL330_TRACE_RING_LEN - 1)
+
+/*
+ * ring of a thread, written by its thread only. head counts the
+ * records ever written, the last PL330_TRACE_RING_LEN are in recs
+ * */
+struct trace_buf {
+	struct trace_buf *next;
+	__u32 tid;
+	__u64 head;
+	struct pl330_trace_rec recs[PL330_TRACE_RING_LEN];
+};
+
+bool pl330_trace_on;
+
+// rings of all the threads, pushed without locks and never removed
+static struct trace_buf *buffers;
+static __thread struct trace_buf *own;
+
+static __u8 next_ctrl;
+
+void pl330_trace_enable(bool on)
+{
+	__atomic_store_n(&pl330_trace_on, on, __ATOMIC_RELAXED);
+}
+
+__u8 pl330_trace_ctrl_id(void)
+{
+	return __atomic_fetch_add(&next_ctrl, 1, __ATOMIC_RELAXED);
+}
+
+static struct trace_buf *new_buf(void)
+{
+	struct trace_buf *buf;
+
+	buf = calloc(1, sizeof(*buf));
+	if(!buf) {
+		return NULL;
+	}
+	buf->tid = syscall(SYS_gettid);
+
+	buf->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&buffers, &buf->next, buf, true,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return buf;
+}
+
+void pl330_trace_record(enum pl330_trace_type type, __u8 ctrl, __u8 chan,
+								__u32 arg)
+{
+	struct pl330_trace_rec *rec;
+	struct timespec ts;
+	__u64 head;
+
+	if(!own) {
+		own = new_buf();
+		// nothing is recorded by this thread without memory
+		if(!own) {
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	head = own->head;
+	rec = &own->recs[head & RING_MASK];
+	rec->ns = (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->arg = arg;
+	rec->type = type;
+	rec->ctrl = ctrl;
+	rec->chan = chan;
+	rec->pad = 0;
+
+	// the dump reads the records before head
+	__atomic_store_n(&own->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * copy the records of buf to recs, oldest first. The thread may go on
+ * writing: the records it may have overwritten meanwhile, those
+ * PL330_TRACE_RING_LEN before its head once the copy is done, are
+ * dropped. Returns the records copied
+ * */
+static __u32 copy_ring(struct trace_buf *buf, struct pl330_trace_rec *recs)
+{
+	__u64 first, last, i, valid;
+
+	last = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+	first = last > PL330_TRACE_RING_LEN ? last - PL330_TRACE_RING_LEN : 0;
+
+	for(i = first; i < last; i++) {
+		recs[i - first] = buf->recs[i & RING_MASK];
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	valid = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+	// the record at valid may be half written over valid - LEN
+	valid = valid >= PL330_TRACE_RING_LEN ?
+				valid - PL330_TRACE_RING_LEN + 1 : 0;
+	if(valid > first) {
+		if(valid > last) {
+			valid = last;
+		}
+		memmove(recs, recs + (valid - first),
+				(last - valid) * sizeof(*recs));
+		first = valid;
+	}
+
+	return last - first;
+}
+
+int pl330_trace_dump(const char *path)
+{
+	struct pl330_trace_header header;
+	struct pl330_trace_thread thread;
+	struct pl330_trace_rec *recs;
+	struct trace_buf *list, *buf;
+	FILE *out;
+	int ret = -1;
+
+	recs = malloc(PL330_TRACE_RING_LEN * sizeof(*recs));
+	if(!recs) {
+		return -1;
+	}
+
+	out = fopen(path, "w");
+	if(!out) {
+		free(recs);
+		return -1;
+	}
+
+	// the threads that start tracing from now on are left out
+	list = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+
+	memcpy(header.magic, PL330_TRACE_MAGIC, sizeof(header.magic));
+	header.num_threads = 0;
+	header.rec_size = sizeof(struct pl330_trace_rec);
+	for(buf = list; buf; buf = buf->next) {
+		header.num_threads++;
+	}
+	if(fwrite(&header, sizeof(header), 1, out) != 1) {
+		goto out;
+	}
+
+	for(buf = list; buf; buf = buf->next) {
+		thread.tid = buf->tid;
+		thread.count = copy_ring(buf, recs);
+		if(fwrite(&thread, sizeof(thread), 1, out) != 1 ||
+				fwrite(recs, sizeof(*recs), thread.count,
+						out) != thread.count) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	if(fclose(out)) {
+		ret = -1;
+	}
+	free(recs);
+
+	return ret;
+}
@@ -0,0 +1,107 @@
+#ifndef PL330_TRACE_H
+#define PL330_TRACE_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+/*
+ * Event trace
+ *
+ * Every thread records the events of the driver in a ring of its
+ * own, without locks: fixed size binary records with a CLOCK_MONOTONIC
+ * timestamp. The ring keeps the last PL330_TRACE_RING_LEN records of
+ * the thread, the older ones are overwritten. pl330_trace_dump() writes
+ * the rings of all the threads to a file, pl330_trace2json turns it
+ * into the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+ *
+ * The hooks are compiled in with PL330_TRACE only (make TRACE=1), even
+ * then nothing is recorded until pl330_trace_enable(true): a disabled
+ * hook costs a relaxed load and a branch.
+ * */
+
+#define PL330_TRACE_RING_LEN	(1 << 16) // records, power of 2
+
+// chan of the events not bound to a channel
+#define PL330_TRACE_NO_CHAN	0xff
+
+enum pl330_trace_type {
+	PL330_TRACE_GEN_BEGIN = 1,	// program generation
+	PL330_TRACE_GEN_END,		// arg: program length, < 0 failed
+	PL330_TRACE_GO,			// DMAGO, arg: IOVA of the program
+	PL330_TRACE_CHUNK,		// chunk done, arg: size of the next
+	PL330_TRACE_DONE,		// request done, arg: bytes
+	PL330_TRACE_IRQ,		// irq thread wakeup, arg: ready lines
+	PL330_TRACE_INTCLR,		// arg: events cleared
+	PL330_TRACE_CB_BEGIN,		// completion callback
+	PL330_TRACE_CB_END,
+};
+
+struct pl330_trace_rec {
+	__u64 ns;
+	__u32 arg;
+	__u8 type;
+	__u8 ctrl; // see pl330_trace_ctrl_id()
+	__u8 chan;
+	__u8 pad;
+};
+
+/*
+ * dump file, host byte order: the header, then for every thread a
+ * pl330_trace_thread followed by its count records, oldest first
+ * */
+#define PL330_TRACE_MAGIC	"PL330TR1"
+
+struct pl330_trace_header {
+	char magic[8];
+	__u32 num_threads;
+	__u32 rec_size;
+};
+
+struct pl330_trace_thread {
+	__u32 tid;
+	__u32 count;
+};
+
+extern bool pl330_trace_on;
+
+static inline bool pl330_trace_enabled(void)
+{
+	return __builtin_expect(__atomic_load_n(&pl330_trace_on,
+						__ATOMIC_RELAXED), 0);
+}
+
+void pl330_trace_enable(bool on);
+
+/*
+ * id of a new controller for the ctrl field of its events
+ * */
+__u8 pl330_trace_ctrl_id(void);
+
+void pl330_trace_record(enum pl330_trace_type type, __u8 ctrl, __u8 chan,
+								__u32 arg);
+
+/*
+ * write the records of all the threads to path, also of the threads
+ * that have exited. The records overwritten while dumping are left
+ * out. Returns -1 on failure
+ * */
+int pl330_trace_dump(const char *path);
+
+#ifdef PL330_TRACE
+#define PL330_TRACE_EVENT(type, ctrl, chan, arg)			\
+	do {								\
+		if(pl330_trace_enabled()) {				\
+			pl330_trace_record(type, ctrl, chan, arg);	\
+		}							\
+	} while(0)
+#else
+// variables only traced are not unused without the trace
+#define PL330_TRACE_EVENT(type, ctrl, chan, arg)			\
+	do {								\
+		(void)(ctrl);						\
+		(void)(chan);						\
+		(void)(arg);						\
+	} while(0)
+#endif
+
+#endif
@@ -1,7 +1,11 @@
 #include "pl330_vfio.h"
+#include "pl330_model.h"
+#include "pl330_disasm.h"
+#include "pl330_trace.h"
 
 #include <linux/types.h>
 #include <errno.h>
+#include <error.h>
 #include <linux/vfio.h>
 #include <poll.h>
 
@@ -10,35 +14,251 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/mman.h>
 #include <sys/eventfd.h>
 #include <sys/fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <time.h>
+
+/*
+ * the controller has an interrupt line for every event
+ * */
+#define MAX_IRQ_LINES		32
+
+struct irq_line {
+	int eventfd;
+	int irq_index; // vfio irq index
+};
+
+/*
+ * debug instructions of all the threads go through a ring: anyone
+ * pushes without locks, the thread holding dispatching writes them
+ * one at a time to the debug interface
+ * */
+#define DBG_RING_LEN		64 // power of 2
+
+struct dbg_cmd {
+	uint seq; // ticket + 1 when pushed, ticket + DBG_RING_LEN when free
+	uint thread_id;
+	uchar ins[6];
+};
+
+struct dbg_ring {
+	struct dbg_cmd cmds[DBG_RING_LEN];
+	uint tail; // next ticket
+	uint head; // next to dispatch, owned by the dispatcher
+	uint done; // tickets before done have been executed
+	bool dispatching;
+};
+
+/*
+ * microcode buffers mapped once and handed out one per request
+ * */
+struct cmds_pool {
+	struct pl330_iommu *mmu;
+	struct pl330_dma_buf buf;
+	uchar *mem;
+	u64 iova;
+	uint slot_size;
+	uint num_slots;
+
+	// stack of the free slots
+	int *free_slots;
+	uint num_free;
+	pthread_mutex_t lock;
+};
+
+/*
+ * where the fields that change between two requests with
+ * the same shape are stored inside a program
+ * */
+struct prog_relocs {
+	uint sar_off; // immediate of DMAMOV SAR
+	uint dar_off; // immediate of DMAMOV DAR
+	int sev_off;  // event byte of DMASEV, -1 if there is none
+	int wfe_off;  // event byte of the DMAWFE of wait_event, or -1
+	int signal_off; // event byte of the DMASEV of signal_event, or -1
+};
+
+/*
+ * Program cache
+ *
+ * Requests with the same shape produce the same program, apart from
+ * the SAR/DAR immediates and the event number. The first program of
+ * a shape is kept as a template together with the position of those
+ * fields, the following ones are copied from the template and patched.
+ *
+ * Every controller has its own cache (struct pl330_status), without a
+ * lock: an entry is a seqlock. A reader copies it and checks that its
+ * sequence didn't move, a writer makes the sequence odd while it
+ * replaces the entry and gives up if another writer already did.
+ * */
+#define PROG_CACHE_SIZE		64 // power of 2
+#define PROG_TEMPLATE_MAX_LEN	256
+
+struct prog_shape {
+	uint ccr;
+	u64 size;
+	uint rows;
+	uint src_stride;
+	uint dst_stride;
+	uint head_align; // the head of the program depends on it
+	uint burst_size;
+	uint burst_len;
+	enum transfer_type t_type;
+	uint periph_id;
+	enum request_type req_type;
+	bool int_fin;
+	bool waits;
+	bool signals;
+};
+
+struct prog_template {
+	uint seq; // odd while the entry is replaced
+	struct prog_shape shape;
+	uint len; // 0 if the entry is empty
+	struct prog_relocs relocs;
+	uchar cmds[PROG_TEMPLATE_MAX_LEN];
+};
+
+/*
+ * configuration of the controller, read at init
+ * */
+struct CR0_conf {
+	bool perif_req_support;
+	uint num_channels;
+	uint num_perif_req;
+	uint num_events;
+};
+
+struct CRD_conf {
+	uint bus_width; // bits
+	uint buf_depth; // lines of the MFIFO, bus_width bits each
+};
 
 struct pl330_status {
 	uint channels; // # of channels available
+	struct CR0_conf cr0;
+	struct CRD_conf crd;
 	struct channel_thread *ch_threads;
 
 	/*
 	 * the controller supports 32 events.
 	 * The envent i is allocated if
-	 * allocated_events[i] == 1
+	 * allocated_events[i] == 1.
+	 * Channels and events are claimed with atomic operations on it,
+	 * the event i < channels goes with the channel i
 	 * */
 	uint allocated_events;
 
+	// INTEN is read-modify-written by many threads
+	pthread_mutex_t inten_lock;
+
+	/*
+	 * channel completed by each event, -1 if none. An interrupt
+	 * wakeup reads INTMIS once and dispatches all its events
+	 * */
+	int event_chan[MAX_IRQ_LINES];
+	// claims the events of INTMIS, see dispatch_irqs()
+	pthread_mutex_t irq_lock;
+
 	uchar * regs; // pointer to the first pl330 register
-	fd_set set_irq_efd;
-	int highest_irq_num;
+	// software model behind regs, NULL for the real device
+	struct pl330_model *model;
 	pthread_t irq_handler;
+	// set by pl330_vfio_start_irq_handler(), remove joins the thread
+	bool irq_handler_started;
+
 	/*
-	 * key is eventfd number
-	 * value is irqnumber
+	 * the irq lines added with pl330_vfio_add_irq(); the data of
+	 * every epoll event is the index of its line in irq_lines
 	 * */
-	GHashTable *efdnum_irqnum;
+	int epoll_fd;
+	struct irq_line irq_lines[MAX_IRQ_LINES];
+	uint num_irq_lines;
+
+	/*
+	 * tokens with notify done and not collected yet, the last done
+	 * first; completion_fd is signalled when the first is pushed
+	 * */
+	struct pl330_vfio_token *completed;
+	int completion_fd;
+
+	struct cmds_pool pool;
+
+	// templates of the programs, see generate_cmds()
+	struct prog_template prog_cache[PROG_CACHE_SIZE];
+
+	struct dbg_ring dbg;
+
+	struct pl330_vfio_stats stats;
+
+	uchar trace_id; // ctrl of the trace events
 };
 
-struct pl330_status *status = NULL;
+
+/*
+ * the registers are MMIO, every access has to reach the device
+ * */
+static inline uint reg_read(struct pl330_status *status, uint offset)
+{
+	return *((volatile uint *)(status->regs + offset));
+}
+
+static inline void reg_write(struct pl330_status *status, uint offset, uint val)
+{
+	if(status->model) {
+		pl330_model_reg_write(status->model, offset, val);
+		return;
+	}
+
+	*((volatile uint *)(status->regs + offset)) = val;
+}
+
+static void update_inten(struct pl330_status *status, uint set, uint clear)
+{
+	pthread_mutex_lock(&status->inten_lock);
+	reg_write(status, INTEN, (reg_read(status, INTEN) & ~clear) | set);
+	pthread_mutex_unlock(&status->inten_lock);
+}
+
+static inline u64 now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * the stats are only added to, a relaxed atomic is enough
+ * */
+#define STAT_ADD(counter, n)	__atomic_fetch_add(&(counter), (n), \
+							__ATOMIC_RELAXED)
+#define STAT_INC(counter)	STAT_ADD(counter, 1)
+
+/*
+ * event of the trace, see pl330_trace.h
+ * */
+#define TRACE(status, type, chan, arg)					\
+	PL330_TRACE_EVENT(PL330_TRACE_##type, (status)->trace_id,	\
+							(chan), (arg))
+
+static inline void stat_latency(u64 *hist, u64 ns)
+{
+	uint bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if(bucket >= PL330_STATS_BUCKETS) {
+		bucket = PL330_STATS_BUCKETS - 1;
+	}
+	STAT_INC(hist[bucket]);
+}
 
 static int pl330_set_burst_size(uint val, enum dst_src type, uint *reg)
 {
@@ -55,8 +275,10 @@ static int pl330_set_burst_size(uint val, enum dst_src type, uint *reg)
 	switch(type){
 	case SRC:
 		*reg |= ret << CCR_SRCBURSTSIZE_SHIFT;
+		break;
 	case DST:
 		*reg |= ret << CCR_DSTBURSTSIZE_SHIFT;
+		break;
 	default:
 		return -1;
 	}
@@ -73,8 +295,10 @@ static int pl330_set_burst_length(uint val, enum dst_src type, uint *reg)
 	switch(type) {
 	case SRC:
 		*reg |= (val - 1) << CCR_SRCBURSTLEN_SHIFT;
+		break;
 	case DST:
 		*reg |= (val - 1) << CCR_DSTBURSTLEN_SHIFT;
+		break;
 	default:
 		return -1;
 	}
@@ -88,18 +312,11 @@ static void pl330_vfio_req_config_init(struct req_config *config)
 	config->config_ops.set_burst_length = pl330_set_burst_length;
 }
 
-struct CR0_conf {
-	bool perif_req_support;
-	uint num_channels;
-	uint num_perif_req;
-	uint num_events;
-};
-
-static void CR0_read_conf(struct CR0_conf *conf)
+static void CR0_read_conf(struct pl330_status *status, struct CR0_conf *conf)
 {
 	uint cr0_reg;
 
-	cr0_reg = *((uint *)(status->regs + CR(0)));
+	cr0_reg = reg_read(status, CR(0));
 
 	conf->perif_req_support = (cr0_reg & CR0_PERIF_REQ_SUPP) ? true : false;
 
@@ -113,16 +330,11 @@ static void CR0_read_conf(struct CR0_conf *conf)
 			CR0_NUM_EVENT_SHIFT, CR0_NUM_EVENT_MASK) + 1;
 }
 
-struct CRD_conf {
-	uint bus_width;
-	uint buf_depth;
-};
-
-static void CRD_read_conf(struct CRD_conf *conf)
+static void CRD_read_conf(struct pl330_status *status, struct CRD_conf *conf)
 {
 	uint crd_reg, tmp;
 
-	crd_reg = *((uint *)(status->regs + CRD));
+	crd_reg = reg_read(status, CRD);
 
 	tmp = shift_and_mask(crd_reg,
 			CRD_BUS_WIDTH_SHIFT, CRD_BUS_WIDTH_MASK);
@@ -177,8 +389,11 @@ static inline uint insert_DMAMOV(uchar *buffer, enum DMAMOV_type type,
 	return DMAMOV_SIZE;
 }
 
+/*
+ * count is 1:256, the register holds count - 1
+ * */
 static inline uint insert_DMALP(uchar *buffer, enum DMA_LOOP_REGISTER type,
-		uchar count)
+		uint count)
 {
 	switch(type) {
 		case LOOP_CNT_0_REG:
@@ -215,13 +430,15 @@ static inline uint insert_DMALPEND(uchar *buffer, enum LOOP_START_TYPE type,
 			// set by dmalp
 			buffer[0] |= 1 << 4;
 			// set dma loop register
-			buffer[0] |= type << 2;
+			buffer[0] |= args->loop_cnt_num << 2;
 
 			switch(args->type) {
 			case SINGLE:
 				buffer[0] |= (0 << 1) | (1 << 0);
+				break;
 			case BURST:
 				buffer[0] |= (1 << 1) | (1 << 0);
+				break;
 			case ALWAYS:
 				break;
 			default:
@@ -254,6 +471,64 @@ static inline uint insert_DMAST(uchar *buf)
 	return DMAST_SIZE;
 }
 
+static inline uint insert_DMAWFE(uchar *buf, uchar event)
+{
+	buf[0] = DMAWFE;
+	buf[1] = (event & 0x1f) << 3;
+
+	return DMAWFE_SIZE;
+}
+
+/*
+ * DMAWFP, DMALDP and DMASTP: type is SINGLE or BURST
+ * */
+static inline uint insert_DMAWFP(uchar *buf, enum request_type type,
+							uchar periph)
+{
+	buf[0] = DMAWFP | (type == BURST ? (1 << 1) : 0);
+	buf[1] = (periph & 0x1f) << 3;
+
+	return DMAWFP_SIZE;
+}
+
+static inline uint insert_DMALDP(uchar *buf, enum request_type type,
+							uchar periph)
+{
+	buf[0] = DMALDP | (type == BURST ? (1 << 1) : 0);
+	buf[1] = (periph & 0x1f) << 3;
+
+	return DMALDP_SIZE;
+}
+
+static inline uint insert_DMASTP(uchar *buf, enum request_type type,
+							uchar periph)
+{
+	buf[0] = DMASTP | (type == BURST ? (1 << 1) : 0);
+	buf[1] = (periph & 0x1f) << 3;
+
+	return DMASTP_SIZE;
+}
+
+static inline uint insert_DMAFLUSHP(uchar *buf, uchar periph)
+{
+	buf[0] = DMAFLUSHP;
+	buf[1] = (periph & 0x1f) << 3;
+
+	return DMAFLUSHP_SIZE;
+}
+
+/*
+ * add imm to SAR (SRC) or DAR (DST)
+ * */
+static inline uint insert_DMAADDH(uchar *buf, enum dst_src type, uint imm)
+{
+	buf[0] = DMAADDH | (type == DST ? (1 << 1) : 0);
+	buf[1] = imm & 0xff;
+	buf[2] = (imm >> 8) & 0xff;
+
+	return DMAADDH_SIZE;
+}
+
 static inline uint insert_DMARMB(uchar *buf)
 {
 	buf[0] = DMARMB;
@@ -297,7 +572,8 @@ static inline uint insert_DMAKILL(uchar *buf)
 	return DMAKILL_SIZE;
 }
 
-static inline void submit_to_DBGINST(uchar *dbg_instrs, uint thread_id)
+static inline void submit_to_DBGINST(struct pl330_status *status,
+					uchar *dbg_instrs, uint thread_id)
 {
 	uint val;
 
@@ -307,33 +583,190 @@ static inline void submit_to_DBGINST(uchar *dbg_instrs, uint thread_id)
 		val |= (thread_id << 8);
 	}
 
-	*((uint *)(status->regs + DBGINST0)) = val;
+	reg_write(status, DBGINST0, val);
 
-	*((uint *)(status->regs + DBGINST1)) = *((uint *)&dbg_instrs[2]);
+	reg_write(status, DBGINST1, *((uint *)&dbg_instrs[2]));
 
 	// GO
-	*((uint *)(status->regs + DBGCMD)) = 0;
+	reg_write(status, DBGCMD, 0);
 }
 
-static bool is_dmac_idle()
+static bool is_dmac_idle(struct pl330_status *status)
 {
-	if (*((uint *)(status->regs + DBGSTATUS)) & DBG_BUSY_MASK) {
+	if (reg_read(status, DBGSTATUS) & DBG_BUSY_MASK) {
 		return false;
 	} else {
 		return true;
 	}
 }
 
-void pl330_vfio_init(uchar *base_regs)
+/*
+ * the debug interface stays busy only for the few cycles
+ * needed to execute the instruction, spin on it
+ * */
+static inline void wait_dmac_idle(struct pl330_status *status)
+{
+	while(!is_dmac_idle(status)) {
+		;
+	}
+}
+
+/*
+ * drain the debug ring unless another thread is doing it already
+ * */
+static void dispatch_debug(struct pl330_status *status)
 {
-	struct CRD_conf *crd_conf;
-	struct CR0_conf *cr0_conf;
-	int i;
+	struct dbg_ring *ring = &status->dbg;
+	struct dbg_cmd *cmd;
+
+	if(__atomic_load_n(&ring->dispatching, __ATOMIC_RELAXED) ||
+			__atomic_exchange_n(&ring->dispatching, true,
+							__ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	while(1) {
+		cmd = &ring->cmds[ring->head % DBG_RING_LEN];
+		if(__atomic_load_n(&cmd->seq, __ATOMIC_ACQUIRE) !=
+							ring->head + 1) {
+			break;
+		}
+
+		if(!is_dmac_idle(status)) {
+			STAT_INC(status->stats.dbg_busy);
+			wait_dmac_idle(status);
+		}
+		submit_to_DBGINST(status, cmd->ins, cmd->thread_id);
+
+		__atomic_store_n(&cmd->seq, ring->head + DBG_RING_LEN,
+							__ATOMIC_RELEASE);
+		ring->head++;
+		__atomic_store_n(&ring->done, ring->head, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&ring->dispatching, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * execute the debug instruction ins on thread_id, from any thread.
+ * Returns once it has been written to the debug interface: the caller
+ * goes on reading the state of the channel
+ * */
+static void debug_exec(struct pl330_status *status, uchar *ins, uint thread_id)
+{
+	struct dbg_ring *ring = &status->dbg;
+	struct dbg_cmd *cmd;
+	uint ticket;
+
+	ticket = __atomic_fetch_add(&ring->tail, 1, __ATOMIC_RELAXED);
+	cmd = &ring->cmds[ticket % DBG_RING_LEN];
+
+	// the ring is full, help to drain it
+	while(__atomic_load_n(&cmd->seq, __ATOMIC_ACQUIRE) != ticket) {
+		dispatch_debug(status);
+	}
+
+	memcpy(cmd->ins, ins, sizeof(cmd->ins));
+	cmd->thread_id = thread_id;
+	__atomic_store_n(&cmd->seq, ticket + 1, __ATOMIC_RELEASE);
+
+	while((int)(__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) -
+							ticket) <= 0) {
+		dispatch_debug(status);
+	}
+}
+
+static uint thread_state(struct pl330_status *status, uint id);
+
+/*
+ * spin until the channel stops executing its program,
+ * returns its final state
+ * */
+static uint wait_channel_stopped(struct pl330_status *status, uint chan)
+{
+	uint state;
+
+	do {
+		state = thread_state(status, chan);
+	} while(state != STOPPED && state != FAULTING &&
+			state != INVALID_STATE);
+
+	return state;
+}
+
+/*
+ * a program that raises no event may run to its DMAEND before its
+ * channel is first seen executing: after this long, a DMAGO still
+ * showing a stopped channel is taken as done
+ * */
+#define DMAGO_SETTLE_NS		10000
+
+/*
+ * wait for the DMAGO just written for chan_id to take effect: the
+ * manager has executed it once the debug interface is idle, then the
+ * channel leaves STOPPED, or has already raised the event of its
+ * DMASEV (the event of the channel, see generate_prog()). Before
+ * this, a poller reading the channel stopped would take the request
+ * as done
+ * */
+static void wait_go_taken(struct pl330_status *status, uint chan_id)
+{
+	u64 deadline;
+
+	wait_dmac_idle(status);
+
+	deadline = now_ns() + DMAGO_SETTLE_NS;
+	while(thread_state(status, chan_id) == STOPPED &&
+			!(reg_read(status, INT_EVENT_RIS) & (1U << chan_id)) &&
+			now_ns() < deadline) {
+		;
+	}
+}
+
+/*
+ * DMAGO the program at iova_cmds on channel chan_id, returns once the
+ * channel has started
+ * */
+static void start_channel(struct pl330_status *status, uint chan_id,
+							u64 iova_cmds)
+{
+	uchar ins_debug[6] = {0, 0, 0, 0, 0, 0};
+	bool non_secure = true;
+
+	insert_DMAGO(ins_debug, chan_id, iova_cmds, non_secure);
+
+	/*
+	 * the event of the previous program is raised by its DMASEV,
+	 * DMAGO is ignored until the DMAEND that follows it
+	 * */
+	wait_channel_stopped(status, chan_id);
+
+	debug_exec(status, ins_debug, MANAGER_ID);
+	wait_go_taken(status, chan_id);
+	STAT_INC(status->stats.chans[chan_id].dmagos);
+	TRACE(status, GO, chan_id, iova_cmds);
+}
+
+/*
+ * start_channel() for the first program of a request, submitted
+ * at submit_ns
+ * */
+static void start_request(struct pl330_status *status, uint chan,
+					u64 iova_cmds, u64 submit_ns)
+{
+	struct channel_thread *ch = &status->ch_threads[chan];
+
+	start_channel(status, chan, iova_cmds);
+
+	ch->go_ns = now_ns();
+	stat_latency(status->stats.chans[chan].submit_to_go,
+							ch->go_ns - submit_ns);
+}
 
-	crd_conf = malloc(sizeof(struct CRD_conf));
-	cr0_conf = malloc(sizeof(struct CR0_conf));
-	memset(crd_conf, 0, sizeof(struct CRD_conf));
-	memset(cr0_conf, 0, sizeof(struct CR0_conf));
+struct pl330_status *pl330_vfio_init(uchar *base_regs)
+{
+	struct pl330_status *status;
+	int i;
 
 	status = malloc(sizeof(struct pl330_status));
 
@@ -346,54 +779,94 @@ void pl330_vfio_init(uchar *base_regs)
 
 	status->regs = base_regs;
 
-	FD_ZERO(&status->set_irq_efd);
-	status->highest_irq_num = 0;
-	status->efdnum_irqnum = g_hash_table_new_full(g_int_hash, g_int_equal,
-								free, free);
+	status->irq_handler_started = false;
+	status->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(status->epoll_fd < 0) {
+		error(-1, errno, "unable to create epoll instance");
+	}
+	status->num_irq_lines = 0;
+
+	status->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(status->completion_fd < 0) {
+		error(-1, errno, "unable to create the completion eventfd");
+	}
 
 	status->allocated_events = 0;
+	status->trace_id = pl330_trace_ctrl_id();
+	pthread_mutex_init(&status->irq_lock, NULL);
+	pthread_mutex_init(&status->inten_lock, NULL);
+
+	for(i = 0; i < DBG_RING_LEN; i++) {
+		status->dbg.cmds[i].seq = i;
+	}
 
-	// grab number of channels available
-	CRD_read_conf(crd_conf);
-	CR0_read_conf(cr0_conf);
+	// grab number of channels, AXI bus width and MFIFO depth
+	CRD_read_conf(status, &status->crd);
+	CR0_read_conf(status, &status->cr0);
 
-	status->channels = cr0_conf->num_channels;
+	status->channels = status->cr0.num_channels;
 	printf("device init, num channel: %d\n", status->channels);
+	DEBUG_MSG("bus width: %u bits, MFIFO depth: %u lines, events: %u\n",
+			status->crd.bus_width, status->crd.buf_depth,
+			status->cr0.num_events);
 
 	status->ch_threads = malloc(status->channels*sizeof(struct channel_thread));
-	struct channel_thread free_state = {FREE, -1};
+	memset(status->ch_threads, 0,
+			status->channels*sizeof(struct channel_thread));
 	for(i = 0; i < status->channels; i++) {
-		status->ch_threads[i] = free_state;
+		status->ch_threads[i].state = FREE;
+		status->ch_threads[i].event_id = -1;
+		status->ch_threads[i].slot = -1;
+		pthread_mutex_init(&status->ch_threads[i].lock, NULL);
+	}
+
+	// every channel signals its completion on the event of its number
+	for(i = 0; i < MAX_IRQ_LINES; i++) {
+		status->event_chan[i] = i < status->channels ? i : -1;
 	}
-	// grab AXI master interface bus configuration TODO
-	// grab device buffer length TODO
+
+	return status;
+}
+
+struct pl330_status *pl330_vfio_init_model(struct pl330_model *model)
+{
+	struct pl330_status *status;
+
+	status = pl330_vfio_init(pl330_model_regs(model));
+	status->model = model;
+
+	return status;
 }
 
 /*
  * add new irq to the triggering set.
  * vfio_irq_index is not the irq hw number
  * */
-int pl330_vfio_add_irq(int eventfd_irq, int vfio_irq_index)
+int pl330_vfio_add_irq(struct pl330_status *status, int eventfd_irq,
+							int vfio_irq_index)
 {
-	int *efd_ptr = NULL;
-	int *irq_idx_ptr = NULL;
+	struct epoll_event ev;
+	uint line;
 
-	if(FD_ISSET(eventfd_irq, &(status->set_irq_efd))) {
+	if(status->num_irq_lines == MAX_IRQ_LINES ||
+			vfio_irq_index >= status->channels) {
 		return -1;
 	}
-	FD_SET(eventfd_irq, &status->set_irq_efd);
 
-	efd_ptr = malloc(sizeof(*efd_ptr));
-	*efd_ptr = eventfd_irq;
-	irq_idx_ptr = malloc(sizeof(*irq_idx_ptr));
-	*irq_idx_ptr = vfio_irq_index;
+	line = status->num_irq_lines;
+	status->irq_lines[line].eventfd = eventfd_irq;
+	status->irq_lines[line].irq_index = vfio_irq_index;
 
-	g_hash_table_insert(status->efdnum_irqnum, efd_ptr,
-						irq_idx_ptr);
+	ev.events = EPOLLIN;
+	ev.data.u32 = line;
 
-	if(eventfd_irq > status->highest_irq_num) {
-		status->highest_irq_num = eventfd_irq;
+	// fails also if the eventfd has already been added
+	if(epoll_ctl(status->epoll_fd, EPOLL_CTL_ADD, eventfd_irq, &ev)) {
+		return -1;
 	}
+	status->num_irq_lines++;
+
+	return 0;
 }
 
 static inline void pl330_vfio_build_CCR(uint * ccr, struct req_config *config)
@@ -414,35 +887,39 @@ static inline void pl330_vfio_build_CCR(uint * ccr, struct req_config *config)
 
 }
 
-static void pl330_vfio_dma_map_init(struct vfio_iommu_type1_dma_map *map,
-						u64 iova, u64 size)
+/*
+ * one burst. Device transfers wait for a request of type cond
+ * and acknowledge it on the device side
+ * */
+static void setup_load_store(uchar *buf, uint *offset,
+			struct req_config *config, enum request_type cond)
 {
-	map->argsz = sizeof(map);
-	map->vaddr = (u64)mmap(NULL, size, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	map->size = size;
-	map->iova = iova;
-	map->flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
-}
+	uchar periph = config->periph_id;
 
-static void setup_load_store(uchar *buf, uint *offset, enum transfer_type t_type)
-{
-	switch(t_type) {
+	switch(config->t_type) {
 	case MEM2MEM: // TODO handle different design revision
 		*offset += insert_DMALD(&buf[*offset]);
 		*offset += insert_DMARMB(&buf[*offset]);
 		*offset += insert_DMAST(&buf[*offset]);
 		*offset += insert_DMAWMB(&buf[*offset]);
 		break;
-	case MEM2DEV: // TODO
-	case DEV2MEM: // TODO
+	case MEM2DEV:
+		*offset += insert_DMAWFP(&buf[*offset], cond, periph);
+		*offset += insert_DMALD(&buf[*offset]);
+		*offset += insert_DMASTP(&buf[*offset], cond, periph);
+		break;
+	case DEV2MEM:
+		*offset += insert_DMAWFP(&buf[*offset], cond, periph);
+		*offset += insert_DMALDP(&buf[*offset], cond, periph);
+		*offset += insert_DMAST(&buf[*offset]);
+		break;
 	default:
 		error(-1, EINVAL, "setup_load_store");
 	}
 }
 
-static uint add_inner_outer_loops(uchar *buf, uint *offset, uint in_cnt,
-					uint out_cnt, enum transfer_type t_type)
+static void add_inner_outer_loops(uchar *buf, uint *offset, uint in_cnt,
+		uint out_cnt, struct req_config *config, enum request_type cond)
 {
 	int out_off, in_off = 0;
 	struct args_DMALPEND args;
@@ -461,13 +938,13 @@ static uint add_inner_outer_loops(uchar *buf, uint *offset, uint in_cnt,
 	/*
 	 * Load&Store operations
 	 * */
-	setup_load_store(buf, offset, t_type);
+	setup_load_store(buf, offset, config, cond);
 
 	// insert end of inner loop
 	args.type = ALWAYS;
 	args.loop_cnt_num = LOOP_CNT_0_REG;
 	args.backflip_jump = *offset - in_off;
-	*offset += insert_DMALPEND(&buf[*offset], LOOP_CNT_0_REG, &args);
+	*offset += insert_DMALPEND(&buf[*offset], BY_DMALP, &args);
 	DEBUG_MSG("        inner_loop_end:%u, backjmp: %d\n", *offset, args.backflip_jump);
 
 	if(out_cnt > 1) {
@@ -479,8 +956,12 @@ static uint add_inner_outer_loops(uchar *buf, uint *offset, uint in_cnt,
 	}
 }
 
-static int setup_req_loops(uchar *buf_cmds, uint *offset, uint burst_size, uint burst_len, uint size,
-								enum transfer_type t_type)
+/*
+ * loops moving burst_count bursts with the current CCR
+ * */
+static void setup_req_loops(uchar *buf_cmds, uint *offset,
+			unsigned long burst_count, struct req_config *config,
+			enum request_type cond)
 {
 	/*
 	 * full loop means two nested loop of
@@ -491,16 +972,6 @@ static int setup_req_loops(uchar *buf_cmds, uint *offset, uint burst_size, uint
 
 	unsigned long remaining_burst = 0;
 
-	/*
-	 * size has to be aligned with the amount of data
-	 * moved every burst
-	 * */
-	if(size % (burst_size * burst_len)) {
-		return -1;
-	}
-	unsigned long burst_count = NUM_OF_BURST(size,
-				burst_len, burst_size);
-
 	DEBUG_MSG("set up loops:\n");
 	DEBUG_MSG("    burst_cnt:%lu\n", burst_count);
 
@@ -510,116 +981,1962 @@ static int setup_req_loops(uchar *buf_cmds, uint *offset, uint burst_size, uint
 	DEBUG_MSG("    full_loop_cnt:%u\n", full_loop_cnt);
 	DEBUG_MSG("    remaining_burst:%lu\n", remaining_burst);
 
+	/*
+	 * the outer loop counter runs the rows of a 2D transfer,
+	 * the bursts of a row go in blocks of 256
+	 * */
+	if(config->rows) {
+		while(burst_count) {
+			remaining_burst = burst_count < 256 ? burst_count : 256;
+			add_inner_outer_loops(buf_cmds, offset, remaining_burst,
+							0, config, cond);
+			burst_count -= remaining_burst;
+		}
+		return;
+	}
+
 	while(full_loop_cnt--) {
-		add_inner_outer_loops(buf_cmds, offset, 256, 256, t_type);
+		add_inner_outer_loops(buf_cmds, offset, 256, 256, config, cond);
 	}
 
 	// there could be n < 256*256 bursts left
-	// TODO add loop to handle more than one full loop
 	if(remaining_burst >= 256) {
-		add_inner_outer_loops(buf_cmds, offset, 256, remaining_burst/256, t_type);
+		add_inner_outer_loops(buf_cmds, offset, 256, remaining_burst/256,
+								config, cond);
 		remaining_burst %= 256;
 		DEBUG_MSG("    remaining_burst_1:%lu\n", remaining_burst);
 	}
 
 	// there could be n < 256 bursts left
 	if(remaining_burst) {
-		add_inner_outer_loops(buf_cmds, offset, remaining_burst, 0, t_type);
+		add_inner_outer_loops(buf_cmds, offset, remaining_burst, 0,
+								config, cond);
 	}
-
-	return 0;
 }
 
+// burst size and length fields of CCR, source and destination
+#define CCR_BURST_FIELDS	((0x7f << CCR_SRCBURSTSIZE_SHIFT) | \
+				(0x7f << CCR_DSTBURSTSIZE_SHIFT))
+
 /*
- * insert required commands to set up the request.
+ * CCR of a program: the fields of the request, the burst
+ * changes from a phase of the transfer to the other
  * */
-int generate_cmds_from_request(uchar *cmds_buf, struct req_config *config)
-{
-	uint offset = 0;
-
-	uint ccr_conf = 0;
-	pl330_vfio_build_CCR(&ccr_conf, config);
+struct prog_ccr {
+	uint base; // burst fields cleared
+	uint cur;  // last DMAMOV CCR, ~0 if none yet
+};
 
-	// add instructions to configure CCR, SAR and DAR
-	offset += insert_DMAMOV(cmds_buf, CCR, ccr_conf);
-	offset += insert_DMAMOV(&cmds_buf[offset], SAR, config->iova_src);
-	offset += insert_DMAMOV(&cmds_buf[offset], DAR, config->iova_dst);
+/*
+ * A transfer of any size from any address is split in
+ * 	head:	single bytes, up to the alignment of the burst size
+ * 	body:	full bursts
+ * 	tail:	single beats of the burst size, then single bytes
+ * */
+struct xfer_phases {
+	uint head;
+	unsigned long bursts;
+	uint beats;
+	uint tail;
+};
 
-	// set up loops, if any TODO handle src and dst burst size/length
-	if (setup_req_loops(cmds_buf, &offset, config->src_burst_size,
-			config->src_burst_len, config->size, config->t_type)) {
-		return -1;
-	}
+static void split_phases(struct xfer_phases *ph, u64 src, u64 size,
+				uint burst_size, uint burst_len)
+{
+	uint burst = burst_size * burst_len;
 
-	if(config->int_fin) {
-		// see the event enabled in enable_int_for_req()
-		offset += insert_DMASEV(&cmds_buf[offset], config->chan_id);
+	ph->head = (-src) & (burst_size - 1);
+	if(ph->head > size) {
+		ph->head = size;
 	}
+	size -= ph->head;
 
-	// terminate transaction
-	offset += insert_DMAEND(&cmds_buf[offset]);
+	ph->bursts = size / burst;
+	size %= burst;
+	ph->beats = size / burst_size;
+	ph->tail = size % burst_size;
 }
 
-
-int pl330_vfio_mem2mem_defconfig(struct req_config *config)
+static void setup_phase(uchar *buf_cmds, uint *offset, struct req_config *config,
+			struct prog_ccr *ccr, uint burst_size, uint burst_len,
+			unsigned long burst_count, enum request_type cond)
 {
-	pl330_vfio_req_config_init(config);
+	uint phase_ccr = ccr->base;
+
+	if(!burst_count) {
+		return;
+	}
+
+	config->config_ops.set_burst_size(burst_size, SRC, &phase_ccr);
+	config->config_ops.set_burst_length(burst_len, SRC, &phase_ccr);
+	config->config_ops.set_burst_size(burst_size, DST, &phase_ccr);
+	config->config_ops.set_burst_length(burst_len, DST, &phase_ccr);
+
+	if(phase_ccr != ccr->cur) {
+		*offset += insert_DMAMOV(&buf_cmds[*offset], CCR, phase_ccr);
+		ccr->cur = phase_ccr;
+	}
+
+	setup_req_loops(buf_cmds, offset, burst_count, config, cond);
+}
+
+/*
+ * move size bytes from src to dst, SAR and DAR already set. Source
+ * and destination bursts are the same, see generate_prog()
+ * */
+static int setup_transfer(uchar *buf_cmds, uint *offset,
+			struct req_config *config, struct prog_ccr *ccr,
+			u64 src, u64 dst, u64 size)
+{
+	uint burst_size = config->src_burst_size;
+	uint burst_len = config->src_burst_len;
+	uint unit = 1; // beat of head and tail
+	struct xfer_phases ph;
+
+	if(!size || !burst_size || !burst_len) {
+		return -1;
+	}
+
+	if(config->t_type == MEM2MEM && !config->src_inc) {
+		/*
+		 * a fixed source is a pattern of burst_size bytes: head and
+		 * tail move beats as wide as dst and size allow, so that
+		 * every beat reads the pattern from its first byte, and align
+		 * the destination instead
+		 * */
+		unit = burst_size;
+		while((dst | size) & (unit - 1)) {
+			unit >>= 1;
+		}
+		split_phases(&ph, dst, size, burst_size, burst_len);
+		ph.head /= unit;
+		ph.tail /= unit;
+	} else if(config->t_type == MEM2MEM) {
+		split_phases(&ph, src, size, burst_size, burst_len);
+	} else {
+		// the device moves whole beats only, head and tail are empty
+		if((src | dst | size) & (burst_size - 1)) {
+			return -1;
+		}
+		// a beat per request
+		if(config->req_type == SINGLE) {
+			burst_len = 1;
+		}
+		split_phases(&ph, src, size, burst_size, burst_len);
+
+		// forget what the peripheral asked for before the transfer
+		*offset += insert_DMAFLUSHP(&buf_cmds[*offset],
+							config->periph_id);
+	}
+	DEBUG_MSG("phases: head %u, bursts %lu, beats %u, tail %u\n",
+				ph.head, ph.bursts, ph.beats, ph.tail);
+
+	setup_phase(buf_cmds, offset, config, ccr, unit, 1, ph.head, SINGLE);
+	setup_phase(buf_cmds, offset, config, ccr, burst_size, burst_len,
+					ph.bursts, config->req_type);
+	setup_phase(buf_cmds, offset, config, ccr, burst_size, 1, ph.beats,
+								SINGLE);
+	setup_phase(buf_cmds, offset, config, ccr, unit, 1, ph.tail, SINGLE);
+
+	return 0;
+}
+
+// the DMAADDH needed to skip gap bytes
+#define ROW_GAP_ADDH(gap)	(((gap) + 0xfffe) / 0xffff)
+
+/*
+ * bytes from the end of a row to the start of the next one, a fixed
+ * source has no stride. Returns -1 if a stride is shorter than a row
+ * */
+static int row_gaps(struct req_config *config, u64 *src_gap, u64 *dst_gap)
+{
+	*src_gap = 0;
+	if(config->src_inc) {
+		if(config->src_stride < config->size) {
+			return -1;
+		}
+		*src_gap = config->src_stride - config->size;
+	}
+
+	if(config->dst_stride < config->size) {
+		return -1;
+	}
+	*dst_gap = config->dst_stride - config->size;
+
+	return 0;
+}
+
+static void skip_row_gap(uchar *buf_cmds, uint *offset, enum dst_src type,
+								u64 gap)
+{
+	uint imm;
+
+	while(gap) {
+		imm = gap < 0xffff ? gap : 0xffff;
+		*offset += insert_DMAADDH(&buf_cmds[*offset], type, imm);
+		gap -= imm;
+	}
+}
+
+/*
+ * 2D transfer: a loop on the rows around the transfer of a row,
+ * repeated for every 256 rows. A row ends where the next starts
+ * but for the gap of the stride, skipped by DMAADDH
+ * */
+static int setup_rows(uchar *buf_cmds, uint *offset,
+			struct req_config *config, struct prog_ccr *ccr)
+{
+	uint burst_size = config->src_burst_size;
+	uint rows = config->rows, cnt, body_off;
+	u64 src_gap, dst_gap;
+	struct args_DMALPEND args;
+
+	if(config->t_type != MEM2MEM || !config->dst_inc || !burst_size ||
+				row_gaps(config, &src_gap, &dst_gap)) {
+		return -1;
+	}
+
+	// every row must have the head of the first one
+	if((config->src_inc ? config->src_stride : config->dst_stride) &
+							(burst_size - 1)) {
+		return -1;
+	}
+
+	while(rows) {
+		cnt = rows < 256 ? rows : 256;
+		rows -= cnt;
+
+		*offset += insert_DMALP(&buf_cmds[*offset], LOOP_CNT_1_REG, cnt);
+		body_off = *offset;
+
+		// the previous row ends with the CCR of its last phase
+		ccr->cur = ~0U;
+		if(setup_transfer(buf_cmds, offset, config, ccr,
+				config->iova_src, config->iova_dst, config->size)) {
+			return -1;
+		}
+		skip_row_gap(buf_cmds, offset, SRC, src_gap);
+		skip_row_gap(buf_cmds, offset, DST, dst_gap);
+
+		if(*offset - body_off > 0xff) {
+			DEBUG_MSG("row of %u bytes of program\n", *offset - body_off);
+			return -1;
+		}
+
+		args.type = ALWAYS;
+		args.loop_cnt_num = LOOP_CNT_1_REG;
+		args.backflip_jump = *offset - body_off;
+		*offset += insert_DMALPEND(&buf_cmds[*offset], BY_DMALP, &args);
+	}
+
+	return 0;
+}
+
+/*
+ * reload SAR and DAR for every segment of a scatter-gather list
+ * and move it with the same CCR configuration. The event is raised
+ * only once, after the last segment, by the caller.
+ * */
+static int setup_sg_segments(uchar *buf_cmds, uint *offset,
+			struct req_config *config, struct prog_ccr *ccr)
+{
+	int i;
+	struct sg_entry *seg;
+
+	for(i = 0; i < config->sg_len; i++) {
+		seg = &config->sg_list[i];
+
+		DEBUG_MSG("sg segment %d, size: %d\n", i, seg->size);
+
+		*offset += insert_DMAMOV(&buf_cmds[*offset], SAR, seg->iova_src);
+		*offset += insert_DMAMOV(&buf_cmds[*offset], DAR, seg->iova_dst);
+
+		if(setup_transfer(buf_cmds, offset, config, ccr,
+				seg->iova_src, seg->iova_dst, seg->size)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * insert required commands to set up the request.
+ * */
+static int generate_prog(uchar *cmds_buf, struct req_config *config,
+						struct prog_relocs *relocs)
+{
+	uint offset = 0;
+	struct prog_ccr ccr = {0, ~0U};
+
+	/*
+	 * a DMALD and a DMAST per burst: the head, the beats and the tail
+	 * move the same bytes both sides only if the bursts are the same
+	 * */
+	if(config->src_burst_size != config->dst_burst_size ||
+			config->src_burst_len != config->dst_burst_len) {
+		return -1;
+	}
+
+	// CCR is set by every phase of the transfer, when it changes
+	pl330_vfio_build_CCR(&ccr.base, config);
+	ccr.base &= ~CCR_BURST_FIELDS;
+
+	relocs->wfe_off = -1;
+	if(config->wait_event >= 0) {
+		relocs->wfe_off = offset + 1;
+		offset += insert_DMAWFE(&cmds_buf[offset], config->wait_event);
+	}
+
+	if(config->sg_len) {
+		if(setup_sg_segments(cmds_buf, &offset, config, &ccr)) {
+			return -1;
+		}
+	} else {
+		// add instructions to configure SAR and DAR
+		relocs->sar_off = offset + 2;
+		offset += insert_DMAMOV(&cmds_buf[offset], SAR, config->iova_src);
+		relocs->dar_off = offset + 2;
+		offset += insert_DMAMOV(&cmds_buf[offset], DAR, config->iova_dst);
+
+		if(config->rows) {
+			if(setup_rows(cmds_buf, &offset, config, &ccr)) {
+				return -1;
+			}
+		} else if(setup_transfer(cmds_buf, &offset, config, &ccr,
+				config->iova_src, config->iova_dst, config->size)) {
+			return -1;
+		}
+	}
+
+	// wake up the next channel first
+	relocs->signal_off = -1;
+	if(config->signal_event >= 0) {
+		relocs->signal_off = offset + 1;
+		offset += insert_DMASEV(&cmds_buf[offset], config->signal_event);
+	}
+
+	relocs->sev_off = -1;
+	if(config->int_fin) {
+		// see the event enabled in enable_int_for_req()
+		relocs->sev_off = offset + 1;
+		offset += insert_DMASEV(&cmds_buf[offset], config->chan_id);
+	}
+
+	// terminate transaction
+	offset += insert_DMAEND(&cmds_buf[offset]);
+
+	return offset;
+}
+
+
+static void prog_shape_from_request(struct prog_shape *shape,
+					struct req_config *config)
+{
+	// zero the padding too, shapes are compared with memcmp()
+	memset(shape, 0, sizeof(*shape));
+
+	pl330_vfio_build_CCR(&shape->ccr, config);
+	shape->size = config->size;
+	if(config->rows) {
+		shape->rows = config->rows;
+		shape->src_stride = config->src_stride;
+		shape->dst_stride = config->dst_stride;
+	}
+	// a fixed source aligns the destination, see setup_transfer()
+	shape->head_align = (config->src_inc ? config->iova_src :
+				config->iova_dst) & (CCR_BURSTSIZE_MAX - 1);
+	shape->burst_size = config->src_burst_size;
+	shape->burst_len = config->src_burst_len;
+	shape->t_type = config->t_type;
+	if(config->t_type != MEM2MEM) {
+		shape->periph_id = config->periph_id;
+		shape->req_type = config->req_type;
+	}
+	shape->int_fin = config->int_fin;
+	shape->waits = config->wait_event >= 0;
+	shape->signals = config->signal_event >= 0;
+}
+
+static uint prog_shape_hash(struct prog_shape *shape)
+{
+	uint hash = shape->ccr;
+
+	hash = hash * 31 + shape->size;
+	hash = hash * 31 + shape->rows;
+	hash = hash * 31 + (shape->src_stride ^ shape->dst_stride << 16);
+	hash = hash * 31 + shape->head_align;
+	hash = hash * 31 + (shape->burst_size << 8 | shape->burst_len);
+	hash = hash * 31 + (shape->t_type << 1 | shape->int_fin);
+	hash = hash * 31 + (shape->periph_id << 2 | shape->req_type);
+	hash = hash * 31 + (shape->waits << 1 | shape->signals);
+	hash ^= hash >> 16;
+
+	return hash & (PROG_CACHE_SIZE - 1);
+}
+
+static inline void prog_patch(uchar *cmds_buf, struct prog_relocs *relocs,
+					struct req_config *config)
+{
+	*((uint *)&cmds_buf[relocs->sar_off]) = config->iova_src;
+	*((uint *)&cmds_buf[relocs->dar_off]) = config->iova_dst;
+
+	if(relocs->sev_off >= 0) {
+		cmds_buf[relocs->sev_off] = (config->chan_id & 0x1f) << 3;
+	}
+	if(relocs->wfe_off >= 0) {
+		cmds_buf[relocs->wfe_off] = (config->wait_event & 0x1f) << 3;
+	}
+	if(relocs->signal_off >= 0) {
+		cmds_buf[relocs->signal_off] = (config->signal_event & 0x1f) << 3;
+	}
+}
+
+/*
+ * longest sequence emitted by setup_load_store(), a device transfer
+ * (DMAWFP, DMALDP, DMAST) or a memory one (DMALD, DMARMB, DMAST, DMAWMB)
+ * */
+#define LOAD_STORE_DEV_LEN	(DMAWFP_SIZE + DMALDP_SIZE + DMAST_SIZE)
+#define LOAD_STORE_MEM_LEN	(DMALD_SIZE + DMARMB_SIZE + DMAST_SIZE + \
+								DMAWMB_SIZE)
+#define LOAD_STORE_MAX_LEN	(LOAD_STORE_DEV_LEN > LOAD_STORE_MEM_LEN ? \
+				LOAD_STORE_DEV_LEN : LOAD_STORE_MEM_LEN)
+
+/*
+ * longest sequence emitted by add_inner_outer_loops()
+ * */
+#define LOOPS_MAX_LEN		(2 * DMALP_SIZE + LOAD_STORE_MAX_LEN + \
+							2 * DMALPEND_SIZE)
+
+/*
+ * longest sequence emitted by setup_transfer()
+ * */
+static int loops_len(struct req_config *config, u64 size)
+{
+	uint burst = config->src_burst_size * config->src_burst_len;
+
+	if(!burst || !size) {
+		return -1;
+	}
+
+	/*
+	 * the bursts need a block for every full loop, plus the two for
+	 * the remainder. Head, single beats and tail need a block each,
+	 * every phase may set CCR, a device transfer flushes first
+	 * */
+	return (size / burst / 65536 + 2 + 3) * LOOPS_MAX_LEN +
+				4 * DMAMOV_SIZE + DMAFLUSHP_SIZE;
+}
+
+/*
+ * longest sequence emitted by setup_rows()
+ * */
+static int rows_len(struct req_config *config)
+{
+	uint burst = config->src_burst_size * config->src_burst_len;
+	u64 row, len, src_gap, dst_gap;
+
+	if(!burst || !config->size || row_gaps(config, &src_gap, &dst_gap)) {
+		return -1;
+	}
+
+	// as loops_len(), with blocks of 256 bursts and the gaps
+	row = (config->size / burst / 256 + 1 + 3) * LOOPS_MAX_LEN +
+		4 * DMAMOV_SIZE + DMAADDH_SIZE *
+		(ROW_GAP_ADDH(src_gap) + ROW_GAP_ADDH(dst_gap));
+
+	len = (config->rows + 255) / 256 * (DMALP_SIZE + row + DMALPEND_SIZE);
+
+	return len > INT_MAX ? -1 : len;
+}
+
+/*
+ * widest burst of the controller: bursts can't be wider than the
+ * AXI bus, and the MFIFO is shared by all the channels, so a burst
+ * takes at most its share (as the Linux pl330 driver does)
+ * */
+static void max_burst(struct pl330_status *status, uint *burst_size,
+							uint *burst_len)
+{
+	uint bus_bytes, share;
+
+	if(!status || !status->crd.bus_width) {
+		*burst_size = CCR_BURSTSIZE_MAX;
+		*burst_len = CCR_BURSTLEN_MAX;
+		return;
+	}
+
+	bus_bytes = status->crd.bus_width / 8;
+	*burst_size = bus_bytes < CCR_BURSTSIZE_MAX ?
+					bus_bytes : CCR_BURSTSIZE_MAX;
+
+	share = status->crd.buf_depth * bus_bytes / status->channels;
+	*burst_len = share / *burst_size;
+	if(*burst_len > CCR_BURSTLEN_MAX) {
+		*burst_len = CCR_BURSTLEN_MAX;
+	}
+	if(!*burst_len) {
+		*burst_len = 1;
+	}
+}
+
+int pl330_vfio_tune_burst(struct pl330_status *status,
+						struct req_config *config)
+{
+	uint burst_size, burst_len, burst_bytes, i;
+	u64 align, size;
+
+	/*
+	 * the burst of a device transfer is the one of its FIFO, the
+	 * burst of a fixed source is the width of its pattern
+	 * */
+	if(config->t_type != MEM2MEM || !config->src_inc) {
+		return 0;
+	}
+
+	/*
+	 * the head of the program aligns the source to the burst size,
+	 * the destination is aligned too only if the distance between the
+	 * two is a multiple of it
+	 * */
+	if(config->sg_len) {
+		align = 0;
+		size = 0;
+		for(i = 0; i < config->sg_len; i++) {
+			if(config->sg_list[i].size <= 0) {
+				return -1;
+			}
+			align |= config->sg_list[i].iova_src ^
+					config->sg_list[i].iova_dst;
+			if((u64)config->sg_list[i].size > size) {
+				size = config->sg_list[i].size;
+			}
+		}
+	} else {
+		if(!config->size) {
+			return -1;
+		}
+		size = config->size;
+		align = config->iova_src ^ config->iova_dst;
+		// every row with the alignment of the first one
+		if(config->rows) {
+			align |= config->src_stride | config->dst_stride;
+		}
+	}
+
+	max_burst(status, &burst_size, &burst_len);
+	burst_bytes = burst_size * burst_len;
+
+	while(align & (burst_size - 1)) {
+		burst_size >>= 1;
+	}
+
+	// narrower beats, more of them for the same MFIFO share
+	burst_len = burst_bytes / burst_size;
+	if(burst_len > CCR_BURSTLEN_MAX) {
+		burst_len = CCR_BURSTLEN_MAX;
+	}
+
+	/*
+	 * no burst longer than the transfer (its longest segment, a row):
+	 * a short one moves in full bursts rather than in a tail of
+	 * single beats. Fewer beats first, then narrower ones
+	 * */
+	if((u64)burst_size * burst_len > size) {
+		burst_len = size / burst_size;
+		while(!burst_len) {
+			burst_size >>= 1;
+			burst_len = size / burst_size;
+		}
+	}
+
+	config->src_burst_size = config->dst_burst_size = burst_size;
+	config->src_burst_len = config->dst_burst_len = burst_len;
+
+	DEBUG_MSG("tuned burst: %u x %u\n", burst_size, burst_len);
+
+	return 0;
+}
+
+static inline int tune_if_auto(struct pl330_status *status,
+						struct req_config *config)
+{
+	if(!config->burst_auto) {
+		return 0;
+	}
+
+	return pl330_vfio_tune_burst(status, config);
+}
+
+/*
+ * bytes moved by a chunk of a long transfer
+ * */
+static inline u64 chunk_bytes(struct req_config *config)
+{
+	return (u64)PROG_CHUNK_BURSTS * config->src_burst_size *
+						config->src_burst_len;
+}
+
+/*
+ * a transfer too long for a program, scatter-gather and 2D
+ * programs are never split
+ * */
+static inline bool chain_needed(struct req_config *conf)
+{
+	return !conf->sg_len && !conf->rows && conf->size > chunk_bytes(conf);
+}
+
+int pl330_vfio_cmds_len(struct pl330_status *status, struct req_config *config)
+{
+	int i, len, loops;
+	u64 size;
+
+	if(tune_if_auto(status, config)) {
+		return -1;
+	}
+
+	len = DMAWFE_SIZE + 2 * DMASEV_SIZE + DMAEND_SIZE;
+
+	if(config->sg_len) {
+		for(i = 0; i < config->sg_len; i++) {
+			loops = loops_len(config, config->sg_list[i].size);
+			if(loops < 0) {
+				return -1;
+			}
+			len += 2 * DMAMOV_SIZE + loops;
+		}
+	} else if(config->rows) {
+		loops = rows_len(config);
+		if(loops < 0) {
+			return -1;
+		}
+		len += 2 * DMAMOV_SIZE + loops;
+	} else {
+		// the program of a chunk at most
+		size = config->size < chunk_bytes(config) ?
+					config->size : chunk_bytes(config);
+		loops = loops_len(config, size);
+		if(loops < 0) {
+			return -1;
+		}
+		len += 2 * DMAMOV_SIZE + loops;
+	}
+
+	return len;
+}
+
+/*
+ * copy the template of shape into cmds_buf, 0 if there is none or
+ * a writer replaced it meanwhile
+ * */
+static int prog_cache_get(struct prog_template *tmpl, struct prog_shape *shape,
+			uchar *cmds_buf, struct prog_relocs *relocs)
+{
+	uint seq = __atomic_load_n(&tmpl->seq, __ATOMIC_ACQUIRE);
+	uint len;
+
+	if(seq & 1 || !tmpl->len || memcmp(&tmpl->shape, shape, sizeof(*shape))) {
+		return 0;
+	}
+
+	len = tmpl->len;
+	*relocs = tmpl->relocs;
+	memcpy(cmds_buf, tmpl->cmds, len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&tmpl->seq, __ATOMIC_RELAXED) != seq) {
+		return 0;
+	}
+
+	return len;
+}
+
+static void prog_cache_put(struct prog_template *tmpl, struct prog_shape *shape,
+			uchar *cmds_buf, uint len, struct prog_relocs *relocs)
+{
+	uint seq = __atomic_load_n(&tmpl->seq, __ATOMIC_RELAXED);
+
+	// another writer is at it, this program isn't kept
+	if(seq & 1 || !__atomic_compare_exchange_n(&tmpl->seq, &seq, seq + 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	tmpl->shape = *shape;
+	tmpl->len = len;
+	tmpl->relocs = *relocs;
+	memcpy(tmpl->cmds, cmds_buf, len);
+
+	__atomic_store_n(&tmpl->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int generate_cmds(struct pl330_status *status, uchar *cmds_buf,
+						struct req_config *config)
+{
+	struct prog_shape shape;
+	struct prog_template *tmpl;
+	struct prog_relocs relocs;
+	int len;
+
+	if(config->sg_len) {
+		// scatter-gather programs are not cached
+		return generate_prog(cmds_buf, config, &relocs);
+	}
+
+	prog_shape_from_request(&shape, config);
+	tmpl = &status->prog_cache[prog_shape_hash(&shape)];
+
+	len = prog_cache_get(tmpl, &shape, cmds_buf, &relocs);
+	if(len) {
+		prog_patch(cmds_buf, &relocs, config);
+		return len;
+	}
+
+	len = generate_prog(cmds_buf, config, &relocs);
+	if(len > 0 && len <= PROG_TEMPLATE_MAX_LEN) {
+		prog_cache_put(tmpl, &shape, cmds_buf, len, &relocs);
+	}
+
+	return len;
+}
+
+#ifdef PL330_CHECKED
+/*
+ * a bad program is dumped and never reaches a channel
+ * */
+static int check_cmds(struct pl330_status *status, uchar *cmds_buf, int len,
+						struct req_config *config)
+{
+	int max_len = pl330_vfio_cmds_len(status, config);
+
+	if(len > max_len) {
+		fprintf(stderr, "pl330 check: program of %d bytes, "
+				"pl330_vfio_cmds_len() is %d\n", len, max_len);
+	} else if(!pl330_prog_check(cmds_buf, len)) {
+		return len;
+	}
+
+	pl330_disasm(stderr, cmds_buf, len);
+
+	return -1;
+}
+#endif
+
+/*
+ * the peripheral of a device transfer must exist, see CR0
+ * */
+static int check_periph(struct pl330_status *status, struct req_config *config)
+{
+	if(config->t_type == MEM2MEM) {
+		return 0;
+	}
+
+	if(config->req_type != SINGLE && config->req_type != BURST) {
+		return -1;
+	}
+
+	if(config->periph_id > CR0_NUM_PERIF_REQ_MK) {
+		return -1;
+	}
+
+	// without a controller, the peripherals are not known yet
+	if(status && (!status->cr0.perif_req_support ||
+			config->periph_id >= status->cr0.num_perif_req)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int generate_cmds_from_request(struct pl330_status *status, uchar *cmds_buf,
+						struct req_config *config)
+{
+	struct req_config chunk;
+	int len;
+
+	if(tune_if_auto(status, config) || check_periph(status, config)) {
+		return -1;
+	}
+
+	TRACE(status, GEN_BEGIN, config->chan_id, 0);
+
+	if(chain_needed(config)) {
+		// the first chunk only, the others are chained by the driver
+		chunk = *config;
+		chunk.size = chunk_bytes(config);
+		chunk.burst_auto = false;
+		// the last chunk signals the dependent channel
+		chunk.signal_event = -1;
+		config = &chunk;
+	}
+
+	len = generate_cmds(status, cmds_buf, config);
+
+#ifdef PL330_CHECKED
+	if(len >= 0) {
+		len = check_cmds(status, cmds_buf, len, config);
+	}
+#endif
+
+	TRACE(status, GEN_END, config->chan_id, len);
+
+	return len;
+}
+
+int pl330_vfio_mem2mem_defconfig(struct pl330_status *status,
+						struct req_config *config)
+{
+	pl330_vfio_req_config_init(config);
 
 	config->src_inc = config->dst_inc = INC_DEF_VAL;
 	config->src_prot_ctrl = config->dst_prot_ctrl = CCR_PROTCTRL_DEF_VAL;
 	config->src_cache_ctrl = config->dst_cache_ctrl = CCR_CACHECTRL_DEF_VAL;
 
-	config->src_burst_size = config->dst_burst_size = CCR_BURSTSIZE_MAX;
-	config->src_burst_len = config->dst_burst_len = CCR_BURSTLEN_MAX;
+	max_burst(status, &config->src_burst_size, &config->src_burst_len);
+	config->dst_burst_size = config->src_burst_size;
+	config->dst_burst_len = config->src_burst_len;
+	config->burst_auto = true;
+
+	config->t_type = MEM2MEM;
+	config->periph_id = 0;
+	config->req_type = BURST;
+
+	config->rows = 0;
+
+	config->wait_event = config->signal_event = -1;
+
+	config->sg_list = NULL;
+	config->sg_len = 0;
+
+	config->c_mode = COMPLETION_IRQ;
+	config->poll_ns = HYBRID_POLL_NS_DEF;
+
+	config->callback = NULL;
+	config->user_data = NULL;
+	config->token = NULL;
+
+	return 0;
+}
+
+int pl330_vfio_dev_defconfig(struct pl330_status *status,
+				struct req_config *config,
+				enum transfer_type t_type, uint periph_id)
+{
+	pl330_vfio_mem2mem_defconfig(status, config);
+
+	config->t_type = t_type;
+	config->periph_id = periph_id;
+
+	config->src_inc = t_type != DEV2MEM;
+	config->dst_inc = t_type != MEM2DEV;
+
+	config->src_burst_size = config->dst_burst_size = 4;
+	config->src_burst_len = config->dst_burst_len = 4;
+	config->burst_auto = false;
+
+	if(t_type == MEM2MEM || check_periph(status, config)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * For the channel num. i, we activate the event i
+ * */
+void enable_int_for_req(struct pl330_status *status, struct req_config *config)
+{
+	if(config->int_fin) {
+		update_inten(status, 1 << config->chan_id, 0);
+	}
+}
+
+int pl330_vfio_cmds_pool_init(struct pl330_status *status,
+			struct pl330_iommu *mmu, uint slot_size, uint num_slots)
+{
+	struct cmds_pool *pool = &status->pool;
+	uint i;
+
+	if(pool->mem || !slot_size || !num_slots) {
+		return -1;
+	}
+
+	if(pl330_vfio_dma_alloc(mmu, (u64)slot_size * num_slots, &pool->buf)) {
+		return -1;
+	}
+
+	pool->free_slots = malloc(num_slots * sizeof(*pool->free_slots));
+	if(!pool->free_slots) {
+		pl330_vfio_dma_free(mmu, &pool->buf);
+		return -1;
+	}
+
+	pool->mmu = mmu;
+	pool->mem = pool->buf.vaddr;
+	pool->iova = pool->buf.iova;
+	pool->slot_size = slot_size;
+	pool->num_slots = num_slots;
+
+	for(i = 0; i < num_slots; i++) {
+		pool->free_slots[i] = num_slots - 1 - i;
+	}
+	pool->num_free = num_slots;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return 0;
+}
+
+uint pl330_vfio_inflight(struct pl330_status *status)
+{
+	struct cmds_pool *pool = &status->pool;
+
+	// a hint only, read without the pool lock
+	return pool->num_slots - __atomic_load_n(&pool->num_free,
+							__ATOMIC_RELAXED);
+}
+
+void pl330_vfio_stats_snapshot(struct pl330_status *status,
+					struct pl330_vfio_stats *stats)
+{
+	// nothing but counters
+	u64 *from = (u64 *)&status->stats;
+	u64 *to = (u64 *)stats;
+	uint i;
+
+	for(i = 0; i < sizeof(*stats) / sizeof(u64); i++) {
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	}
+}
+
+static void cmds_pool_destroy(struct pl330_status *status)
+{
+	struct cmds_pool *pool = &status->pool;
+
+	if(!pool->mem) {
+		return;
+	}
+
+	pl330_vfio_dma_free(pool->mmu, &pool->buf);
+	free(pool->free_slots);
+	pool->mem = NULL;
+}
+
+static int get_slot(struct pl330_status *status)
+{
+	struct cmds_pool *pool = &status->pool;
+	int slot = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->num_free) {
+		slot = pool->free_slots[--pool->num_free];
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return slot;
+}
+
+static void put_slot(struct pl330_status *status, int slot)
+{
+	struct cmds_pool *pool = &status->pool;
+
+	if(slot < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->free_slots[pool->num_free++] = slot;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static inline uchar *slot_cmds(struct pl330_status *status, int slot)
+{
+	return status->pool.mem + (u64)slot * status->pool.slot_size;
+}
+
+static inline u64 slot_iova(struct pl330_status *status, int slot)
+{
+	return status->pool.iova + (u64)slot * status->pool.slot_size;
+}
+
+static uint stop_thread(struct pl330_status *status, uint id);
+
+/*
+ * bytes moved by the request of conf
+ * */
+static u64 req_bytes(struct req_config *conf)
+{
+	u64 bytes = 0;
+	uint i;
+
+	if(conf->sg_len) {
+		for(i = 0; i < conf->sg_len; i++) {
+			bytes += conf->sg_list[i].size;
+		}
+		return bytes;
+	}
+
+	return conf->rows ? (u64)conf->size * conf->rows : conf->size;
+}
+
+/*
+ * remember the chunks of conf after the first one, whose program
+ * is at cmds
+ * */
+static void chain_init(struct chunk_chain *chain, uchar *cmds, u64 iova_cmds,
+						struct req_config *conf)
+{
+	chain->cmds = NULL;
+
+	if(!cmds || !chain_needed(conf)) {
+		return;
+	}
+
+	chain->conf = *conf;
+	chain->conf.burst_auto = false;
+	chain->cmds = cmds;
+	chain->iova_cmds = iova_cmds;
+	chain->next = chunk_bytes(conf);
+}
+
+/*
+ * start the next chunk of the running request of chan, if any.
+ * Called with the channel lock held, returns 1 if a chunk has been
+ * started, 0 if the request is over and -1 if the program of the
+ * next chunk can't be generated: the caller fails the request
+ * */
+static int chain_next(struct pl330_status *status, uint chan)
+{
+	struct channel_thread *ch = &status->ch_threads[chan];
+	struct chunk_chain *chain = &ch->chain;
+	struct req_config chunk;
+	u64 left;
+
+	if(!chain->cmds || chain->next >= chain->conf.size) {
+		return 0;
+	}
+
+	chunk = chain->conf;
+	left = chunk.size - chain->next;
+	// the address of a device doesn't move
+	if(chunk.src_inc) {
+		chunk.iova_src += chain->next;
+	}
+	if(chunk.dst_inc) {
+		chunk.iova_dst += chain->next;
+	}
+	chunk.size = left < chunk_bytes(&chunk) ? left : chunk_bytes(&chunk);
+	chain->next += chunk.size;
+	TRACE(status, CHUNK, chan, chunk.size);
+
+	// the first chunk waited, the last one signals
+	chunk.wait_event = -1;
+	if(chain->next < chain->conf.size) {
+		chunk.signal_event = -1;
+	}
+
+	// the channel may still have to fetch the DMAEND after DMASEV
+	wait_channel_stopped(status, chan);
+
+	// same shape of the previous chunk but for the last, only patched
+	if(generate_cmds_from_request(status, chain->cmds, &chunk) < 0) {
+		return -1;
+	}
+	start_channel(status, chan, chain->iova_cmds);
+
+	return 1;
+}
+
+/*
+ * completion tokens: TOKEN_DONE is set once, with TOKEN_CANCELLED if
+ * the request was dropped; TOKEN_WAITING while a thread sleeps on the
+ * futex of state
+ * */
+#define TOKEN_DONE		(1 << 0)
+#define TOKEN_WAITING		(1 << 1)
+#define TOKEN_CANCELLED		(1 << 2)
+
+static void complete_token(struct pl330_status *status,
+			struct pl330_vfio_token *token, bool cancelled)
+{
+	struct pl330_vfio_token *head;
+	bool notify = token->notify;
+	uint done = TOKEN_DONE | (cancelled ? TOKEN_CANCELLED : 0);
+
+	// without notify the token can be freed as soon as it's done
+	if(__atomic_exchange_n(&token->state, done, __ATOMIC_ACQ_REL) &
+							TOKEN_WAITING) {
+		syscall(SYS_futex, &token->state, FUTEX_WAKE_PRIVATE, INT_MAX,
+							NULL, NULL, 0);
+	}
+
+	if(!notify) {
+		return;
+	}
+
+	head = __atomic_load_n(&status->completed, __ATOMIC_RELAXED);
+	do {
+		token->next = head;
+	} while(!__atomic_compare_exchange_n(&status->completed, &head,
+				token, true, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED));
+
+	// the others found the fd signalled already
+	if(!head) {
+		eventfd_write(status->completion_fd, 1);
+	}
+}
+
+void pl330_vfio_token_init(struct pl330_vfio_token *token, bool notify)
+{
+	token->state = 0;
+	token->notify = notify;
+	token->next = NULL;
+}
+
+bool pl330_vfio_token_test(struct pl330_vfio_token *token)
+{
+	return __atomic_load_n(&token->state, __ATOMIC_ACQUIRE) & TOKEN_DONE;
+}
+
+bool pl330_vfio_token_cancelled(struct pl330_vfio_token *token)
+{
+	return __atomic_load_n(&token->state, __ATOMIC_ACQUIRE) &
+							TOKEN_CANCELLED;
+}
+
+int pl330_vfio_completion_fd(struct pl330_status *status)
+{
+	return status->completion_fd;
+}
+
+struct pl330_vfio_token *pl330_vfio_poll_completions(
+					struct pl330_status *status)
+{
+	struct pl330_vfio_token *list, *next, *ordered = NULL;
+	eventfd_t val;
+
+	// first: a token pushed from now on signals the fd again
+	eventfd_read(status->completion_fd, &val);
+
+	list = __atomic_exchange_n(&status->completed, NULL, __ATOMIC_ACQUIRE);
+	while(list) {
+		next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	return ordered;
+}
+
+/*
+ * the running request of chan is done: start the next queued one,
+ * if any. Called with the channel lock held, the slot and the callback
+ * of the completed request are returned in done.
+ * */
+static void next_request(struct pl330_status *status, uint chan,
+						struct pending_req *done)
+{
+	struct channel_thread *ch = &status->ch_threads[chan];
+	struct pl330_vfio_chan_stats *stats = &status->stats.chans[chan];
+
+	STAT_INC(stats->completions);
+	STAT_ADD(stats->bytes, ch->bytes);
+	stat_latency(stats->go_to_done, now_ns() - ch->go_ns);
+	TRACE(status, DONE, chan, ch->bytes);
+
+	done->slot = ch->slot;
+	done->callback = ch->callback;
+	done->user_data = ch->user_data;
+	done->token = ch->token;
+
+	// keep the channel busy, start the next request first
+	if(ch->queue_cnt) {
+		struct pending_req *req = &ch->queue[ch->queue_head];
+
+		ch->slot = req->slot;
+		ch->chain = req->chain;
+		ch->callback = req->callback;
+		ch->user_data = req->user_data;
+		ch->token = req->token;
+		ch->bytes = req->bytes;
+		start_request(status, chan, req->iova_cmds, req->submit_ns);
+
+		ch->queue_head = (ch->queue_head + 1) % CHANNEL_QUEUE_LEN;
+		ch->queue_cnt--;
+	} else {
+		/*
+		 * the channel may still have to fetch the DMAEND after
+		 * DMASEV, the program can be rewritten once it's stopped
+		 * */
+		wait_channel_stopped(status, chan);
+		ch->running = false;
+		ch->slot = -1;
+	}
+}
+
+static inline void finish_request(struct pl330_status *status, uint chan,
+						struct pending_req *done)
+{
+	// the program of the completed request is not needed anymore
+	put_slot(status, done->slot);
+
+	// trigger callback
+	if(done->callback != NULL) {
+		TRACE(status, CB_BEGIN, chan, 0);
+		done->callback(done->user_data);
+		TRACE(status, CB_END, chan, 0);
+	}
+
+	if(done->token) {
+		complete_token(status, done->token, false);
+	}
+}
+
+/*
+ * complete the running request of chan, its event has already been
+ * cleared by dispatch_irqs()
+ * */
+static bool complete_channel(struct pl330_status *status, uint chan)
+{
+	struct channel_thread *ch = &status->ch_threads[chan];
+	struct pending_req done;
+	int more;
+
+	pthread_mutex_lock(&ch->lock);
+
+	if(!ch->running) {
+		pthread_mutex_unlock(&ch->lock);
+		return false;
+	}
+
+	// a long transfer goes on with its next chunk
+	more = chain_next(status, chan);
+	if(more) {
+		pthread_mutex_unlock(&ch->lock);
+		// a chunk that can't be generated fails its request
+		if(more < 0) {
+			stop_thread(status, chan);
+		}
+		return true;
+	}
+
+	next_request(status, chan, &done);
+
+	pthread_mutex_unlock(&ch->lock);
+
+	finish_request(status, chan, &done);
+
+	return true;
+}
+
+/*
+ * read INTMIS once, clear all of its events with a single write and
+ * complete the channel of each one. The irq thread and the hybrid
+ * submitters can get here for the same events: reading and clearing
+ * under irq_lock hands every event to one of them only. The events
+ * are cleared before the channels move on to their next request, so
+ * a request that completes right away raises its event again.
+ * Returns the events dispatched.
+ * */
+static uint dispatch_irqs(struct pl330_status *status)
+{
+	uint mis, pending;
+	int chan;
+
+	pthread_mutex_lock(&status->irq_lock);
+
+	mis = reg_read(status, INTMIS);
+	if(mis) {
+		reg_write(status, INTCLR, mis);
+		TRACE(status, INTCLR, PL330_TRACE_NO_CHAN, mis);
+	}
+
+	pthread_mutex_unlock(&status->irq_lock);
+
+	STAT_ADD(status->stats.irq_events, __builtin_popcount(mis));
+
+	// the callbacks run unlocked, they may submit and spin in turn
+	for(pending = mis; pending; pending &= pending - 1) {
+		chan = status->event_chan[__builtin_ctz(pending)];
+		if(chan >= 0) {
+			complete_channel(status, chan);
+		}
+	}
+
+	return mis;
+}
+
+int pl330_vfio_token_wait(struct pl330_vfio_token *token, int timeout_ms)
+{
+	u64 deadline = now_ns() + (u64)timeout_ms * 1000000ULL;
+	struct timespec ts, *timeout = NULL;
+	uint state;
+	u64 now;
+
+	state = __atomic_load_n(&token->state, __ATOMIC_ACQUIRE);
+	while(!(state & TOKEN_DONE)) {
+		// tell complete_token() to wake us up
+		if(!(state & TOKEN_WAITING) &&
+				!__atomic_compare_exchange_n(&token->state,
+					&state, state | TOKEN_WAITING, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		if(timeout_ms >= 0) {
+			now = now_ns();
+			if(now >= deadline) {
+				return -1;
+			}
+			ts.tv_sec = (deadline - now) / 1000000000ULL;
+			ts.tv_nsec = (deadline - now) % 1000000000ULL;
+			timeout = &ts;
+		}
+
+		syscall(SYS_futex, &token->state, FUTEX_WAIT_PRIVATE,
+					TOKEN_WAITING, timeout, NULL, 0);
+
+		state = __atomic_load_n(&token->state, __ATOMIC_ACQUIRE);
+	}
+
+	return 0;
+}
+
+/*
+ * COMPLETION_POLL: no event is raised, the submitter spins on the
+ * channel state and runs the callback itself
+ * */
+static int submit_polled(struct pl330_status *status, uchar *cmds,
+			u64 iova_cmds, int slot, struct req_config *conf)
+{
+	struct channel_thread *ch = &status->ch_threads[conf->chan_id];
+	struct pl330_vfio_chan_stats *stats =
+					&status->stats.chans[conf->chan_id];
+	u64 submit_ns = now_ns();
+	struct pending_req done;
+	int more;
+
+	pthread_mutex_lock(&ch->lock);
+
+	if(ch->running || conf->int_fin) {
+		pthread_mutex_unlock(&ch->lock);
+		STAT_INC(stats->rejects);
+		return -1;
+	}
+
+	// keep the others queuing on the channel while we spin
+	ch->running = true;
+	ch->slot = slot;
+	chain_init(&ch->chain, cmds, iova_cmds, conf);
+	ch->callback = conf->callback;
+	ch->user_data = conf->user_data;
+	ch->token = conf->token;
+	ch->bytes = req_bytes(conf);
+	start_request(status, conf->chan_id, iova_cmds, submit_ns);
+	STAT_INC(stats->submits);
+
+	pthread_mutex_unlock(&ch->lock);
+
+	do {
+		if(wait_channel_stopped(status, conf->chan_id) != STOPPED) {
+			more = -1;
+			break;
+		}
+
+		pthread_mutex_lock(&ch->lock);
+		more = chain_next(status, conf->chan_id);
+		pthread_mutex_unlock(&ch->lock);
+	} while(more > 0);
+
+	// a fault, or a chunk that can't be generated
+	if(more < 0) {
+		// the slot goes back to the caller, the channel is killed
+		pthread_mutex_lock(&ch->lock);
+		ch->slot = -1;
+		pthread_mutex_unlock(&ch->lock);
+
+		stop_thread(status, conf->chan_id);
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&ch->lock);
+	next_request(status, conf->chan_id, &done);
+	pthread_mutex_unlock(&ch->lock);
+
+	finish_request(status, conf->chan_id, &done);
+
+	return 0;
+}
+
+/*
+ * COMPLETION_HYBRID: spin on the interrupt status for up to poll_ns,
+ * then leave the completion to the irq thread
+ * */
+static void spin_for_completion(struct pl330_status *status,
+							struct req_config *conf)
+{
+	u64 deadline = now_ns() + conf->poll_ns;
+
+	do {
+		if(reg_read(status, INTMIS) & (1 << conf->chan_id)) {
+			dispatch_irqs(status);
+			return;
+		}
+	} while(now_ns() < deadline);
+}
+
+static int submit_on_channel(struct pl330_status *status, uchar *cmds,
+			u64 iova_cmds, int slot, struct req_config *conf)
+{
+	struct channel_thread *ch = &status->ch_threads[conf->chan_id];
+	struct pl330_vfio_chan_stats *stats =
+					&status->stats.chans[conf->chan_id];
+	u64 submit_ns = now_ns();
+	struct pending_req *req;
+	bool started = false;
+	int ret = 0;
+
+	if(conf->c_mode == COMPLETION_POLL) {
+		return submit_polled(status, cmds, iova_cmds, slot, conf);
+	}
+
+	// the completion interrupt starts the chunks after the first
+	if(chain_needed(conf) && !conf->int_fin) {
+		STAT_INC(stats->rejects);
+		return -1;
+	}
+
+	// enable interrupt
+	enable_int_for_req(status, conf);
+
+	pthread_mutex_lock(&ch->lock);
+
+	/*
+	 * nothing tracks a request without int_fin, the channel may still
+	 * be executing it: DMAGO would spin until it stops, forever if it
+	 * waits for an event or a peripheral
+	 * */
+	if(!ch->running && thread_state(status, conf->chan_id) != STOPPED) {
+		ret = -1;
+	} else if(!ch->running) {
+		if(conf->int_fin) {
+			ch->running = true;
+			ch->slot = slot;
+			chain_init(&ch->chain, cmds, iova_cmds, conf);
+			ch->callback = conf->callback;
+			ch->user_data = conf->user_data;
+			ch->token = conf->token;
+			ch->bytes = req_bytes(conf);
+		}
+		start_request(status, conf->chan_id, iova_cmds, submit_ns);
+		started = true;
+	} else if(conf->int_fin && ch->queue_cnt < CHANNEL_QUEUE_LEN) {
+		req = &ch->queue[(ch->queue_head + ch->queue_cnt)
+						% CHANNEL_QUEUE_LEN];
+		req->iova_cmds = iova_cmds;
+		req->slot = slot;
+		chain_init(&req->chain, cmds, iova_cmds, conf);
+		req->callback = conf->callback;
+		req->user_data = conf->user_data;
+		req->token = conf->token;
+		req->submit_ns = submit_ns;
+		req->bytes = req_bytes(conf);
+		ch->queue_cnt++;
+	} else {
+		ret = -1;
+	}
 
-	config->t_type = MEM2MEM;
+	pthread_mutex_unlock(&ch->lock);
 
-	config->callback = NULL;
-	config->user_data = NULL;
+	if(ret) {
+		STAT_INC(stats->rejects);
+	} else {
+		STAT_INC(stats->submits);
+	}
+
+	// a queued request is completed by the irq thread
+	if(started && conf->int_fin && conf->c_mode == COMPLETION_HYBRID) {
+		spin_for_completion(status, conf);
+	}
+
+	return ret;
+}
+
+int pl330_vfio_submit_req(struct pl330_status *status, uchar *cmds,
+					u64 iova_cmds, struct req_config *conf)
+{
+	return submit_on_channel(status, cmds, iova_cmds, -1, conf);
 }
 
 /*
- * For the channel num. i, we activate the event i
+ * check that the program of conf fits in a slot of the pool
  * */
-void enable_int_for_req(struct req_config *config)
+static int check_slot_fit(struct pl330_status *status, struct req_config *conf)
 {
-	if(config->int_fin) {
-		uint int_reg;
-		int_reg = *((uint *)(status->regs + INTEN)) | (1 << config->chan_id);
-		(*((uint *)(status->regs + INTEN))) |= int_reg;
+	int len;
+
+	if(!status->pool.mem) {
+		return -1;
+	}
+
+	len = pl330_vfio_cmds_len(status, conf);
+	if(len < 0 || len > status->pool.slot_size) {
+		return -1;
 	}
+
+	return 0;
 }
 
-int pl330_vfio_submit_req(uchar *cmds, u64 iova_cmds, struct req_config *conf)
+static int submit_in_slot(struct pl330_status *status, int slot,
+							struct req_config *conf)
 {
-	if(!is_dmac_idle()) {
+	uchar *cmds = slot_cmds(status, slot);
+
+	if(generate_cmds_from_request(status, cmds, conf) < 0 ||
+			submit_on_channel(status, cmds,
+				slot_iova(status, slot), slot, conf)) {
+		put_slot(status, slot);
 		return -1;
 	}
 
-	// enable interrupt
-	enable_int_for_req(conf);
+	return 0;
+}
 
-	uchar ins_debug[6] = {0, 0, 0, 0, 0, 0};
+int pl330_vfio_submit(struct pl330_status *status, struct req_config *conf)
+{
+	int slot;
 
-	bool non_secure = true;
+	conf->int_fin = (conf->c_mode != COMPLETION_POLL);
 
-	insert_DMAGO(ins_debug, conf->chan_id, iova_cmds,
-			non_secure);
+	if(check_slot_fit(status, conf)) {
+		return -1;
+	}
+
+	slot = get_slot(status);
+	if(slot < 0) {
+		STAT_INC(status->stats.no_slot);
+		return -1;
+	}
+
+	return submit_in_slot(status, slot, conf);
+}
+
+/*
+ * a copy split across channels, completed when the last
+ * stripe signals
+ * */
+struct stripe_ctx {
+	struct pl330_status *status;
+	int remaining; // stripes not completed, +1 while submitting
+	bool failed; // a stripe couldn't be submitted, no callback
+	uint num_stripes;
+	int chans[MANAGER_ID];
+
+	void (* callback)(void *user_data);
+	void *user_data;
+};
+
+/*
+ * drop n references to ctx, the last one releases the channels and
+ * completes the copy
+ * */
+static void stripe_put(struct stripe_ctx *ctx, int n)
+{
+	struct pl330_status *status = ctx->status;
+	int i;
+
+	if(__atomic_sub_fetch(&ctx->remaining, n, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	for(i = 0; i < ctx->num_stripes; i++) {
+		pl330_vfio_release_channel(status, ctx->chans[i]);
+	}
+
+	if(!ctx->failed && ctx->callback) {
+		ctx->callback(ctx->user_data);
+	}
+
+	free(ctx);
+}
+
+static void stripe_done(void *user_data)
+{
+	stripe_put(user_data, 1);
+}
+
+int pl330_vfio_fill(struct pl330_status *status, struct req_config *conf,
+					const void *pattern, uint pattern_bits)
+{
+	uint pattern_bytes = pattern_bits / 8;
+	uint burst_size, burst_len, i;
+	u64 pattern_iova;
+	uchar *slot_pattern;
+	int slot, len;
+
+	if(pattern_bits % 8 || pattern_bytes > FILL_PATTERN_MAX ||
+			!pattern_bytes || (pattern_bytes & (pattern_bytes - 1))) {
+		return -1;
+	}
+
+	if(!conf->size || ((conf->iova_dst | conf->size) & (pattern_bytes - 1))) {
+		return -1;
+	}
+
+	// a beat reads the whole pattern, it can't be wider than the bus
+	max_burst(status, &burst_size, &burst_len);
+	if(pattern_bytes > burst_size) {
+		return -1;
+	}
+
+	conf->t_type = MEM2MEM;
+	conf->sg_len = 0;
+	conf->src_inc = 0;
+	conf->src_burst_size = conf->dst_burst_size = burst_size;
+	conf->src_burst_len = conf->dst_burst_len = burst_len;
+	conf->burst_auto = false;
+	conf->int_fin = (conf->c_mode != COMPLETION_POLL);
+
+	if(!status->pool.mem) {
+		return -1;
+	}
+
+	slot = get_slot(status);
+	if(slot < 0) {
+		STAT_INC(status->stats.no_slot);
+		return -1;
+	}
+
+	// the pattern at the end of the slot, after the program
+	pattern_iova = (slot_iova(status, slot) + status->pool.slot_size -
+			FILL_PATTERN_MAX) & ~(u64)(FILL_PATTERN_MAX - 1);
+	len = pl330_vfio_cmds_len(status, conf);
+	if(len < 0 || slot_iova(status, slot) + len > pattern_iova) {
+		put_slot(status, slot);
+		return -1;
+	}
+
+	// repeated up to the width of a beat
+	slot_pattern = slot_cmds(status, slot) +
+				(pattern_iova - slot_iova(status, slot));
+	for(i = 0; i < burst_size; i += pattern_bytes) {
+		memcpy(&slot_pattern[i], pattern, pattern_bytes);
+	}
+	conf->iova_src = pattern_iova;
+
+	return submit_in_slot(status, slot, conf);
+}
+
+int pl330_vfio_copy_striped(struct pl330_status *status,
+		u64 iova_src, u64 iova_dst, u64 size,
+		uint num_chans, void (*callback)(void *user_data),
+		void *user_data)
+{
+	struct stripe_ctx *ctx;
+	struct req_config conf;
+	int slots[MANAGER_ID];
+	u64 bursts, per_stripe;
+	uint burst, rest, extra, n, i, j, dropped;
+	u64 offset = 0;
+	int chan;
+
+	pl330_vfio_mem2mem_defconfig(status, &conf);
+	conf.int_fin = true;
+
+	burst = conf.src_burst_size * conf.src_burst_len;
+	if(!size || !num_chans) {
+		return -1;
+	}
+	bursts = size / burst;
+	rest = size % burst;
+
+	if(num_chans > status->channels) {
+		num_chans = status->channels;
+	}
+	// every stripe moves at least one burst, but the last one
+	if(num_chans > bursts) {
+		num_chans = bursts ? bursts : 1;
+	}
+
+	ctx = malloc(sizeof(*ctx));
+	if(!ctx) {
+		return -1;
+	}
+
+	/*
+	 * grab channels and slots first: the stripes can't run short of
+	 * them once the first is started
+	 * */
+	for(n = 0; n < num_chans; n++) {
+		chan = pl330_vfio_request_channel(status);
+		if(chan < 0) {
+			break;
+		}
+		slots[n] = get_slot(status);
+		if(slots[n] < 0) {
+			pl330_vfio_release_channel(status, chan);
+			break;
+		}
+		ctx->chans[n] = chan;
+	}
+
+	per_stripe = n ? bursts / n : 0;
+	extra = n ? bursts % n : 0;
+
+	// the biggest stripe has to fit in a slot too
+	conf.size = (per_stripe + (extra ? 1 : 0)) * burst + rest;
+	if(!n || check_slot_fit(status, &conf)) {
+		for(i = 0; i < n; i++) {
+			put_slot(status, slots[i]);
+			pl330_vfio_release_channel(status, ctx->chans[i]);
+		}
+		free(ctx);
+		return -1;
+	}
+
+	ctx->status = status;
+	// the stripes completing meanwhile don't free ctx
+	ctx->remaining = n + 1;
+	ctx->failed = false;
+	ctx->num_stripes = n;
+	ctx->callback = callback;
+	ctx->user_data = user_data;
+
+	conf.callback = stripe_done;
+	conf.user_data = ctx;
+
+	for(i = 0; i < n; i++) {
+		conf.chan_id = ctx->chans[i];
+		conf.iova_src = iova_src + offset;
+		conf.iova_dst = iova_dst + offset;
+		conf.size = (per_stripe + (i < extra ? 1 : 0)) * burst;
+		if(i == n - 1) {
+			conf.size += rest;
+		}
+
+		// the program can still be rejected, the slot is freed
+		if(submit_in_slot(status, slots[i], &conf)) {
+			break;
+		}
+
+		offset += conf.size;
+	}
+
+	if(i == n) {
+		stripe_put(ctx, 1);
+		return 0;
+	}
+
+	/*
+	 * stop the stripes started: those dropped by the kill never
+	 * complete, those already completed or completing have put their
+	 * reference. The last one gone releases the channels
+	 * */
+	ctx->failed = true;
+	dropped = n - i;
+	for(j = i + 1; j < n; j++) {
+		put_slot(status, slots[j]);
+	}
+	for(j = 0; j < i; j++) {
+		dropped += stop_thread(status, ctx->chans[j]);
+	}
+	stripe_put(ctx, dropped + 1);
+
+	return -1;
+}
+
+/*
+ * a chain of dependent requests, completed by its last stage
+ * */
+struct dep_chain_ctx {
+	struct pl330_status *status;
+	uint num_stages;
+	int chans[MANAGER_ID];
+	int events[MANAGER_ID]; // signalled by stage i to stage i + 1
+
+	// of the last stage
+	void (* callback)(void *user_data);
+	void *user_data;
+};
+
+/*
+ * start the program of slot on the idle channel chan. The request is
+ * completed by the irq thread if it raises the completion event of
+ * the channel, by complete_stage() otherwise
+ * */
+static int arm_stage(struct pl330_status *status, struct req_config *stage,
+			int slot, void (*callback)(void *user_data),
+			void *user_data)
+{
+	uint chan = stage->chan_id;
+	struct channel_thread *ch = &status->ch_threads[chan];
+	u64 submit_ns = now_ns();
+
+	pthread_mutex_lock(&ch->lock);
+
+	if(ch->running) {
+		pthread_mutex_unlock(&ch->lock);
+		STAT_INC(status->stats.chans[chan].rejects);
+		return -1;
+	}
+
+	ch->running = true;
+	ch->slot = slot;
+	ch->chain.cmds = NULL;
+	ch->callback = callback;
+	ch->user_data = user_data;
+	ch->token = stage->token;
+	ch->bytes = req_bytes(stage);
+	start_request(status, chan, slot_iova(status, slot), submit_ns);
+	STAT_INC(status->stats.chans[chan].submits);
+
+	pthread_mutex_unlock(&ch->lock);
+
+	return 0;
+}
+
+/*
+ * the stage running on chan is over: start what queued behind it
+ * */
+static void complete_stage(struct pl330_status *status, uint chan)
+{
+	struct channel_thread *ch = &status->ch_threads[chan];
+	struct pending_req done;
+
+	pthread_mutex_lock(&ch->lock);
+	next_request(status, chan, &done);
+	pthread_mutex_unlock(&ch->lock);
+
+	finish_request(status, chan, &done);
+}
+
+static void dep_chain_done(void *user_data)
+{
+	struct dep_chain_ctx *ctx = user_data;
+	struct pl330_status *status = ctx->status;
+	uint i;
+
+	// the last stage waited for all the others
+	for(i = 0; i < ctx->num_stages - 1; i++) {
+		complete_stage(status, ctx->chans[i]);
+		pl330_vfio_free_event(status, ctx->events[i]);
+	}
+
+	if(ctx->callback) {
+		ctx->callback(ctx->user_data);
+	}
+
+	free(ctx);
+}
+
+int pl330_vfio_submit_chain(struct pl330_status *status,
+				struct req_config *stages, uint num_stages)
+{
+	struct dep_chain_ctx *ctx;
+	struct req_config *conf;
+	int slots[MANAGER_ID];
+	uint num_slots = 0, num_events = 0, i, j;
+	uint last = num_stages - 1;
+
+	if(num_stages < 2 || num_stages > status->channels) {
+		return -1;
+	}
+
+	for(i = 0; i < num_stages; i++) {
+		if(stages[i].chan_id >= status->channels) {
+			return -1;
+		}
+		for(j = 0; j < i; j++) {
+			if(stages[j].chan_id == stages[i].chan_id) {
+				return -1;
+			}
+		}
+	}
+
+	ctx = malloc(sizeof(*ctx));
+	if(!ctx) {
+		return -1;
+	}
+
+	ctx->status = status;
+	ctx->num_stages = num_stages;
+	ctx->callback = stages[last].callback;
+	ctx->user_data = stages[last].user_data;
+
+	for(i = 0; i < num_stages; i++) {
+		conf = &stages[i];
+		ctx->chans[i] = conf->chan_id;
+
+		conf->wait_event = i ? ctx->events[i - 1] : -1;
+		conf->signal_event = -1;
+		if(i < last) {
+			ctx->events[i] = pl330_vfio_alloc_event(status);
+			if(ctx->events[i] < 0) {
+				goto fail;
+			}
+			num_events++;
+			conf->signal_event = ctx->events[i];
+		}
+
+		// only the last stage wakes up the CPU
+		conf->int_fin = (i == last);
+		conf->c_mode = COMPLETION_IRQ;
+
+		if(check_slot_fit(status, conf) || chain_needed(conf)) {
+			goto fail;
+		}
+
+		slots[i] = get_slot(status);
+		if(slots[i] < 0) {
+			STAT_INC(status->stats.no_slot);
+			goto fail;
+		}
+		num_slots++;
 
-	if(conf->int_fin) {
-		status->ch_threads[conf->chan_id].callback =
-					conf->callback;
-		status->ch_threads[conf->chan_id].user_data =
-					conf->user_data;
+		if(generate_cmds_from_request(status,
+				slot_cmds(status, slots[i]), conf) < 0) {
+			goto fail;
+		}
 	}
 
-	submit_to_DBGINST(ins_debug, MANAGER_ID);
+	enable_int_for_req(status, &stages[last]);
+
+	// a stage waits for the previous one, arm it first
+	for(i = num_stages; i--; ) {
+		if(!arm_stage(status, &stages[i], slots[i],
+				i == last ? dep_chain_done : stages[i].callback,
+				i == last ? ctx : stages[i].user_data)) {
+			continue;
+		}
+
+		// the stages already armed wait for an event that won't come
+		for(j = i + 1; j < num_stages; j++) {
+			stop_thread(status, stages[j].chan_id);
+		}
+		num_slots = i + 1;
+		goto fail;
+	}
 
 	return 0;
+
+fail:
+	for(i = 0; i < num_slots; i++) {
+		put_slot(status, slots[i]);
+	}
+	for(i = 0; i < num_events; i++) {
+		pl330_vfio_free_event(status, ctx->events[i]);
+	}
+	free(ctx);
+
+	return -1;
 }
 
-int pl330_vfio_mem2mem_int(uchar *cmds, u64 iova_cmds,
-					u64 iova_src, u64 iova_dst)
+int pl330_vfio_mem2mem_int(struct pl330_status *status, uchar *cmds,
+				u64 iova_cmds, u64 iova_src, u64 iova_dst)
 {
 	int offset = 0;
 	struct req_config config;
@@ -651,10 +2968,6 @@ int pl330_vfio_mem2mem_int(uchar *cmds, u64 iova_cmds,
 
 	offset += insert_DMAEND(&cmds[offset]);
 
-	if (!is_dmac_idle()) {
-		return -1;
-	}
-
 	uchar ins_debug[6] = {0, 0, 0, 0, 0, 0};
 
 	uchar channel_id = 0;
@@ -663,91 +2976,79 @@ int pl330_vfio_mem2mem_int(uchar *cmds, u64 iova_cmds,
 	insert_DMAGO(ins_debug, channel_id, iova_cmds,
 			non_secure);
 
-	submit_to_DBGINST(ins_debug, MANAGER_ID);
+	debug_exec(status, ins_debug, MANAGER_ID);
 
 	return 0;
 }
 
-static void fdset_insert(gpointer key, gpointer val, gpointer nodata)
-{
-	// the key is the eventfd number
-	FD_SET(*((int *)key), &status->set_irq_efd);
-}
-
-static void restore_fdset()
+static void handle_irq_line(struct irq_line *line)
 {
-	FD_ZERO(&status->set_irq_efd);
-
-	g_hash_table_foreach(status->efdnum_irqnum, fdset_insert, NULL);
-}
+	eventfd_t eval;
 
-static void handle_trigger_fdset(gpointer key, gpointer val, gpointer mask)
-{
-	if(FD_ISSET(*(int *)key, &status->set_irq_efd)) {
-		// clear irq
-		pl330_vfio_clear_irq(*(int *)val);
-		// restore eventfd
-		eventfd_t eval;
-		if(eventfd_read(*(int *)key, &eval)) {
-			error(-1, errno, "error while reading from eventfd");
-		}
-		// trigger callback
-		struct channel_thread *ch = &status->ch_threads[*(int *)val];
-		if(ch->callback != NULL) {
-			ch->callback(ch->user_data);
-		}
+	// restore eventfd
+	if(eventfd_read(line->eventfd, &eval)) {
+		error(-1, errno, "error while reading from eventfd");
 	}
 }
 
 static void *irq_handler_func(void *arg)
 {
-	int *irq_num;
-	int efd_num;
-	int irq_triggered_mask = 0;
+	struct pl330_status *status = arg;
+	struct epoll_event events[MAX_IRQ_LINES];
+	int i, n;
 
 	while (1) {
 		/*
 		 * waiting for I/O, in this case for the notification
 		 * of an interrupt
 		 * */
-		efd_num = select(status->highest_irq_num + 1, &status->set_irq_efd,
-								NULL, NULL, NULL);
-		printf("TRIGGER!\n");
+		n = epoll_wait(status->epoll_fd, events, MAX_IRQ_LINES, -1);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			error(-1, errno, "error while waiting for irqs");
+		}
+		STAT_INC(status->stats.irq_wakeups);
+		TRACE(status, IRQ, PL330_TRACE_NO_CHAN, n);
 
-		g_hash_table_foreach(status->efdnum_irqnum, handle_trigger_fdset,
-							&irq_triggered_mask);
+		for(i = 0; i < n; i++) {
+			handle_irq_line(&status->irq_lines[events[i].data.u32]);
+		}
 
-		restore_fdset();
+		// one pass covers all the channels completed by now
+		dispatch_irqs(status);
 	}
+
+	return NULL;
 }
 
-void pl330_vfio_start_irq_handler()
+void pl330_vfio_start_irq_handler(struct pl330_status *status)
 {
 	int ret;
 
-	ret = pthread_create(&status->irq_handler, NULL, irq_handler_func, NULL);
+	ret = pthread_create(&status->irq_handler, NULL, irq_handler_func,
+								status);
 
 	if(ret) {
-		error(-1, "unable to create irq thread");
+		error(-1, ret, "unable to create irq thread");
 	}
+	status->irq_handler_started = true;
 }
 
-void pl330_vfio_clear_irq(int irq_num)
+void pl330_vfio_clear_irq(struct pl330_status *status, int irq_num)
 {
-	uint *int_reg = (uint *)(status->regs + INTEN);
-	uint *cl_irq_reg = (uint *)(status->regs + INTCLR);
-
-	if(*int_reg & (1 << irq_num)) {
+	if(reg_read(status, INTEN) & (1 << irq_num)) {
 		// clear it
-		*cl_irq_reg = (1 << irq_num);
+		reg_write(status, INTCLR, 1 << irq_num);
 	}
 }
 
-static uint thread_state(uint id)
+static uint thread_state(struct pl330_status *status, uint id)
 {
 	uint state_reg, state;
 	if(id == MANAGER_ID) {
-		state_reg = *((uint *)(status->regs + DSR));
+		state_reg = reg_read(status, DSR);
 		state = shift_and_mask(state_reg,
 				DSR_STATUS_SHIFT, DSR_STATUS_MASK);
 		switch(state) {
@@ -762,7 +3063,7 @@ static uint thread_state(uint id)
 			return INVALID_STATE;
 		}
 	} else {
-		state_reg = *((uint *)(status->regs + CSR(id)));
+		state_reg = reg_read(status, CSR(id));
 		state = shift_and_mask(state_reg,
 				CSR_CHANNEL_STATUS_SH, CSR_CHANNEL_STATUS_MK);
 		switch(state) {
@@ -784,92 +3085,212 @@ static uint thread_state(uint id)
 	}
 }
 
-static void stop_thread(uint id)
+/*
+ * kill the thread id, the manager or a channel. Returns the requests
+ * of the channel dropped, running or queued
+ * */
+static uint stop_thread(struct pl330_status *status, uint id)
 {
 	uchar ins_debug[6] = {0, 0, 0, 0, 0, 0};
-	uint int_reg, state;
+	uint state, dropped = 0;
+
+	if(id > MANAGER_ID || (id != MANAGER_ID && id >= status->channels)) {
+		error(-1, EINVAL, "invalid channel id");
+	}
+
+	if(id < MANAGER_ID) {
+		struct channel_thread *ch = &status->ch_threads[id];
+		struct pending_req *req;
 
-	if(id > MANAGER_ID) {
-		error(-1, "invalid channel id");
+		/*
+		 * drop the running request and those still waiting for the
+		 * channel: their tokens complete as cancelled, the callbacks
+		 * are not called
+		 * */
+		pthread_mutex_lock(&ch->lock);
+		if(ch->running) {
+			if(ch->token) {
+				complete_token(status, ch->token, true);
+			}
+			dropped++;
+		}
+		put_slot(status, ch->slot);
+		dropped += ch->queue_cnt;
+		while(ch->queue_cnt) {
+			req = &ch->queue[ch->queue_head];
+			if(req->token) {
+				complete_token(status, req->token, true);
+			}
+			put_slot(status, req->slot);
+			ch->queue_head = (ch->queue_head + 1) % CHANNEL_QUEUE_LEN;
+			ch->queue_cnt--;
+		}
+		ch->running = false;
+		ch->token = NULL;
+		ch->slot = -1;
+		ch->chain.cmds = NULL;
+		pthread_mutex_unlock(&ch->lock);
 	}
 
-	state = thread_state(id);
+	state = thread_state(status, id);
 	if(state == INVALID_STATE) {
-		error(-1, "invalid state");
+		error(-1, EINVAL, "invalid state");
 	}
 
 	switch(state) {
 		case STOPPED:
 		case KILLING:
 		case COMPLETING:
-			printf("thread %d already stopped\n", id);
+			DEBUG_MSG("thread %d already stopped\n", id);
 			// nothing to do
-			return;
+			return dropped;
 		default:
 			break;
 	}
 
-	// stop interrupt for channel id
-	int_reg = *((uint *)(status->regs + INTEN));
-	*((uint *)(status->regs + INTEN)) = int_reg
-		& ~(1 << status->ch_threads[id].event_id);
-	printf("closing event %d for thread %d", status->ch_threads[id].event_id, id);
+	/*
+	 * stop interrupt for channel id; the manager has no ch_threads
+	 * entry, a channel never requested has no event
+	 * */
+	if(id < MANAGER_ID && status->ch_threads[id].event_id >= 0) {
+		update_inten(status, 0, 1U << status->ch_threads[id].event_id);
+		DEBUG_MSG("closing event %d for thread %d\n",
+				status->ch_threads[id].event_id, id);
+	}
 
 	insert_DMAKILL(ins_debug);
 
-	submit_to_DBGINST(ins_debug, id);
+	debug_exec(status, ins_debug, id);
+	if(id < MANAGER_ID) {
+		STAT_INC(status->stats.chans[id].kills);
+	}
+
+	return dropped;
 }
 
-int pl330_vfio_request_channel()
+/*
+ * set the lowest clear bit of allocated_events in [first, last) with a
+ * compare and swap, so that concurrent callers never get the same bit.
+ * Returns the bit, -1 if all of them are set
+ * */
+static int claim_bit(struct pl330_status *status, uint first, uint last)
 {
-	int i;
-	int ret = -1;
-
-	for(i = 0; i <= status->channels; i++) {
-		if(status->ch_threads[i].state == FREE) {
-			ret = i;
-			if(status->allocated_events & (1 << i)) {
-				// the event is already allocated
-				error(-1, "event already allocated");
-			}
-			status->ch_threads[i].state = ALLOCATED;
-			status->ch_threads[i].event_id = i;
-			status->allocated_events |= (1 << i);
-			break;
+	uint map, free_bits, range;
+	int bit;
+
+	if(first >= last) {
+		return -1;
+	}
+	range = (last - first == 32 ? ~0U : ((1U << (last - first)) - 1))
+								<< first;
+
+	map = __atomic_load_n(&status->allocated_events, __ATOMIC_RELAXED);
+	do {
+		free_bits = ~map & range;
+		if(!free_bits) {
+			return -1;
 		}
+		bit = __builtin_ctz(free_bits);
+	} while(!__atomic_compare_exchange_n(&status->allocated_events, &map,
+				map | (1U << bit), true,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return bit;
+}
+
+static void release_bit(struct pl330_status *status, uint bit)
+{
+	__atomic_and_fetch(&status->allocated_events, ~(1U << bit),
+							__ATOMIC_RELEASE);
+}
+
+int pl330_vfio_request_channel(struct pl330_status *status)
+{
+	int ret;
+
+	// the channel comes with its completion event, the same bit
+	ret = claim_bit(status, 0, status->channels);
+	if(ret >= 0) {
+		status->ch_threads[ret].state = ALLOCATED;
+		status->ch_threads[ret].event_id = ret;
 	}
-	printf("allocated thread %d\n", ret);
+	DEBUG_MSG("allocated thread %d\n", ret);
 
 	return ret;
 }
 
-void pl330_vfio_release_channel(uint id)
+void pl330_vfio_release_channel(struct pl330_status *status, uint id)
 {
-	status->allocated_events &= ~(1 << id);
+	if(id >= status->channels) {
+		return;
+	}
+
 	status->ch_threads[id].state = FREE;
 	status->ch_threads[id].event_id = -1;
+	release_bit(status, id);
+}
+
+int pl330_vfio_alloc_event(struct pl330_status *status)
+{
+	int event;
+
+	// the first ones are the completion events of the channels
+	event = claim_bit(status, status->channels, status->cr0.num_events);
+	if(event >= 0) {
+		// an interrupt would take the place of the event
+		update_inten(status, 0, 1U << event);
+	}
+
+	return event;
+}
+
+void pl330_vfio_free_event(struct pl330_status *status, int event)
+{
+	if(event < (int)status->channels || event >= status->cr0.num_events) {
+		return;
+	}
+
+	release_bit(status, event);
 }
 
-void pl330_vfio_reset()
+void pl330_vfio_reset(struct pl330_status *status)
 {
 	int i;
 
 	// stop the manager
-	stop_thread(MANAGER_ID);
+	stop_thread(status, MANAGER_ID);
 
 	// stop all the channels
 	for(i = 0; i < status->channels; i++) {
-		stop_thread(i);
+		stop_thread(status, i);
 	}
 }
 
-void pl330_vfio_remove()
+void pl330_vfio_remove(struct pl330_status *status)
 {
-	// clear all interrups
-	uint *int_reg = (uint *)(status->regs + INTCLR);
-	*int_reg = 0;
+	uint events = status->cr0.num_events >= 32 ? ~0U :
+					(1U << status->cr0.num_events) - 1;
+	uint i;
+
+	// no more interrupts, clear the pending ones (write 1 to clear)
+	update_inten(status, 0, events);
+	reg_write(status, INTCLR, events);
+
+	if(status->irq_handler_started) {
+		pthread_cancel(status->irq_handler);
+		pthread_join(status->irq_handler, NULL);
+	}
+	close(status->epoll_fd);
+	close(status->completion_fd);
+
+	cmds_pool_destroy(status);
 
-	pthread_cancel(status->irq_handler);
+	for(i = 0; i < status->channels; i++) {
+		pthread_mutex_destroy(&status->ch_threads[i].lock);
+	}
+	free(status->ch_threads);
+	pthread_mutex_destroy(&status->irq_lock);
+	pthread_mutex_destroy(&status->inten_lock);
 
 	free(status);
 }
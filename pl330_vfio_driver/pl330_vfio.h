@@ -2,10 +2,10 @@
 #define PL330_VFIO_H
 
 #include <stdbool.h>
-#include <glib.h>
 #include <pthread.h>
 #include <linux/types.h>
-#include <sys/select.h>
+
+#include "pl330_vfio_dma.h"
 
 /*
  * Register offset
@@ -128,6 +128,12 @@
 #define DMAWMB			0x013
 #define DMAWMB_SIZE		1
 
+/*
+ * DMANOP
+ * */
+#define DMANOP			0x018
+#define DMANOP_SIZE		1
+
 /*
  * DMAGO
  */
@@ -146,6 +152,49 @@
 #define DMAKILL			0x001
 #define DMAKILL_SIZE		1
 
+/*
+ * DMASTZ
+ * */
+#define DMASTZ			0x00C
+#define DMASTZ_SIZE		1
+
+/*
+ * DMAWFE
+ * */
+#define DMAWFE			0x036
+#define DMAWFE_SIZE		2
+
+/*
+ * DMAWFP
+ * */
+#define DMAWFP			0x030
+#define DMAWFP_SIZE		2
+
+/*
+ * DMALDP
+ * */
+#define DMALDP			0x025
+#define DMALDP_SIZE		2
+
+/*
+ * DMASTP
+ * */
+#define DMASTP			0x029
+#define DMASTP_SIZE		2
+
+/*
+ * DMAFLUSHP
+ * */
+#define DMAFLUSHP		0x035
+#define DMAFLUSHP_SIZE		2
+
+/*
+ * DMAADDH, DMAADNH
+ * */
+#define DMAADDH			0x054
+#define DMAADNH			0x05C
+#define DMAADDH_SIZE		3
+
 /*
  * Channel Control Register - CCR
  */
@@ -176,7 +225,7 @@
 #define CCR_BURSTSIZE_MAX	16 // bytes
 #define CCR_BURSTLEN_MAX	16 // data transfers
 
-#define DEBUG 1
+// make DEBUG=1 prints every instruction generated
 #ifdef DEBUG
 #define DEBUG_MSG(fmt, ...)				\
 	do {						\
@@ -229,6 +278,18 @@ enum transfer_type {
 	DEV2MEM,
 };
 
+/*
+ * how the completion of a request is detected
+ * */
+enum completion_mode {
+	COMPLETION_IRQ,		// DMASEV, irq, eventfd, irq thread
+	COMPLETION_POLL,	// the submitter spins on the channel state
+	COMPLETION_HYBRID,	// spin for poll_ns, then fall back to the irq
+};
+
+// default spin budget of COMPLETION_HYBRID
+#define HYBRID_POLL_NS_DEF	20000
+
 struct controller_config {
 	bool non_secure_mode;
 };
@@ -249,17 +310,66 @@ struct req_config_ops {
 	int (*set_prot_control)(uint val, enum dst_src type, uint *reg);
 };
 
+/*
+ * one segment of a scatter-gather request
+ * */
+struct sg_entry {
+	__u64 iova_src;
+	__u64 iova_dst;
+
+	// bytes to transfer for this segment
+	int size;
+};
+
+/*
+ * completion token of a request, see pl330_vfio_token_init(): the
+ * caller tests it or waits on it, or collects it from the completion
+ * fd of the controller. It belongs to the library from the submit
+ * until it's done or, with notify, returned by
+ * pl330_vfio_poll_completions()
+ * */
+struct pl330_vfio_token {
+	uint state; // private to the library
+	bool notify;
+	struct pl330_vfio_token *next; // of pl330_vfio_poll_completions()
+};
+
 struct req_config {
 	// source and destination
 	__u64 iova_src;
 	__u64 iova_dst;
 
-	// bytes to transfer
-	int size;
+	// bytes to transfer, of every row for a 2D transfer
+	__u64 size;
+
+	/*
+	 * 2D transfer: when rows is not 0, rows rows of size bytes each,
+	 * a row starting src_stride (dst_stride) bytes after the start of
+	 * the previous one. MEM2MEM only, strides not below size.
+	 * */
+	unsigned int rows;
+	unsigned int src_stride;
+	unsigned int dst_stride;
+
+	/*
+	 * scatter-gather list. When sg_len is not 0, the segments are
+	 * transferred in order by a single channel program and
+	 * iova_src, iova_dst and size are ignored
+	 * */
+	struct sg_entry *sg_list;
+	unsigned int sg_len;
 
 	// type of the transfer (mem to mem, mem to dev, dev to mem)
 	enum transfer_type t_type;
 
+	/*
+	 * MEM2DEV and DEV2MEM only: peripheral request line and how the
+	 * peripheral asks for data, SINGLE (a beat per request) or BURST
+	 * (a burst per request, single requests for the beats left)
+	 * */
+	unsigned int periph_id;
+	enum request_type req_type;
+
 	/*
 	 * channel configuration
 	 */
@@ -267,6 +377,10 @@ struct req_config {
 	unsigned int src_inc;
 	unsigned int dst_inc;
 
+	/*
+	 * source and destination bursts have to be the same, a request
+	 * with different ones is refused
+	 * */
 	// burst size
 	unsigned int src_burst_size;
 	unsigned int dst_burst_size;
@@ -275,6 +389,12 @@ struct req_config {
 	unsigned int src_burst_len;
 	unsigned int dst_burst_len;
 
+	/*
+	 * choose burst size and length for every request with
+	 * pl330_vfio_tune_burst(), overwriting the ones above
+	 * */
+	bool burst_auto;
+
 	// channel to which submit the request
 	unsigned int chan_id;
 
@@ -294,10 +414,31 @@ struct req_config {
 	// arise an interrupt when the transfer is completed
 	bool int_fin;
 
+	/*
+	 * hardware dependencies, events from pl330_vfio_alloc_event() or
+	 * -1: the program waits for wait_event (DMAWFE) before moving
+	 * anything and signals signal_event (DMASEV) once it's done
+	 * */
+	int wait_event;
+	int signal_event;
+
+	/*
+	 * COMPLETION_POLL needs int_fin to be false and an idle channel,
+	 * the callback is called by the submitter before returning.
+	 * COMPLETION_HYBRID needs int_fin, the callback is called by the
+	 * submitter if the request completes within poll_ns, by the irq
+	 * thread otherwise; a queued request falls back to the irq.
+	 * */
+	enum completion_mode c_mode;
+	unsigned int poll_ns;
+
 	// callback to be called when the request has been served
 	void (*callback)(void *user_data);
 	void *user_data;
 
+	// completed after the callback, NULL if none
+	struct pl330_vfio_token *token;
+
 	struct req_config_ops config_ops;
 };
 
@@ -306,6 +447,48 @@ enum channel_thread_state {
 	ALLOCATED,
 };
 
+/*
+ * biggest number of bursts moved by one program, a pair of nested
+ * loops: longer transfers are split in chunks of this many bursts, so
+ * that the program of any transfer fits in a small slot
+ * */
+#define PROG_CHUNK_BURSTS	65536
+
+/*
+ * the chunks of a long transfer after the first one: every chunk is
+ * generated in the cmds buffer of the request when the previous
+ * completes, and the channel is started again
+ * */
+struct chunk_chain {
+	struct req_config conf; // the whole transfer
+	uchar *cmds; // NULL if the transfer fits in one program
+	u64 iova_cmds;
+	u64 next; // offset of the next chunk
+};
+
+/*
+ * max number of requests waiting for a channel
+ * */
+#define CHANNEL_QUEUE_LEN	16
+
+/*
+ * a request submitted while the channel was executing
+ * another one
+ * */
+struct pending_req {
+	u64 iova_cmds;
+	int slot; // slot of the cmds pool, -1 if cmds is not from the pool
+	struct chunk_chain chain;
+
+	void (* callback)(void *user_data);
+	void *user_data;
+	struct pl330_vfio_token *token;
+
+	// for the stats
+	u64 submit_ns;
+	u64 bytes;
+};
+
 struct channel_thread {
 	enum channel_thread_state state;
 	/*
@@ -316,12 +499,45 @@ struct channel_thread {
 	// callback when finished
 	void (* callback)(void *user_data);
 	void *user_data;
+	struct pl330_vfio_token *token;
+
+	// of the running request, for the stats
+	u64 go_ns;
+	u64 bytes;
+
+	/*
+	 * the channel is executing a request, the following ones are
+	 * queued and started by the irq handler, in order
+	 * */
+	bool running;
+	int slot; // pool slot of the running request, -1 if none
+	struct chunk_chain chain; // of the running request
+	struct pending_req queue[CHANNEL_QUEUE_LEN];
+	uint queue_head;
+	uint queue_cnt;
+
+	// protects running and the queue
+	pthread_mutex_t lock;
 };
 
 /*
- * init the controller
+ * handle of a controller: every controller has its own channels,
+ * events, irq thread and cmds pool. The functions below take the
+ * handle of the controller they act on
  * */
-void pl330_vfio_init(uchar *base_regs);
+struct pl330_status;
+
+/*
+ * init the controller, returns its handle
+ * */
+struct pl330_status *pl330_vfio_init(uchar *base_regs);
+
+/*
+ * init the controller on the software model instead of the registers
+ * mapped through VFIO, see pl330_model.h
+ * */
+struct pl330_model;
+struct pl330_status *pl330_vfio_init_model(struct pl330_model *model);
 
 /*
  * fill config with default value for a mem2mem transfer:
@@ -329,26 +545,142 @@ void pl330_vfio_init(uchar *base_regs);
  * 	config_ops
  * 	src_inc, dst_inc at def val
  * 	src_cache_ctrl, dst_cache_ctrl at def val
- * 	src_burst_size, dst_burst_size at max
- * 	src_burst_len, dst_burst_len at max
- *	t_type = MEM2MEM
+ * 	src_burst_size, dst_burst_size at the widest legal burst
+ * 	src_burst_len, dst_burst_len at the widest legal burst
+ * 	burst_auto = true, set it to false to keep your own bursts
+ *	t_type = MEM2MEM, periph_id = 0, req_type = BURST
+ *	rows = 0
+ *	wait_event = signal_event = -1
+ *	sg_list = NULL, sg_len = 0
+ *	c_mode = COMPLETION_IRQ, poll_ns = HYBRID_POLL_NS_DEF
  *
  *	Remember that iova_src, iova_dst and size
  *	are still to be set
  * */
-int pl330_vfio_mem2mem_defconfig(struct req_config *config);
+int pl330_vfio_mem2mem_defconfig(struct pl330_status *status,
+						struct req_config *config);
+
+/*
+ * fill config with default value for a transfer from or to the
+ * peripheral periph_id (t_type MEM2DEV or DEV2MEM): as
+ * pl330_vfio_mem2mem_defconfig(), but
+ * 	the device address is not incremented
+ * 	bursts of 4 x 4 bytes, burst_auto = false: the burst must match
+ * 	the FIFO of the device, set it if it differs
+ * 	req_type = BURST
+ *
+ * The addresses and the size must be aligned to the burst size.
+ * Returns -1 if the controller has no such peripheral
+ * */
+int pl330_vfio_dev_defconfig(struct pl330_status *status,
+				struct req_config *config,
+			enum transfer_type t_type, unsigned int periph_id);
+
+/*
+ * choose the widest burst for the transfer of config: the burst size
+ * is bounded by the AXI bus width (CRD) and by the relative alignment
+ * of source and destination, the burst length by the share of the
+ * MFIFO of every channel. Neither is bigger than the transfer needs:
+ * size (the longest segment, a row) caps the bytes of a burst.
+ *
+ * Called by generate_cmds_from_request(), pl330_vfio_cmds_len() and
+ * pl330_vfio_submit() when config->burst_auto is set.
+ * Bursts of MEM2DEV and DEV2MEM transfers are left as they are, the
+ * device sets them with the depth of its FIFO; so are those of a fixed
+ * source (src_inc = 0, e.g. pl330_vfio_fill()), where a beat has to be
+ * the width of the pattern.
+ * Returns -1 if the size is not valid
+ * */
+int pl330_vfio_tune_burst(struct pl330_status *status,
+						struct req_config *config);
 
 /*
  * fill the buffer with the instructions needed to realize
- * the transfer configured by config
+ * the transfer configured by config.
+ * Any size and alignment is allowed: single bytes are moved up to the
+ * alignment of the source to the burst size, then full bursts, then
+ * single beats and bytes for what is left, changing CCR in between.
+ *
+ * A transfer longer than PROG_CHUNK_BURSTS bursts (not scatter-gather)
+ * gets the program of its first chunk only: the driver generates the
+ * following ones in the same buffer, see pl330_vfio_submit_req().
+ * For scatter-gather requests SAR and DAR are reloaded before
+ * every segment and only one event is raised, at the end.
+ *
+ * MEM2DEV and DEV2MEM transfers flush the peripheral, then wait for
+ * its request (DMAWFP) before every burst and acknowledge it with
+ * DMASTP/DMALDP on the device side. They have no head and no tail:
+ * addresses and size must be aligned to the burst size.
+ *
+ * A 2D transfer is a single program too: the rows loop around the
+ * program of a row, DMAADDH moves SAR and DAR to the next row. Bursts
+ * don't cross rows and the source stride (the destination stride for
+ * a fixed source) must be a multiple of the burst size; a row has to
+ * fit in the 255 bytes a loop can jump back.
+ *
+ * A fixed source (src_inc = 0, MEM2MEM) is taken as a pattern of the
+ * burst size: the head aligns the destination and the head and tail
+ * beats are as wide as the alignment of iova_dst and size allows.
+ *
+ * A program with a wait_event starts with DMAWFE, one with a
+ * signal_event raises it before the completion event; for a long
+ * transfer, the first chunk waits and the last one signals.
+ *
+ * Programs are cached by shape (size, rows and strides, CCR, burst
+ * size/length, t_type, periph_id, req_type, int_fin, dependencies,
+ * alignment of iova_src, of iova_dst for a fixed source): a request
+ * with a known shape only copies the cached program and patches SAR,
+ * DAR and the event. Every controller has its cache, cmds_buf may be
+ * written by anyone between two calls.
+ *
+ * Returns the length of the program in bytes, -1 on error
  * */
-int generate_cmds_from_request(uchar *cmds_buf, struct req_config *config);
+int generate_cmds_from_request(struct pl330_status *status, uchar *cmds_buf,
+						struct req_config *config);
 
 /*
- * TODO describe
+ * upper bound of the length of the program generated for config,
+ * -1 if the request can't be transferred.
+ * Bounded for any size, except for scatter-gather requests
  * */
-int pl330_vfio_request_channel();
-void pl330_vfio_release_channel(uint id);
+int pl330_vfio_cmds_len(struct pl330_status *status,
+						struct req_config *config);
+
+/*
+ * a free channel, with its completion event, -1 if none is free.
+ * Channels and events can be allocated and released from any thread
+ * */
+int pl330_vfio_request_channel(struct pl330_status *status);
+void pl330_vfio_release_channel(struct pl330_status *status, uint id);
+
+/*
+ * events for hardware dependencies between channels. The first
+ * events are the completion events of the channels, the others can be
+ * allocated; their interrupt stays disabled, a DMASEV keeps them
+ * active until a DMAWFE clears them.
+ * Returns the event, -1 if none is free
+ * */
+int pl330_vfio_alloc_event(struct pl330_status *status);
+void pl330_vfio_free_event(struct pl330_status *status, int event);
+
+/*
+ * run the num_stages requests of stages one after the other, each on
+ * its own channel (chan_id), without the CPU in between: every stage
+ * but the first waits for an event signalled by the previous one at
+ * its end. All the stages are armed here, the last first.
+ *
+ * Only the last stage raises the completion interrupt; then the
+ * callbacks of all the stages are called, in order, and the channels
+ * can take other requests. The events are allocated and freed here,
+ * int_fin, c_mode, wait_event and signal_event of the stages are
+ * overwritten. The stages can't be longer than a program (see
+ * PROG_CHUNK_BURSTS).
+ *
+ * Returns -1 if a channel is busy or repeated, if no slot or event is
+ * free, or if a program doesn't fit in a slot
+ * */
+int pl330_vfio_submit_chain(struct pl330_status *status,
+		struct req_config *stages, unsigned int num_stages);
 
 /*
  * handy function to test mem to mem transactions
@@ -358,30 +690,192 @@ void pl330_vfio_release_channel(uint id);
  * For such a transaction only, 1KB is more than enough.
  *
  * */
-int pl330_vfio_mem2mem_int(uchar *cmds, u64 iova_cmds, u64 iova_src, u64 iova_dst);
+int pl330_vfio_mem2mem_int(struct pl330_status *status, uchar *cmds,
+			u64 iova_cmds, u64 iova_src, u64 iova_dst);
 
 /*
  * Tell to the controller where the instructions are
- * and instruct it to go
+ * and instruct it to go.
+ *
+ * If the channel is still executing a previous request, the new one
+ * is queued and started as soon as the previous completes; this needs
+ * conf->int_fin, the completion interrupt is what moves the queue.
+ * cmds must stay untouched until the request is completed: the chunks
+ * of a long transfer are generated there, when the previous completes;
+ * chaining needs int_fin, or COMPLETION_POLL.
+ *
+ * Returns -1 if the queue of the channel is full, if a request
+ * without int_fin needs chunks or finds the channel busy, or if the
+ * channel is still executing a request without int_fin: the call never
+ * waits for the channel to stop
+ * */
+int pl330_vfio_submit_req(struct pl330_status *status, uchar *cmds,
+			u64 iova_cmds, struct req_config *conf);
+
+/*
+ * Pool of microcode buffers owned by the library.
+ *
+ * num_slots buffers of slot_size bytes are allocated and mapped through
+ * mmu once; pl330_vfio_submit() takes a slot for every request and gives
+ * it back when the completion interrupt arrives.
+ * */
+int pl330_vfio_cmds_pool_init(struct pl330_status *status,
+		struct pl330_iommu *mmu, uint slot_size, uint num_slots);
+
+/*
+ * requests of the pool not completed yet, slots taken
+ * */
+uint pl330_vfio_inflight(struct pl330_status *status);
+
+/*
+ * generate the program for conf in a slot of the pool and submit it,
+ * as pl330_vfio_submit_req() does. int_fin is forced, unless c_mode is
+ * COMPLETION_POLL; the completion recycles the slot.
+ *
+ * Returns -1 if no slot is free, if the program doesn't fit in a slot
+ * or if the request can't be queued
+ * */
+int pl330_vfio_submit(struct pl330_status *status, struct req_config *conf);
+
+/*
+ * widest pattern of pl330_vfio_fill(), in bytes
+ * */
+#define FILL_PATTERN_MAX	CCR_BURSTSIZE_MAX
+
+/*
+ * fill size bytes from iova_dst repeating a pattern of 8, 16, 32, 64
+ * or 128 bits, as pl330_vfio_submit() does for a copy: conf comes from
+ * pl330_vfio_mem2mem_defconfig() with iova_dst, size and chan_id set,
+ * the CPU never touches the destination.
+ * The pattern is kept at the end of the slot of the request, the
+ * source doesn't increment and reads it at every beat; iova_src,
+ * src_inc and the bursts of conf are set here.
+ *
+ * Returns -1 if iova_dst or size are not aligned to the pattern, if
+ * the pattern is wider than the bus, if no slot is free or the slot
+ * can't hold both program and pattern, or if the request can't be queued
+ * */
+int pl330_vfio_fill(struct pl330_status *status, struct req_config *conf,
+		const void *pattern, unsigned int pattern_bits);
+
+/*
+ * copy size bytes from iova_src to iova_dst splitting the transfer
+ * in stripes, aligned to the burst, across up to num_chans free channels.
+ * Every stripe is a request of the cmds pool; callback is called once,
+ * when the last stripe completes, and the channels are released.
+ * The bytes left over by the bursts go to the last stripe.
+ *
+ * Returns -1 if no channel or slot is free, or if a stripe can't be
+ * submitted: the stripes already started are stopped, callback is not
+ * called and the destination is left partly written
+ * */
+int pl330_vfio_copy_striped(struct pl330_status *status,
+		u64 iova_src, u64 iova_dst, u64 size,
+		uint num_chans, void (*callback)(void *user_data),
+		void *user_data);
+
+/*
+ * prepare token for a request (req_config.token). With notify the
+ * token is queued on the controller when done, and the completion fd
+ * becomes readable
+ * */
+void pl330_vfio_token_init(struct pl330_vfio_token *token, bool notify);
+
+/*
+ * true if the request of token has completed, also if cancelled
+ * */
+bool pl330_vfio_token_test(struct pl330_vfio_token *token);
+
+/*
+ * true if the request of token was dropped instead of completing: its
+ * channel was killed by a fault in COMPLETION_POLL, by a chunk of a
+ * long transfer whose program couldn't be generated, by the unwind of
+ * a failed pl330_vfio_submit_chain() or by pl330_vfio_reset(), with the
+ * request running or queued. A cancelled token is done as any other:
+ * pl330_vfio_token_wait() returns, a token with notify is queued for
+ * pl330_vfio_poll_completions(). The callback of a cancelled request
+ * is not called, its destination is left partly written
+ * */
+bool pl330_vfio_token_cancelled(struct pl330_vfio_token *token);
+
+/*
+ * sleep until the request of token completes, for timeout_ms at most,
+ * forever if -1. Returns 0 if it has completed or was cancelled, -1 on
+ * timeout
+ * */
+int pl330_vfio_token_wait(struct pl330_vfio_token *token, int timeout_ms);
+
+/*
+ * eventfd readable while tokens with notify are waiting to be
+ * collected, to be added to the epoll set of the caller. Owned by the
+ * library, it is closed by pl330_vfio_remove()
+ * */
+int pl330_vfio_completion_fd(struct pl330_status *status);
+
+/*
+ * the tokens with notify done since the last call, in completion
+ * order, linked through next; NULL if none. Drains the completion fd
+ * */
+struct pl330_vfio_token *pl330_vfio_poll_completions(
+					struct pl330_status *status);
+
+/*
+ * Statistics
+ *
+ * Counters of the controller and of its channels, updated on the hot
+ * path with relaxed atomics. The latencies are histograms of log2
+ * buckets: bucket i counts the requests that took [2^i, 2^(i+1)) ns,
+ * the last bucket anything longer.
+ * */
+#define PL330_STATS_BUCKETS	40
+
+struct pl330_vfio_chan_stats {
+	u64 submits;		// requests accepted
+	u64 rejects;		// refused: channel busy or queue full
+	u64 dmagos;		// programs started, every chunk counts
+	u64 completions;	// requests completed
+	u64 bytes;		// moved by the completed requests
+	u64 kills;		// DMAKILL of the channel
+
+	// from the submit of the program to its first DMAGO
+	u64 submit_to_go[PL330_STATS_BUCKETS];
+	// from the first DMAGO to the completion, before the callback
+	u64 go_to_done[PL330_STATS_BUCKETS];
+};
+
+struct pl330_vfio_stats {
+	u64 no_slot;		// submit, fill or chain without a free slot
+	u64 dbg_busy;		// debug instructions that found DBGSTATUS busy
+	u64 irq_wakeups;	// of the irq thread
+	u64 irq_events;		// completion events read from INTMIS
+
+	struct pl330_vfio_chan_stats chans[MANAGER_ID];
+};
+
+/*
+ * copy the statistics of the controller in stats. Every counter is
+ * read atomically, the snapshot as a whole is not
  * */
-int pl330_vfio_submit_req(uchar *cmds, u64 iova_cmds, struct req_config *conf);
+void pl330_vfio_stats_snapshot(struct pl330_status *status,
+					struct pl330_vfio_stats *stats);
 
-void pl330_vfio_start_irq_handler();
-int pl330_vfio_add_irq(int eventfd_irq, int vfio_irq_index);
+void pl330_vfio_start_irq_handler(struct pl330_status *status);
+int pl330_vfio_add_irq(struct pl330_status *status, int eventfd_irq,
+							int vfio_irq_index);
 
 /*
  * Clear interrupt number num
  * */
-void pl330_vfio_clear_irq(int irq_num);
+void pl330_vfio_clear_irq(struct pl330_status *status, int irq_num);
 
 /*
  * For every available channel, check if it's in stopped state; if it's not,
  * force it to move into it. Stop also the manager thread.
  * */
-void pl330_vfio_reset();
+void pl330_vfio_reset(struct pl330_status *status);
 
 /*
- * Unload driver
+ * Unload driver, status is freed
  * */
-void pl330_vfio_remove();
+void pl330_vfio_remove(struct pl330_status *status);
 #endif
@@ -0,0 +1,426 @@
+#include "pl330_vfio_dma.h"
+
+#include <linux/types.h>
+#include <linux/vfio.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/*
+ * Buddy allocator: the window is made of blocks of 2^order pages,
+ * aligned to their size from the base of the window. A block is split
+ * in two buddies to allocate a smaller one and merged with its buddy
+ * when both are free again.
+ *
+ * The state is kept per page, in the page a block starts at: free
+ * blocks are linked in a list per order through it, allocated ones
+ * point to their mapping. The array is sized by the window, but pages
+ * no block starts at are never touched
+ * */
+#define BUDDY_ORDERS	32
+#define BUDDY_NIL	UINT32_MAX
+
+enum block_state {
+	BLOCK_NONE, // no block starts here
+	BLOCK_FREE,
+	BLOCK_USED,
+};
+
+struct dma_mapping {
+	struct pl330_dma_buf buf;
+	bool owned; // memory allocated by pl330_vfio_dma_alloc()
+	struct dma_mapping *prev;
+	struct dma_mapping *next;
+};
+
+struct buddy_page {
+	struct dma_mapping *mapping; // of a used block
+	uint32_t prev; // free list of the order, of a free block
+	uint32_t next;
+	__u8 order;
+	__u8 state;
+};
+
+struct pl330_iommu {
+	int container;
+	__u32 map_flags;
+	__u64 page_size;
+
+	__u64 iova_base;
+	uint32_t num_pages;
+	struct buddy_page *pages;
+	uint32_t free_heads[BUDDY_ORDERS];
+
+	// every mapping, to unmap them on destroy
+	struct dma_mapping *mappings;
+
+	/*
+	 * protects the blocks and the mappings; the lookups of the
+	 * model channels only read, they go in parallel
+	 * */
+	pthread_rwlock_t lock;
+};
+
+static inline __u64 page_align(struct pl330_iommu *mmu, __u64 size)
+{
+	return (size + mmu->page_size - 1) & ~(mmu->page_size - 1);
+}
+
+// the smallest order holding size bytes, size is page aligned
+static uint block_order(struct pl330_iommu *mmu, __u64 size)
+{
+	__u64 pages = size / mmu->page_size;
+	uint order = 0;
+
+	while(order < BUDDY_ORDERS && ((__u64)1 << order) < pages) {
+		order++;
+	}
+
+	return order;
+}
+
+static void push_free(struct pl330_iommu *mmu, uint32_t idx, uint order)
+{
+	struct buddy_page *page = &mmu->pages[idx];
+
+	page->state = BLOCK_FREE;
+	page->order = order;
+	page->prev = BUDDY_NIL;
+	page->next = mmu->free_heads[order];
+	if(page->next != BUDDY_NIL) {
+		mmu->pages[page->next].prev = idx;
+	}
+	mmu->free_heads[order] = idx;
+}
+
+static void unlink_free(struct pl330_iommu *mmu, uint32_t idx)
+{
+	struct buddy_page *page = &mmu->pages[idx];
+
+	if(page->prev != BUDDY_NIL) {
+		mmu->pages[page->prev].next = page->next;
+	} else {
+		mmu->free_heads[page->order] = page->next;
+	}
+	if(page->next != BUDDY_NIL) {
+		mmu->pages[page->next].prev = page->prev;
+	}
+	page->state = BLOCK_NONE;
+}
+
+/*
+ * take a free block of order, splitting the smallest larger one
+ * if there is none: O(orders)
+ * */
+static int iova_alloc(struct pl330_iommu *mmu, uint order, uint32_t *idx)
+{
+	uint k = order;
+
+	while(k < BUDDY_ORDERS && mmu->free_heads[k] == BUDDY_NIL) {
+		k++;
+	}
+	if(k >= BUDDY_ORDERS) {
+		return -1;
+	}
+
+	*idx = mmu->free_heads[k];
+	unlink_free(mmu, *idx);
+
+	// the upper halves stay free
+	while(k > order) {
+		k--;
+		push_free(mmu, *idx + (1U << k), k);
+	}
+
+	mmu->pages[*idx].state = BLOCK_USED;
+	mmu->pages[*idx].order = order;
+
+	return 0;
+}
+
+/*
+ * give a block back, merging it with its buddy for as long as
+ * the buddy is free: O(orders)
+ * */
+static void iova_release(struct pl330_iommu *mmu, uint32_t idx, uint order)
+{
+	struct buddy_page *buddy;
+	uint32_t pos;
+
+	mmu->pages[idx].state = BLOCK_NONE;
+	mmu->pages[idx].mapping = NULL;
+
+	while(order < BUDDY_ORDERS - 1) {
+		pos = idx ^ (1U << order);
+		if(pos >= mmu->num_pages) {
+			break;
+		}
+		buddy = &mmu->pages[pos];
+		if(buddy->state != BLOCK_FREE || buddy->order != order) {
+			break;
+		}
+		unlink_free(mmu, pos);
+		idx &= ~(1U << order);
+		order++;
+	}
+
+	push_free(mmu, idx, order);
+}
+
+/*
+ * the mapping iova belongs to, NULL if none: the used block holding
+ * the page of iova starts at the page rounded down to its order
+ * */
+static struct dma_mapping *find_mapping(struct pl330_iommu *mmu, __u64 iova)
+{
+	struct dma_mapping *mapping;
+	struct buddy_page *page;
+	uint32_t idx;
+	uint k;
+
+	if(iova < mmu->iova_base ||
+		(iova - mmu->iova_base) / mmu->page_size >= mmu->num_pages) {
+		return NULL;
+	}
+	idx = (iova - mmu->iova_base) / mmu->page_size;
+
+	for(k = 0; k < BUDDY_ORDERS; k++) {
+		page = &mmu->pages[idx & ~((1ULL << k) - 1)];
+		if(page->state == BLOCK_USED && page->order == k) {
+			mapping = page->mapping;
+			// the block can be larger than the mapping
+			if(iova - mapping->buf.iova < mapping->buf.size) {
+				return mapping;
+			}
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+struct pl330_iommu *pl330_vfio_iommu_init(int container, __u64 iova_base,
+					__u64 iova_size, __u32 map_flags)
+{
+	struct pl330_iommu *mmu;
+	uint32_t idx;
+	uint k;
+
+	mmu = malloc(sizeof(*mmu));
+	if(!mmu) {
+		return NULL;
+	}
+	memset(mmu, 0, sizeof(*mmu));
+
+	mmu->container = container;
+	mmu->map_flags = map_flags;
+	mmu->page_size = sysconf(_SC_PAGESIZE);
+
+	if((iova_base | iova_size) & (mmu->page_size - 1) || !iova_size ||
+			iova_size / mmu->page_size >= BUDDY_NIL) {
+		free(mmu);
+		return NULL;
+	}
+
+	mmu->iova_base = iova_base;
+	mmu->num_pages = iova_size / mmu->page_size;
+
+	// zeroed pages are only committed where a block starts
+	mmu->pages = calloc(mmu->num_pages, sizeof(*mmu->pages));
+	if(!mmu->pages) {
+		free(mmu);
+		return NULL;
+	}
+	memset(mmu->free_heads, 0xff, sizeof(mmu->free_heads));
+
+	// the largest aligned blocks that fit, the window needn't be 2^n pages
+	for(idx = 0; idx < mmu->num_pages; idx += 1U << k) {
+		k = 0;
+		while(k + 1 < BUDDY_ORDERS && !(idx & ((2U << k) - 1)) &&
+				(__u64)idx + (2U << k) <= mmu->num_pages) {
+			k++;
+		}
+		push_free(mmu, idx, k);
+	}
+
+	pthread_rwlock_init(&mmu->lock, NULL);
+
+	return mmu;
+}
+
+static void unmap_mapping(struct pl330_iommu *mmu, struct dma_mapping *mapping)
+{
+	struct vfio_iommu_type1_dma_unmap unmap = { .argsz = sizeof(unmap) };
+
+	unmap.iova = mapping->buf.iova;
+	unmap.size = mapping->buf.size;
+	if(mmu->container >= 0) {
+		ioctl(mmu->container, VFIO_IOMMU_UNMAP_DMA, &unmap);
+	}
+
+	if(mapping->owned) {
+		munmap(mapping->buf.vaddr, mapping->buf.size);
+	}
+}
+
+static int map_and_track(struct pl330_iommu *mmu, void *vaddr, __u64 size,
+				bool owned, struct pl330_dma_buf *buf)
+{
+	struct vfio_iommu_type1_dma_map map = { .argsz = sizeof(map) };
+	struct dma_mapping *mapping;
+	uint order = block_order(mmu, size);
+	uint32_t idx;
+
+	mapping = malloc(sizeof(*mapping));
+	if(!mapping) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&mmu->lock);
+
+	if(order >= BUDDY_ORDERS || iova_alloc(mmu, order, &idx)) {
+		goto err;
+	}
+
+	mapping->buf.vaddr = vaddr;
+	mapping->buf.iova = mmu->iova_base + idx * mmu->page_size;
+	mapping->buf.size = size;
+	mapping->owned = owned;
+
+	map.vaddr = (__u64)(uintptr_t)vaddr;
+	map.size = size;
+	map.iova = mapping->buf.iova;
+	map.flags = mmu->map_flags;
+
+	if(mmu->container >= 0 &&
+			ioctl(mmu->container, VFIO_IOMMU_MAP_DMA, &map)) {
+		iova_release(mmu, idx, order);
+		goto err;
+	}
+
+	mmu->pages[idx].mapping = mapping;
+	mapping->prev = NULL;
+	mapping->next = mmu->mappings;
+	if(mapping->next) {
+		mapping->next->prev = mapping;
+	}
+	mmu->mappings = mapping;
+
+	pthread_rwlock_unlock(&mmu->lock);
+
+	*buf = mapping->buf;
+
+	return 0;
+
+err:
+	pthread_rwlock_unlock(&mmu->lock);
+	free(mapping);
+
+	return -1;
+}
+
+int pl330_vfio_dma_alloc(struct pl330_iommu *mmu, __u64 size,
+					struct pl330_dma_buf *buf)
+{
+	void *vaddr;
+
+	if(!size) {
+		return -1;
+	}
+	size = page_align(mmu, size);
+
+	vaddr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(vaddr == MAP_FAILED) {
+		return -1;
+	}
+
+	if(map_and_track(mmu, vaddr, size, true, buf)) {
+		munmap(vaddr, size);
+		return -1;
+	}
+
+	return 0;
+}
+
+int pl330_vfio_dma_map(struct pl330_iommu *mmu, void *vaddr, __u64 size,
+					struct pl330_dma_buf *buf)
+{
+	if(!size || ((uintptr_t)vaddr | size) & (mmu->page_size - 1)) {
+		return -1;
+	}
+
+	return map_and_track(mmu, vaddr, size, false, buf);
+}
+
+int pl330_vfio_dma_free(struct pl330_iommu *mmu, struct pl330_dma_buf *buf)
+{
+	struct dma_mapping *mapping;
+
+	pthread_rwlock_wrlock(&mmu->lock);
+
+	mapping = find_mapping(mmu, buf->iova);
+	if(!mapping || mapping->buf.iova != buf->iova) {
+		pthread_rwlock_unlock(&mmu->lock);
+		return -1;
+	}
+
+	if(mapping->prev) {
+		mapping->prev->next = mapping->next;
+	} else {
+		mmu->mappings = mapping->next;
+	}
+	if(mapping->next) {
+		mapping->next->prev = mapping->prev;
+	}
+
+	unmap_mapping(mmu, mapping);
+	iova_release(mmu, (buf->iova - mmu->iova_base) / mmu->page_size,
+					block_order(mmu, mapping->buf.size));
+
+	pthread_rwlock_unlock(&mmu->lock);
+
+	free(mapping);
+
+	return 0;
+}
+
+void *pl330_vfio_iova_to_vaddr(struct pl330_iommu *mmu, __u64 iova,
+							__u64 *len)
+{
+	struct dma_mapping *mapping;
+	void *vaddr = NULL;
+
+	pthread_rwlock_rdlock(&mmu->lock);
+
+	mapping = find_mapping(mmu, iova);
+	if(mapping) {
+		vaddr = (char *)mapping->buf.vaddr + (iova - mapping->buf.iova);
+		*len = mapping->buf.size - (iova - mapping->buf.iova);
+	}
+
+	pthread_rwlock_unlock(&mmu->lock);
+
+	return vaddr;
+}
+
+void pl330_vfio_iommu_destroy(struct pl330_iommu *mmu)
+{
+	struct dma_mapping *mapping;
+
+	while((mapping = mmu->mappings)) {
+		mmu->mappings = mapping->next;
+		unmap_mapping(mmu, mapping);
+		free(mapping);
+	}
+	free(mmu->pages);
+
+	pthread_rwlock_destroy(&mmu->lock);
+	free(mmu);
+}
@@ -0,0 +1,75 @@
+#ifndef PL330_VFIO_DMA_H
+#define PL330_VFIO_DMA_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <linux/types.h>
+
+/*
+ * IOVA space and DMA mappings of a VFIO container
+ *
+ * The IOVA window given at init is handed out by a buddy allocator,
+ * in blocks of a power of two pages aligned to their size: a buffer
+ * takes its size rounded up to one of IOVA space (not of memory).
+ * A freed block is merged with its free buddy, so that the space
+ * doesn't fragment over map/unmap cycles. Allocating and freeing are
+ * O(log window).
+ * Every mapping made through VFIO_IOMMU_MAP_DMA is tracked until it is
+ * unmapped, from the block it starts: pl330_vfio_iova_to_vaddr() looks
+ * up the block holding an IOVA, O(log window) under a read lock.
+ * */
+
+/*
+ * a memory area the device can reach
+ * */
+struct pl330_dma_buf {
+	void *vaddr;
+	__u64 iova;
+	__u64 size;
+};
+
+struct pl330_iommu;
+
+/*
+ * manage the IOVA window [iova_base, iova_base + iova_size)
+ * of container. map_flags are the flags of every VFIO_IOMMU_MAP_DMA.
+ * With container -1 nothing is mapped in an IOMMU, the ranges are only
+ * tracked: that's what the software model (pl330_model.h) needs
+ * */
+struct pl330_iommu *pl330_vfio_iommu_init(int container, __u64 iova_base,
+					__u64 iova_size, __u32 map_flags);
+
+/*
+ * unmap everything still mapped and free the memory
+ * allocated by pl330_vfio_dma_alloc()
+ * */
+void pl330_vfio_iommu_destroy(struct pl330_iommu *mmu);
+
+/*
+ * allocate size bytes of memory (rounded up to the page size),
+ * reserve an IOVA range for it and map it
+ * */
+int pl330_vfio_dma_alloc(struct pl330_iommu *mmu, __u64 size,
+					struct pl330_dma_buf *buf);
+
+/*
+ * map memory owned by the caller, vaddr and size have to
+ * be page aligned
+ * */
+int pl330_vfio_dma_map(struct pl330_iommu *mmu, void *vaddr, __u64 size,
+					struct pl330_dma_buf *buf);
+
+/*
+ * unmap buf and give its IOVA range back; memory allocated by
+ * pl330_vfio_dma_alloc() is freed too
+ * */
+int pl330_vfio_dma_free(struct pl330_iommu *mmu, struct pl330_dma_buf *buf);
+
+/*
+ * host address of iova, NULL if iova is not mapped.
+ * *len is set to the number of bytes mapped from iova on
+ * */
+void *pl330_vfio_iova_to_vaddr(struct pl330_iommu *mmu, __u64 iova,
+							__u64 *len);
+
+#endif
@@ -0,0 +1,132 @@
+#include "pl330_vfio_group.h"
+
+#include <stdlib.h>
+
+struct group_ctrl {
+	struct pl330_status *status;
+	int *chans; // held by the group, -1 if not taken
+	uint next; // round robin over chans
+};
+
+struct pl330_vfio_group {
+	struct group_ctrl *ctrls;
+	uint num_ctrls;
+	uint chans_per_ctrl;
+};
+
+struct pl330_vfio_group *pl330_vfio_group_create(
+		struct pl330_status **ctrls, uint num_ctrls,
+		uint chans_per_ctrl)
+{
+	struct pl330_vfio_group *group;
+	struct group_ctrl *ctrl;
+	uint i, c;
+
+	if(!num_ctrls || !chans_per_ctrl) {
+		return NULL;
+	}
+
+	group = malloc(sizeof(*group));
+	if(!group) {
+		return NULL;
+	}
+	group->ctrls = calloc(num_ctrls, sizeof(*group->ctrls));
+	if(!group->ctrls) {
+		free(group);
+		return NULL;
+	}
+	group->num_ctrls = num_ctrls;
+	group->chans_per_ctrl = chans_per_ctrl;
+
+	for(i = 0; i < num_ctrls; i++) {
+		ctrl = &group->ctrls[i];
+		ctrl->status = ctrls[i];
+		ctrl->chans = malloc(chans_per_ctrl * sizeof(*ctrl->chans));
+		if(!ctrl->chans) {
+			goto fail;
+		}
+		for(c = 0; c < chans_per_ctrl; c++) {
+			ctrl->chans[c] = -1;
+		}
+		for(c = 0; c < chans_per_ctrl; c++) {
+			ctrl->chans[c] = pl330_vfio_request_channel(ctrls[i]);
+			if(ctrl->chans[c] < 0) {
+				goto fail;
+			}
+		}
+	}
+
+	return group;
+
+fail:
+	pl330_vfio_group_destroy(group);
+
+	return NULL;
+}
+
+void pl330_vfio_group_destroy(struct pl330_vfio_group *group)
+{
+	struct group_ctrl *ctrl;
+	uint i, c;
+
+	for(i = 0; i < group->num_ctrls; i++) {
+		ctrl = &group->ctrls[i];
+		if(!ctrl->chans) {
+			continue;
+		}
+		for(c = 0; c < group->chans_per_ctrl; c++) {
+			if(ctrl->chans[c] >= 0) {
+				pl330_vfio_release_channel(ctrl->status,
+								ctrl->chans[c]);
+			}
+		}
+		free(ctrl->chans);
+	}
+
+	free(group->ctrls);
+	free(group);
+}
+
+/*
+ * the controller with the fewest requests in flight, the first one
+ * on a tie
+ * */
+static uint least_loaded(struct pl330_vfio_group *group)
+{
+	uint i, best = 0, load, best_load = ~0U;
+
+	for(i = 0; i < group->num_ctrls; i++) {
+		load = pl330_vfio_inflight(group->ctrls[i].status);
+		if(load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+int pl330_vfio_group_submit(struct pl330_vfio_group *group,
+						struct req_config *conf)
+{
+	struct group_ctrl *ctrl;
+	uint first, i, k, c, chan;
+
+	// the others, in turn, if its channels are all full
+	first = least_loaded(group);
+	for(k = 0; k < group->num_ctrls; k++) {
+		i = (first + k) % group->num_ctrls;
+		ctrl = &group->ctrls[i];
+
+		for(c = 0; c < group->chans_per_ctrl; c++) {
+			chan = __atomic_fetch_add(&ctrl->next, 1,
+					__ATOMIC_RELAXED) % group->chans_per_ctrl;
+			conf->chan_id = ctrl->chans[chan];
+			if(!pl330_vfio_submit(ctrl->status, conf)) {
+				return i;
+			}
+		}
+	}
+
+	return -1;
+}
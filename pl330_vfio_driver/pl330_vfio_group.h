@@ -0,0 +1,48 @@
+#ifndef PL330_VFIO_GROUP_H
+#define PL330_VFIO_GROUP_H
+
+#include "pl330_vfio.h"
+
+/*
+ * Group of controllers
+ *
+ * Spreads the requests of one service over several controllers to
+ * aggregate their bandwidth. The group holds some channels of every
+ * controller; each request goes to the controller with the fewest
+ * requests in flight (see pl330_vfio_inflight()), on the next of its
+ * channels.
+ *
+ * The controllers are set up as usual (irq lines, cmds pool, irq
+ * thread) and outlive the group. The buffers of the requests must be
+ * reachable at the same IOVA from all of them, e.g. their VFIO groups
+ * share a container.
+ * */
+
+struct pl330_vfio_group;
+
+/*
+ * take chans_per_ctrl channels of each of the num_ctrls controllers.
+ * Returns NULL if a controller hasn't enough free channels
+ * */
+struct pl330_vfio_group *pl330_vfio_group_create(
+		struct pl330_status **ctrls, unsigned int num_ctrls,
+		unsigned int chans_per_ctrl);
+
+/*
+ * release the channels, the requests in flight must have completed
+ * */
+void pl330_vfio_group_destroy(struct pl330_vfio_group *group);
+
+/*
+ * pl330_vfio_submit() conf on the least loaded controller; conf comes
+ * from pl330_vfio_mem2mem_defconfig() of any controller of the group,
+ * chan_id is set here. Automatic bursts are tuned for the controller
+ * that takes the request.
+ *
+ * Returns the index in ctrls of the controller, -1 if none of them
+ * could take the request
+ * */
+int pl330_vfio_group_submit(struct pl330_vfio_group *group,
+						struct req_config *conf);
+
+#endif
@@ -1,4 +1,8 @@
 #include "pl330_vfio_driver/pl330_vfio.h"
+#include "pl330_vfio_driver/pl330_model.h"
+#include "pl330_vfio_driver/pl330_disasm.h"
+#include "pl330_vfio_driver/pl330_vfio_group.h"
+#include "pl330_vfio_driver/pl330_trace.h"
 
 #include <linux/vfio.h>
 #include <linux/types.h>
@@ -6,8 +10,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/eventfd.h>
 
@@ -19,87 +28,2335 @@
 
 #define VFIO_DMA_MAP_FLAG_EXEC		(1 << 2)
 
+#define IOVA_BASE			0x0
+#define IOVA_SIZE			0x10000000
+
+#define WAIT_DONE_MS			1000
+
 static void vfio_irqfd_clean(int device, unsigned int index)
 {
-    struct vfio_irq_set irq_set = {
-		.argsz = sizeof(irq_set),
-		.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER,
-		.index = index,
-		.start = 0,
-		.count = 0,
-	};
+    struct vfio_irq_set irq_set = {
+		.argsz = sizeof(irq_set),
+		.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER,
+		.index = index,
+		.start = 0,
+		.count = 0,
+	};
+
+	int ret = ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set);
+
+	if (ret) {
+		printf("Failure in %s for IRQ %d\n", __func__, index);
+		exit(1);
+	}
+}
+
+static void vfio_irqfd_init(int device, unsigned int index, int fd)
+{
+	struct vfio_irq_set *irq_set;
+	int32_t *pfd;
+	int ret, argsz;
+
+	argsz = sizeof(*irq_set) + sizeof(*pfd);
+	irq_set = malloc(argsz);
+
+	if (!irq_set) {
+		printf("Failure in %s allocating memory\n", __func__);
+		exit(1);
+	}
+
+	irq_set->argsz = argsz;
+	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set->index = index;
+	irq_set->start = 0;
+	irq_set->count = 1;
+	pfd = (int32_t *)&irq_set->data;
+	*pfd = fd;
+
+	ret = ioctl(device, VFIO_DEVICE_SET_IRQS, irq_set);
+	free(irq_set);
+
+	if (ret) {
+		printf("Failure in %s for IRQ %d\n", __func__, index);
+		exit(1);
+	}
+}
+
+static volatile bool transfer_done = false;
+
+void done_callback(void *user_data)
+{
+	printf("done!\n");
+	transfer_done = true;
+
+	char *ptr = (char *)user_data;
+	printf("the message is: %s\n", ptr);
+}
+
+/*
+ * copy a page with the controller and check it
+ * */
+static int run_copy_test(struct pl330_status *pl330,
+						struct pl330_iommu *mmu)
+{
+	// source memory area the DMA controller will read from
+	struct pl330_dma_buf dma_map_src;
+	// destination memory area the DMA controller will read to
+	struct pl330_dma_buf dma_map_dst;
+	int ret = 0;
+
+	// easy and safer map
+	int size_to_map = getpagesize();
+
+	// source map for the dma copy
+	ret = pl330_vfio_dma_alloc(mmu, size_to_map, &dma_map_src);
+	// destination map for the dma copy
+	ret |= pl330_vfio_dma_alloc(mmu, size_to_map, &dma_map_dst);
+
+	if(ret) {
+		printf("Could not map DMA memory\n");
+		return 1;
+	}
+
+	int *src_ptr = (int *)((uintptr_t)dma_map_src.vaddr);
+	int *dst_ptr = (int *)((uintptr_t)dma_map_dst.vaddr);
+
+	// fill with random data
+	int c;
+	int tot = dma_map_src.size/sizeof(*src_ptr);
+	srand(time(NULL));
+	for(c = 0; c < tot; c++) {
+		src_ptr[c] = rand();
+	}
+
+	printf("source value: 0x%x\n", *src_ptr);
+	printf("destination value: 0x%x\n", *dst_ptr);
+
+	printf("start thread\n");
+
+	// irq handler after setting up irqs
+	pl330_vfio_start_irq_handler(pl330);
+
+	struct req_config config;
+	pl330_vfio_mem2mem_defconfig(pl330, &config);
+
+	config.iova_src = dma_map_src.iova;
+	config.iova_dst = dma_map_dst.iova;
+	config.size	= dma_map_src.size;
+	config.int_fin  = true;
+
+	int channel_id;
+	channel_id = pl330_vfio_request_channel(pl330);
+	if(channel_id < 0) {
+		printf("fail! No channels available!\n");
+		return 1;
+	} else {
+		printf("channel %d allocated\n", channel_id);
+		config.chan_id = channel_id;
+	}
+
+	config.callback = done_callback;
+	char msg[] = "transfer completed";
+	config.user_data = msg;
+
+	/*
+	 * memory area where the DMA controller will grub the instructions
+	 * to execute, one slot per request. We will tell to the controller
+	 * how to reach these instructions through the DEBUG registers.
+	 */
+	if(pl330_vfio_cmds_pool_init(pl330, mmu, 256, size_to_map / 256)) {
+		printf("Could not map the commands pool\n");
+		return 1;
+	}
+
+	pl330_vfio_submit(pl330, &config);
+
+	// wait for the callback
+	for(c = 0; c < WAIT_DONE_MS && !transfer_done; c++) {
+		usleep(1000);
+	}
+	if(!transfer_done) {
+		printf("test failed! - transfer not completed\n");
+		ret = 1;
+	}
+
+	for(c = 0; c < tot; c++) {
+		if(src_ptr[c] != dst_ptr[c]) {
+			printf("test failed! - %d - 0x%x - 0x%x\n", c, src_ptr[c], dst_ptr[c]);
+			ret = 1;
+		}
+	}
+
+	pl330_vfio_reset(pl330);
+
+	/*
+	 * check result
+	 */
+	printf("source value: 0x%x\n", *((uint *)src_ptr));
+	printf("destination value: 0x%x\n", *((uint *)dst_ptr));
+
+	pl330_vfio_release_channel(pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * Model tests
+ *
+ * The tests below run on a controller of the software model only, with
+ * a pool of wider slots than the one of run_copy_test(). Every test
+ * starts from a random source and a zeroed destination and returns 1
+ * on failure; it releases the channels it takes and leaves no request
+ * in flight.
+ * */
+#define TEST_BUF_SIZE			(4 << 20)
+#define TEST_SLOT_SIZE			1024
+#define TEST_NUM_SLOTS			64
+
+// bytes around a destination the transfer must leave untouched
+#define TEST_GUARD			64
+
+#define WAIT_MODEL_MS			5000
+
+struct test_env {
+	struct pl330_status *pl330;
+	struct pl330_iommu *mmu;
+	struct pl330_model *model;
+	struct pl330_dma_buf src;
+	struct pl330_dma_buf dst;
+};
+
+static int callbacks;
+
+static void count_callback(void *user_data)
+{
+	(void)user_data;
+
+	__atomic_add_fetch(&callbacks, 1, __ATOMIC_RELAXED);
+}
+
+static int get_callbacks(void)
+{
+	return __atomic_load_n(&callbacks, __ATOMIC_RELAXED);
+}
+
+/*
+ * wait for n callbacks since the start of the test
+ * */
+static int wait_callbacks(int n)
+{
+	int c;
+
+	for(c = 0; c < WAIT_MODEL_MS && get_callbacks() < n; c++) {
+		usleep(1000);
+	}
+	if(get_callbacks() != n) {
+		printf("test failed! - %d callbacks, %d expected\n",
+						get_callbacks(), n);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * the bytes around [dst_off, dst_off + size) are still zero
+ * */
+static int check_guard(struct test_env *env, u64 dst_off, u64 size)
+{
+	uchar *dst = env->dst.vaddr;
+	u64 i, lo, hi;
+
+	lo = dst_off > TEST_GUARD ? dst_off - TEST_GUARD : 0;
+	hi = dst_off + size + TEST_GUARD;
+	if(hi > env->dst.size) {
+		hi = env->dst.size;
+	}
+
+	for(i = lo; i < hi; i++) {
+		if((i < dst_off || i >= dst_off + size) && dst[i]) {
+			printf("test failed! - byte 0x%llx written outside "
+				"[0x%llx, 0x%llx)\n", i, dst_off, dst_off + size);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * size bytes at dst_off are a copy of the source at src_off, and
+ * nothing around them was written
+ * */
+static int check_copy(struct test_env *env, u64 src_off, u64 dst_off,
+								u64 size)
+{
+	uchar *src = (uchar *)env->src.vaddr + src_off;
+	uchar *dst = (uchar *)env->dst.vaddr + dst_off;
+	u64 i;
+
+	for(i = 0; i < size; i++) {
+		if(src[i] != dst[i]) {
+			printf("test failed! - copy of 0x%llx bytes from 0x%llx "
+				"to 0x%llx differs at %llu - 0x%x - 0x%x\n",
+				size, src_off, dst_off, i, src[i], dst[i]);
+			return 1;
+		}
+	}
+
+	return check_guard(env, dst_off, size);
+}
+
+/*
+ * mem to mem request from src_off to dst_off, counted by
+ * count_callback()
+ * */
+static void copy_config(struct test_env *env, struct req_config *conf,
+		u64 src_off, u64 dst_off, u64 size, unsigned int chan_id)
+{
+	pl330_vfio_mem2mem_defconfig(env->pl330, conf);
+
+	conf->iova_src = env->src.iova + src_off;
+	conf->iova_dst = env->dst.iova + dst_off;
+	conf->size = size;
+	conf->chan_id = chan_id;
+	conf->int_fin = true;
+	conf->callback = count_callback;
+}
+
+/*
+ * segments of odd sizes and alignments, in one program
+ * */
+static int test_scatter_gather(struct test_env *env)
+{
+	static const struct {
+		u64 src_off;
+		u64 dst_off;
+		int size;
+	} segs[] = {
+		{ 0x0000, 0x1000, 4096 },
+		{ 0x2003, 0x3001, 1000 },
+		{ 0x5000, 0x4005, 7 },
+		{ 0x8001, 0x9000, 65536 + 3 },
+		{ 0x7ff8, 0x5000, 1 },
+	};
+	struct sg_entry sg[sizeof(segs) / sizeof(segs[0])];
+	struct req_config config;
+	unsigned int i;
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	for(i = 0; i < sizeof(segs) / sizeof(segs[0]); i++) {
+		sg[i].iova_src = env->src.iova + segs[i].src_off;
+		sg[i].iova_dst = env->dst.iova + segs[i].dst_off;
+		sg[i].size = segs[i].size;
+	}
+
+	copy_config(env, &config, 0, 0, 0, channel_id);
+	config.sg_list = sg;
+	config.sg_len = i;
+
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - submit\n");
+		ret = 1;
+	} else {
+		ret = wait_callbacks(1);
+	}
+
+	for(i = 0; !ret && i < sizeof(segs) / sizeof(segs[0]); i++) {
+		ret = check_copy(env, segs[i].src_off, segs[i].dst_off,
+							segs[i].size);
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+// user_data of the callbacks, in the order they are called
+static int order[CHANNEL_QUEUE_LEN + 1];
+
+static void order_callback(void *user_data)
+{
+	int n = __atomic_fetch_add(&callbacks, 1, __ATOMIC_RELAXED);
+
+	if(n < (int)(sizeof(order) / sizeof(order[0]))) {
+		order[n] = (int)(uintptr_t)user_data;
+	}
+}
+
+static int check_order(int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(order[i] != i) {
+			printf("test failed! - callback %d of request %d\n",
+								i, order[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * fill the queue of a channel held by a request waiting for its
+ * peripheral, then let it go
+ * */
+static int test_queue(struct test_env *env)
+{
+	struct req_config config;
+	__u32 *word = env->src.vaddr;
+	int i, channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	// 16 bytes from the device register at the start of the source
+	pl330_vfio_dev_defconfig(env->pl330, &config, DEV2MEM, 0);
+	config.iova_src = env->src.iova;
+	config.iova_dst = env->dst.iova;
+	config.size = 16;
+	config.chan_id = channel_id;
+	config.callback = order_callback;
+	config.user_data = (void *)0;
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - submit\n");
+		pl330_vfio_release_channel(env->pl330, channel_id);
+		return 1;
+	}
+
+	for(i = 1; i <= CHANNEL_QUEUE_LEN; i++) {
+		copy_config(env, &config, i * 8192, i * 8192, 4096 - i,
+								channel_id);
+		config.callback = order_callback;
+		config.user_data = (void *)(uintptr_t)i;
+		if(pl330_vfio_submit(env->pl330, &config)) {
+			printf("test failed! - request %d not queued\n", i);
+			ret = 1;
+		}
+	}
+
+	if(!pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - request queued on a full queue\n");
+		ret = 1;
+		i++;
+	}
+
+	usleep(10000);
+	if(get_callbacks()) {
+		printf("test failed! - completed without the peripheral\n");
+		ret = 1;
+	}
+
+	pl330_model_periph_request(env->model, 0, true);
+	ret |= wait_callbacks(i);
+	ret |= check_order(CHANNEL_QUEUE_LEN + 1);
+
+	if(!ret) {
+		__u32 *dst = env->dst.vaddr;
+
+		// the register is read at every beat of 4 bytes
+		for(i = 0; i < 4; i++) {
+			if(dst[i] != *word) {
+				printf("test failed! - beat %d from the "
+							"peripheral\n", i);
+				ret = 1;
+			}
+		}
+		ret |= check_guard(env, 0, 16);
+	}
+	for(i = 1; !ret && i <= CHANNEL_QUEUE_LEN; i++) {
+		ret = check_copy(env, i * 8192, i * 8192, 4096 - i);
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * a copy striped across channels, then one without free channels
+ * */
+static int test_striped(struct test_env *env)
+{
+	struct pl330_vfio_stats before, after;
+	int chans[MODEL_NUM_CHANNELS];
+	int i, n, ret = 0;
+
+	pl330_vfio_stats_snapshot(env->pl330, &before);
+	if(pl330_vfio_copy_striped(env->pl330, env->src.iova + 3,
+			env->dst.iova + 5, (3 << 20) + 5, 4, count_callback,
+									NULL)) {
+		printf("test failed! - striped copy\n");
+		return 1;
+	}
+	ret = wait_callbacks(1);
+	if(!ret) {
+		ret = check_copy(env, 3, 5, (3 << 20) + 5);
+	}
+
+	// a stripe on each of 4 channels
+	pl330_vfio_stats_snapshot(env->pl330, &after);
+	for(i = 0, n = 0; i < MANAGER_ID; i++) {
+		n += after.chans[i].completions != before.chans[i].completions;
+	}
+	if(n != 4) {
+		printf("test failed! - striped across %d channels\n", n);
+		ret = 1;
+	}
+
+	// the channels of the stripes are released
+	for(n = 0; n < MODEL_NUM_CHANNELS; n++) {
+		chans[n] = pl330_vfio_request_channel(env->pl330);
+		if(chans[n] < 0) {
+			printf("test failed! - %d channels free\n", n);
+			ret = 1;
+			break;
+		}
+	}
+
+	if(!pl330_vfio_copy_striped(env->pl330, env->src.iova,
+			env->dst.iova, 4096, 4, count_callback, NULL)) {
+		printf("test failed! - striped copy without channels\n");
+		ret = 1;
+	}
+
+	for(i = 0; i < n; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	usleep(10000);
+	if(get_callbacks() != 1) {
+		printf("test failed! - %d callbacks\n", get_callbacks());
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * COMPLETION_POLL: the callback is called before the submit returns.
+ * COMPLETION_HYBRID: within the spin budget, or by the irq thread
+ * without one
+ * */
+static int test_poll_hybrid(struct test_env *env)
+{
+	struct req_config config;
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	copy_config(env, &config, 0, 0, 65536 + 1, channel_id);
+	config.c_mode = COMPLETION_POLL;
+	config.int_fin = false;
+	if(pl330_vfio_submit(env->pl330, &config) || get_callbacks() != 1) {
+		printf("test failed! - polled copy, %d callbacks\n",
+							get_callbacks());
+		ret = 1;
+	} else {
+		ret = check_copy(env, 0, 0, 65536 + 1);
+	}
+
+	copy_config(env, &config, 0x20001, 0x20000, 4096, channel_id);
+	config.c_mode = COMPLETION_HYBRID;
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - hybrid copy\n");
+		ret = 1;
+	}
+
+	copy_config(env, &config, 0x30000, 0x30003, 300000, channel_id);
+	config.c_mode = COMPLETION_HYBRID;
+	config.poll_ns = 0;
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - hybrid copy without spin\n");
+		ret = 1;
+	}
+
+	if(!ret) {
+		ret = wait_callbacks(3);
+	}
+	if(!ret) {
+		ret = check_copy(env, 0x20001, 0x20000, 4096);
+		ret |= check_copy(env, 0x30000, 0x30003, 300000);
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * sizes and alignments that need a head and a tail around the bursts,
+ * with the bursts chosen by the driver and with narrow ones
+ * */
+static int test_odd_sizes(struct test_env *env)
+{
+	static const u64 sizes[] = {
+		1, 2, 3, 7, 8, 15, 17, 31, 33, 63, 65, 127, 129, 255, 4095, 4097,
+	};
+	struct req_config config;
+	unsigned int i, s, d;
+	int channel_id, n = 0, ret = 0;
+	bool burst_auto;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	for(i = 0; !ret && i < 2 * sizeof(sizes) / sizeof(sizes[0]); i++) {
+		burst_auto = i < sizeof(sizes) / sizeof(sizes[0]);
+		for(s = 0; !ret && s < 8; s++) {
+			for(d = 0; !ret && d < 8; d++) {
+				u64 size = sizes[i % (sizeof(sizes) /
+							sizeof(sizes[0]))];
+
+				memset(env->dst.vaddr, 0, 0x2000 + size);
+
+				copy_config(env, &config, 0x1000 + s,
+						0x1000 + d, size, channel_id);
+				config.c_mode = COMPLETION_POLL;
+				config.int_fin = false;
+				if(!burst_auto) {
+					config.burst_auto = false;
+					config.src_burst_size = 4;
+					config.dst_burst_size = 4;
+					config.src_burst_len = 3;
+					config.dst_burst_len = 3;
+				}
+
+				if(pl330_vfio_submit(env->pl330, &config)) {
+					printf("test failed! - submit of %llu "
+						"bytes, 0x%x to 0x%x\n", size,
+						0x1000 + s, 0x1000 + d);
+					ret = 1;
+					break;
+				}
+				n++;
+
+				ret = check_copy(env, 0x1000 + s, 0x1000 + d,
+									size);
+			}
+		}
+	}
+
+	// bursts the two sides don't share
+	copy_config(env, &config, 0x1000, 0x1000, 64, channel_id);
+	config.burst_auto = false;
+	config.src_burst_size = config.dst_burst_size = 4;
+	config.src_burst_len = 4;
+	config.dst_burst_len = 2;
+	if(!ret && !pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - different src and dst bursts accepted\n");
+		ret = 1;
+	}
+
+	if(get_callbacks() != n) {
+		printf("test failed! - %d callbacks, %d expected\n",
+							get_callbacks(), n);
+		ret = 1;
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * automatic bursts no longer than a short copy, the widest the bus
+ * and the MFIFO allow for a long one, and left alone for a device
+ * */
+static int test_burst_tuning(struct test_env *env)
+{
+	static const u64 sizes[] = { 1, 3, 8, 24, 100, 1 << 20 };
+	struct req_config config, widest;
+	unsigned int i, bytes;
+	int ret = 0;
+
+	pl330_vfio_mem2mem_defconfig(env->pl330, &widest);
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		copy_config(env, &config, 0, 0, sizes[i], 0);
+		if(pl330_vfio_tune_burst(env->pl330, &config)) {
+			printf("test failed! - tuning %llu bytes\n", sizes[i]);
+			return 1;
+		}
+
+		bytes = config.src_burst_size * config.src_burst_len;
+		if(bytes > sizes[i] || config.src_burst_size !=
+				config.dst_burst_size || config.src_burst_len !=
+				config.dst_burst_len) {
+			printf("test failed! - burst %u x %u for %llu bytes\n",
+				config.src_burst_size, config.src_burst_len,
+								sizes[i]);
+			ret = 1;
+		}
+	}
+
+	// the last one is long enough for the widest
+	if(config.src_burst_size != widest.src_burst_size ||
+			config.src_burst_len != widest.src_burst_len) {
+		printf("test failed! - burst %u x %u of a long copy\n",
+				config.src_burst_size, config.src_burst_len);
+		ret = 1;
+	}
+
+	pl330_vfio_dev_defconfig(env->pl330, &config, DEV2MEM, 0);
+	config.size = 4;
+	config.src_burst_size = config.dst_burst_size = 4;
+	config.src_burst_len = config.dst_burst_len = 4;
+	if(pl330_vfio_tune_burst(env->pl330, &config) ||
+			config.src_burst_len != 4 || config.dst_burst_len != 4) {
+		printf("test failed! - burst of a device transfer tuned\n");
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * copies longer than PROG_CHUNK_BURSTS bursts of 4 bytes, one DMAGO
+ * per chunk, completed by the irq thread and polled
+ * */
+static int test_chunks(struct test_env *env)
+{
+	struct pl330_vfio_stats before, after;
+	struct req_config config;
+	u64 size = 4 * PROG_CHUNK_BURSTS * 3 + 13, chunks;
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	chunks = (size / 4 + PROG_CHUNK_BURSTS - 1) / PROG_CHUNK_BURSTS;
+
+	pl330_vfio_stats_snapshot(env->pl330, &before);
+
+	copy_config(env, &config, 0, 0, size, channel_id);
+	config.burst_auto = false;
+	config.src_burst_size = 4;
+	config.dst_burst_size = 4;
+	config.src_burst_len = 1;
+	config.dst_burst_len = 1;
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - submit\n");
+		ret = 1;
+	} else {
+		ret = wait_callbacks(1);
+	}
+
+	config.iova_src = env->src.iova + 2 * size;
+	config.iova_dst = env->dst.iova + 2 * size;
+	config.c_mode = COMPLETION_POLL;
+	config.int_fin = false;
+	if(!ret && (pl330_vfio_submit(env->pl330, &config) ||
+						get_callbacks() != 2)) {
+		printf("test failed! - polled submit\n");
+		ret = 1;
+	}
+
+	pl330_vfio_stats_snapshot(env->pl330, &after);
+	if(!ret && after.chans[channel_id].dmagos -
+				before.chans[channel_id].dmagos != 2 * chunks) {
+		printf("test failed! - %llu DMAGO for %llu chunks\n",
+			after.chans[channel_id].dmagos -
+			before.chans[channel_id].dmagos, 2 * chunks);
+		ret = 1;
+	}
+
+	if(!ret) {
+		ret = check_copy(env, 0, 0, size);
+		ret |= check_copy(env, 2 * size, 2 * size, size);
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * a transfer with peripheral 5 that needs num_reqs requests of the
+ * peripheral: it must not complete before the last one
+ * */
+static int periph_transfer(struct test_env *env, unsigned int channel_id,
+		enum transfer_type t_type, enum request_type req_type,
+		u64 src_off, u64 dst_off, u64 size, int num_reqs)
+{
+	struct req_config config;
+	int i, n = get_callbacks();
+
+	pl330_vfio_dev_defconfig(env->pl330, &config, t_type, 5);
+	config.iova_src = env->src.iova + src_off;
+	config.iova_dst = env->dst.iova + dst_off;
+	config.size = size;
+	config.req_type = req_type;
+	config.chan_id = channel_id;
+	config.callback = count_callback;
+	if(pl330_vfio_submit(env->pl330, &config)) {
+		printf("test failed! - submit\n");
+		return 1;
+	}
+
+	for(i = 0; i < num_reqs - 1; i++) {
+		pl330_model_periph_request(env->model, 5, req_type == BURST);
+	}
+	usleep(10000);
+	if(get_callbacks() != n) {
+		printf("test failed! - completed after %d requests of %d\n",
+							num_reqs - 1, num_reqs);
+		return 1;
+	}
+
+	pl330_model_periph_request(env->model, 5, req_type == BURST);
+
+	return wait_callbacks(n + 1);
+}
+
+/*
+ * the size bytes at dst_off are beats of 4 bytes read from the
+ * register at src_off
+ * */
+static int check_beats(struct test_env *env, u64 src_off, u64 dst_off,
+								u64 size)
+{
+	__u32 *reg = (__u32 *)((uchar *)env->src.vaddr + src_off);
+	__u32 *dst = (__u32 *)((uchar *)env->dst.vaddr + dst_off);
+	u64 i;
+
+	for(i = 0; i < size / 4; i++) {
+		if(dst[i] != *reg) {
+			printf("test failed! - beat %llu from the peripheral "
+					"- 0x%x - 0x%x\n", i, *reg, dst[i]);
+			return 1;
+		}
+	}
+
+	return check_guard(env, dst_off, size);
+}
+
+/*
+ * bursts and single beats from and to a device register, paced by
+ * the requests of the peripheral
+ * */
+static int test_periph(struct test_env *env)
+{
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	// 16 bursts of 4 x 4 bytes, then 16 beats, from the register at 0x100
+	ret = periph_transfer(env, channel_id, DEV2MEM, BURST, 0x100, 0x1000,
+								256, 16);
+	ret |= periph_transfer(env, channel_id, DEV2MEM, SINGLE, 0x100, 0x2000,
+								64, 16);
+	if(!ret) {
+		ret = check_beats(env, 0x100, 0x1000, 256);
+		ret |= check_beats(env, 0x100, 0x2000, 64);
+	}
+
+	// to the register at 0x3000, that keeps the last beat
+	if(!ret) {
+		ret = periph_transfer(env, channel_id, MEM2DEV, BURST, 0x4000,
+							0x3000, 256, 16);
+	}
+	if(!ret) {
+		ret = check_copy(env, 0x4000 + 256 - 4, 0x3000, 4);
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * fills with patterns of every width the bus takes
+ * */
+static int test_fill(struct test_env *env)
+{
+	static const uchar pattern[16] = {
+		0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+		0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+	};
+	struct req_config config;
+	unsigned int bits, bytes, n = 0;
+	uchar *dst;
+	u64 i, dst_off, size;
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	for(bits = 8; !ret && bits <= MODEL_BUS_WIDTH; bits *= 2) {
+		bytes = bits / 8;
+		dst_off = 0x20000 * n + bytes;
+		size = 65536 + 3 * bytes;
+
+		pl330_vfio_mem2mem_defconfig(env->pl330, &config);
+		config.iova_dst = env->dst.iova + dst_off;
+		config.size = size;
+		config.chan_id = channel_id;
+		config.callback = count_callback;
+		if(pl330_vfio_fill(env->pl330, &config, pattern, bits)) {
+			printf("test failed! - fill of %u bits\n", bits);
+			ret = 1;
+			break;
+		}
+		ret = wait_callbacks(++n);
+
+		dst = (uchar *)env->dst.vaddr + dst_off;
+		for(i = 0; !ret && i < size; i++) {
+			if(dst[i] != pattern[i % bytes]) {
+				printf("test failed! - fill of %u bits, byte "
+					"%llu - 0x%x\n", bits, i, dst[i]);
+				ret = 1;
+			}
+		}
+		if(!ret) {
+			ret = check_guard(env, dst_off, size);
+		}
+	}
+
+	// wider than the bus, not aligned to the pattern
+	pl330_vfio_mem2mem_defconfig(env->pl330, &config);
+	config.iova_dst = env->dst.iova;
+	config.size = 64;
+	config.chan_id = channel_id;
+	if(!pl330_vfio_fill(env->pl330, &config, pattern,
+						2 * MODEL_BUS_WIDTH)) {
+		printf("test failed! - fill wider than the bus\n");
+		ret = 1;
+	}
+	config.iova_dst = env->dst.iova + 2;
+	if(!pl330_vfio_fill(env->pl330, &config, pattern, 32)) {
+		printf("test failed! - misaligned fill\n");
+		ret = 1;
+	}
+
+	usleep(10000);
+	if(get_callbacks() != (int)n) {
+		printf("test failed! - %d callbacks, %u expected\n",
+						get_callbacks(), n);
+		ret = 1;
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * rows of a 2D transfer: each one is copied, the gaps between them in
+ * the destination are left alone
+ * */
+static int check_rows(struct test_env *env, struct req_config *config)
+{
+	u64 src_off = config->iova_src - env->src.iova;
+	u64 dst_off = config->iova_dst - env->dst.iova;
+	unsigned int r;
+
+	for(r = 0; r < config->rows; r++) {
+		if(check_copy(env, src_off + r * config->src_stride,
+				dst_off + r * config->dst_stride,
+				config->size)) {
+			printf("test failed! - row %u of %u\n", r,
+							config->rows);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * 2D transfers: rows of whole bursts, and odd rows that need a head
+ * and a tail each
+ * */
+static int test_2d(struct test_env *env)
+{
+	static const struct {
+		u64 src_off;
+		u64 dst_off;
+		u64 size;
+		unsigned int rows;
+		unsigned int src_stride;
+		unsigned int dst_stride;
+	} shapes[] = {
+		{ 0x0000, 0x1000, 64, 37, 128, 200 },
+		{ 0x8003, 0x10001, 13, 100, 24, 19 + TEST_GUARD },
+		{ 0x20000, 0x30000, 200, 3, 256, 4096 },
+	};
+	struct req_config config;
+	unsigned int i;
+	int channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		return 1;
+	}
+
+	for(i = 0; !ret && i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		copy_config(env, &config, shapes[i].src_off, shapes[i].dst_off,
+						shapes[i].size, channel_id);
+		config.rows = shapes[i].rows;
+		config.src_stride = shapes[i].src_stride;
+		config.dst_stride = shapes[i].dst_stride;
+		if(pl330_vfio_submit(env->pl330, &config)) {
+			printf("test failed! - submit of %u rows of %llu "
+				"bytes\n", shapes[i].rows, shapes[i].size);
+			ret = 1;
+			break;
+		}
+
+		ret = wait_callbacks(i + 1);
+		if(!ret) {
+			ret = check_rows(env, &config);
+		}
+	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+/*
+ * number of events pl330_vfio_alloc_event() can hand out
+ * */
+static int free_events(struct test_env *env)
+{
+	int events[MODEL_NUM_EVENTS];
+	int i, n;
+
+	for(n = 0; n < MODEL_NUM_EVENTS; n++) {
+		events[n] = pl330_vfio_alloc_event(env->pl330);
+		if(events[n] < 0) {
+			break;
+		}
+	}
+	for(i = 0; i < n; i++) {
+		pl330_vfio_free_event(env->pl330, events[i]);
+	}
+
+	return n;
+}
+
+/*
+ * three copies, each reading what the previous one wrote, chained on
+ * three channels through events
+ * */
+static int test_chain(struct test_env *env)
+{
+	struct req_config stages[3];
+	u64 size = 0x40000 + 5;
+	int chans[3];
+	int i, events, ret = 0;
+
+	for(i = 0; i < 3; i++) {
+		chans[i] = pl330_vfio_request_channel(env->pl330);
+		if(chans[i] < 0) {
+			printf("test failed! - no channels available\n");
+			while(i--) {
+				pl330_vfio_release_channel(env->pl330,
+								chans[i]);
+			}
+			return 1;
+		}
+
+		copy_config(env, &stages[i], 0x11, i * 0x100000, size,
+								chans[i]);
+		if(i) {
+			stages[i].iova_src = stages[i - 1].iova_dst;
+		}
+		stages[i].callback = order_callback;
+		stages[i].user_data = (void *)(uintptr_t)i;
+	}
+
+	events = free_events(env);
+
+	if(pl330_vfio_submit_chain(env->pl330, stages, 3)) {
+		printf("test failed! - submit\n");
+		ret = 1;
+	} else {
+		ret = wait_callbacks(3) || check_order(3);
+	}
+
+	for(i = 0; !ret && i < 3; i++) {
+		ret = check_copy(env, 0x11, i * 0x100000, size);
+	}
+
+	if(free_events(env) != events) {
+		printf("test failed! - events of the chain not freed\n");
+		ret = 1;
+	}
+
+	// a channel can't take two stages
+	stages[2].chan_id = chans[0];
+	if(!pl330_vfio_submit_chain(env->pl330, stages, 3)) {
+		printf("test failed! - chain on a repeated channel\n");
+		ret = 1;
+		wait_callbacks(6);
+	}
+
+	for(i = 0; i < 3; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * collect n tokens with notify through the completion fd
+ * */
+static int collect_tokens(struct test_env *env,
+			struct pl330_vfio_token *tokens, int n)
+{
+	struct pollfd pfd = {
+		.fd = pl330_vfio_completion_fd(env->pl330),
+		.events = POLLIN,
+	};
+	struct pl330_vfio_token *token;
+	bool seen[n];
+	int got = 0;
+
+	memset(seen, 0, sizeof(seen));
+	while(got < n) {
+		if(poll(&pfd, 1, WAIT_MODEL_MS) != 1) {
+			printf("test failed! - %d tokens of %d collected\n",
+								got, n);
+			return 1;
+		}
+
+		for(token = pl330_vfio_poll_completions(env->pl330); token;
+							token = token->next) {
+			if(token < tokens || token >= tokens + n ||
+						seen[token - tokens] ||
+						!pl330_vfio_token_test(token)) {
+				printf("test failed! - bad token collected\n");
+				return 1;
+			}
+			seen[token - tokens] = true;
+			got++;
+		}
+	}
+
+	// drained
+	if(poll(&pfd, 1, 0)) {
+		printf("test failed! - completion fd readable when drained\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * tokens waited on, collected from the completion fd, and cancelled
+ * by a reset with their requests running or queued
+ * */
+static int test_tokens(struct test_env *env)
+{
+	struct pl330_vfio_token tokens[8], token;
+	struct req_config config;
+	int i, chans[2], ret = 0;
+
+	for(i = 0; i < 2; i++) {
+		chans[i] = pl330_vfio_request_channel(env->pl330);
+		if(chans[i] < 0) {
+			printf("test failed! - no channels available\n");
+			if(i) {
+				pl330_vfio_release_channel(env->pl330,
+								chans[0]);
+			}
+			return 1;
+		}
+	}
+
+	// never submitted
+	pl330_vfio_token_init(&token, false);
+	if(pl330_vfio_token_wait(&token, 10) != -1 ||
+					pl330_vfio_token_test(&token)) {
+		printf("test failed! - token done without a request\n");
+		ret = 1;
+	}
+
+	copy_config(env, &config, 0, 0, 65536 + 7, chans[0]);
+	config.token = &token;
+	if(pl330_vfio_submit(env->pl330, &config) ||
+			pl330_vfio_token_wait(&token, WAIT_MODEL_MS) ||
+			pl330_vfio_token_cancelled(&token)) {
+		printf("test failed! - token wait\n");
+		ret = 1;
+	}
+	// the callback comes before the token
+	if(!ret && get_callbacks() != 1) {
+		printf("test failed! - token done before the callback\n");
+		ret = 1;
+	}
+	if(!ret) {
+		ret = check_copy(env, 0, 0, 65536 + 7);
+	}
+
+	for(i = 0; !ret && i < 8; i++) {
+		copy_config(env, &config, 0x100000 + i * 0x10000,
+			0x100000 + i * 0x10000, 0x8000 + i, chans[i % 2]);
+		pl330_vfio_token_init(&tokens[i], true);
+		config.token = &tokens[i];
+		if(pl330_vfio_submit(env->pl330, &config)) {
+			printf("test failed! - submit\n");
+			ret = 1;
+		}
+	}
+	if(!ret) {
+		ret = collect_tokens(env, tokens, 8);
+	}
+	for(i = 0; !ret && i < 8; i++) {
+		ret = check_copy(env, 0x100000 + i * 0x10000,
+				0x100000 + i * 0x10000, 0x8000 + i);
+	}
+	if(!ret && get_callbacks() != 9) {
+		printf("test failed! - %d callbacks\n", get_callbacks());
+		ret = 1;
+	}
+
+	// a request waiting for its peripheral, a copy queued behind it
+	if(!ret) {
+		pl330_vfio_dev_defconfig(env->pl330, &config, DEV2MEM, 7);
+		config.iova_src = env->src.iova;
+		config.iova_dst = env->dst.iova + 0x200000;
+		config.size = 64;
+		config.chan_id = chans[0];
+		config.callback = count_callback;
+		pl330_vfio_token_init(&tokens[0], false);
+		config.token = &tokens[0];
+		ret = pl330_vfio_submit(env->pl330, &config);
+
+		copy_config(env, &config, 0, 0x300000, 4096, chans[0]);
+		pl330_vfio_token_init(&tokens[1], true);
+		config.token = &tokens[1];
+		ret |= pl330_vfio_submit(env->pl330, &config);
+		if(ret) {
+			printf("test failed! - submit\n");
+		}
+	}
+	if(!ret) {
+		pl330_vfio_reset(env->pl330);
+
+		for(i = 0; i < 2; i++) {
+			if(pl330_vfio_token_wait(&tokens[i], 0) ||
+				!pl330_vfio_token_cancelled(&tokens[i])) {
+				printf("test failed! - token %d not "
+							"cancelled\n", i);
+				ret = 1;
+			}
+		}
+		ret |= collect_tokens(env, &tokens[1], 1);
+		// the queued copy never started
+		ret |= check_guard(env, 0x300000, 0);
+
+		if(get_callbacks() != 9) {
+			printf("test failed! - callback of a cancelled "
+								"request\n");
+			ret = 1;
+		}
+	}
+
+	for(i = 0; i < 2; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	return ret;
+}
+
+static u64 hist_sum(const u64 *hist)
+{
+	u64 sum = 0;
+	int i;
+
+	for(i = 0; i < PL330_STATS_BUCKETS; i++) {
+		sum += hist[i];
+	}
+
+	return sum;
+}
+
+/*
+ * a request waiting for peripheral 9, holding the channel until a
+ * reset
+ * */
+static int submit_blocker(struct test_env *env, unsigned int channel_id)
+{
+	struct req_config config;
+
+	pl330_vfio_dev_defconfig(env->pl330, &config, DEV2MEM, 9);
+	config.iova_src = env->src.iova;
+	config.iova_dst = env->dst.iova;
+	config.size = 16;
+	config.chan_id = channel_id;
+
+	return pl330_vfio_submit(env->pl330, &config);
+}
+
+/*
+ * counters of completed copies, of a full queue, of a pool without
+ * free slots and of the kills of a reset
+ * */
+static int test_stats(struct test_env *env)
+{
+	struct pl330_vfio_stats before, after;
+	struct pl330_vfio_chan_stats *b, *a;
+	struct req_config config;
+	u64 bytes = 0;
+	int i, n, chans[4], ret = 0;
+
+	for(i = 0; i < 4; i++) {
+		chans[i] = pl330_vfio_request_channel(env->pl330);
+		if(chans[i] < 0) {
+			printf("test failed! - no channels available\n");
+			while(i--) {
+				pl330_vfio_release_channel(env->pl330,
+								chans[i]);
+			}
+			return 1;
+		}
+	}
+	b = &before.chans[chans[0]];
+	a = &after.chans[chans[0]];
+
+	pl330_vfio_stats_snapshot(env->pl330, &before);
+	for(i = 0; i < 3; i++) {
+		copy_config(env, &config, 0, i * 0x10000, 4096 + i, chans[0]);
+		ret |= pl330_vfio_submit(env->pl330, &config);
+		bytes += 4096 + i;
+	}
+	if(ret) {
+		printf("test failed! - submit\n");
+	} else {
+		ret = wait_callbacks(3);
+	}
+	pl330_vfio_stats_snapshot(env->pl330, &after);
+
+	if(!ret && (a->submits - b->submits != 3 ||
+			a->completions - b->completions != 3 ||
+			a->dmagos - b->dmagos != 3 ||
+			a->bytes - b->bytes != bytes ||
+			a->rejects != b->rejects ||
+			hist_sum(a->submit_to_go) -
+				hist_sum(b->submit_to_go) != 3 ||
+			hist_sum(a->go_to_done) -
+				hist_sum(b->go_to_done) != 3 ||
+			after.irq_events == before.irq_events ||
+			after.irq_wakeups == before.irq_wakeups)) {
+		printf("test failed! - counters of 3 copies\n");
+		ret = 1;
+	}
+	for(i = 0; !ret && i < 3; i++) {
+		ret = check_copy(env, 0, i * 0x10000, 4096 + i);
+	}
+
+	// one request more than the queue takes
+	before = after;
+	if(!ret && submit_blocker(env, chans[0])) {
+		printf("test failed! - submit\n");
+		ret = 1;
+	}
+	for(i = 0; !ret && i <= CHANNEL_QUEUE_LEN; i++) {
+		copy_config(env, &config, 0, 0, 4096, chans[0]);
+		if(pl330_vfio_submit(env->pl330, &config) !=
+					(i < CHANNEL_QUEUE_LEN ? 0 : -1)) {
+			printf("test failed! - request %d of the queue\n", i);
+			ret = 1;
+		}
+	}
+	pl330_vfio_reset(env->pl330);
+	pl330_vfio_stats_snapshot(env->pl330, &after);
+
+	if(!ret && (a->submits - b->submits != CHANNEL_QUEUE_LEN + 1 ||
+			a->rejects - b->rejects != 1 ||
+			a->kills == b->kills ||
+			a->completions != b->completions ||
+			after.no_slot != before.no_slot)) {
+		printf("test failed! - counters of a full queue\n");
+		ret = 1;
+	}
+
+	// more requests than slots, spread over the channels
+	before = after;
+	for(i = 0; !ret && i < 4; i++) {
+		ret = submit_blocker(env, chans[i]);
+	}
+	for(n = i; !ret; n++) {
+		copy_config(env, &config, 0, 0, 4096, chans[n % 4]);
+		if(pl330_vfio_submit(env->pl330, &config)) {
+			break;
+		}
+	}
+	if(!ret && (n != TEST_NUM_SLOTS ||
+			pl330_vfio_inflight(env->pl330) != TEST_NUM_SLOTS)) {
+		printf("test failed! - %d requests taken by %d slots\n",
+							n, TEST_NUM_SLOTS);
+		ret = 1;
+	}
+	pl330_vfio_reset(env->pl330);
+	pl330_vfio_stats_snapshot(env->pl330, &after);
+
+	if(!ret && (after.no_slot - before.no_slot != 1 ||
+			a->rejects != b->rejects)) {
+		printf("test failed! - counters of a pool without slots\n");
+		ret = 1;
+	}
+
+	if(get_callbacks() != 3) {
+		printf("test failed! - %d callbacks\n", get_callbacks());
+		ret = 1;
+	}
+
+	for(i = 0; i < 4; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * pl330_prog_check() refuses the program, with a report on stderr
+ * containing expect. The report is captured rather than printed
+ * */
+static int check_rejected(const uchar *cmds, __u32 len, const char *expect)
+{
+	char report[256];
+	FILE *tmp;
+	int err, ret;
+
+	tmp = tmpfile();
+	if(!tmp) {
+		return 1;
+	}
+
+	fflush(stderr);
+	err = dup(STDERR_FILENO);
+	if(err < 0) {
+		fclose(tmp);
+		return 1;
+	}
+	dup2(fileno(tmp), STDERR_FILENO);
+	ret = pl330_prog_check(cmds, len);
+	fflush(stderr);
+	dup2(err, STDERR_FILENO);
+	close(err);
+
+	rewind(tmp);
+	report[fread(report, 1, sizeof(report) - 1, tmp)] = 0;
+	fclose(tmp);
+
+	return ret != -1 || !strstr(report, expect);
+}
+
+/*
+ * the programs generated for every kind of request pass the static
+ * checks and decode to their end; broken ones don't pass
+ * */
+static int test_prog_check(struct test_env *env)
+{
+	struct sg_entry sg[3];
+	struct req_config configs[8];
+	uchar cmds[TEST_SLOT_SIZE + 1];
+	FILE *null;
+	int i, n = 0, len, event, channel_id, ret = 0;
+
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	event = pl330_vfio_alloc_event(env->pl330);
+	if(channel_id < 0 || event < 0) {
+		printf("test failed! - no channels or events available\n");
+		return 1;
+	}
+
+	// a plain copy
+	copy_config(env, &configs[n++], 0, 0, 4096, channel_id);
+
+	// scatter-gather
+	for(i = 0; i < 3; i++) {
+		sg[i].iova_src = env->src.iova + i * 0x1001;
+		sg[i].iova_dst = env->dst.iova + i * 0x2003;
+		sg[i].size = 100 * i + 1;
+	}
+	copy_config(env, &configs[n], 0, 0, 0, channel_id);
+	configs[n].sg_list = sg;
+	configs[n++].sg_len = 3;
+
+	// odd, narrow bursts
+	copy_config(env, &configs[n++], 3, 5, 4097, channel_id);
+	copy_config(env, &configs[n], 1, 2, 1000, channel_id);
+	configs[n].burst_auto = false;
+	configs[n].src_burst_size = configs[n].dst_burst_size = 2;
+	configs[n].src_burst_len = configs[n].dst_burst_len = 7;
+	n++;
+
+	// the first chunk of a long copy
+	copy_config(env, &configs[n], 0, 0, 3 << 20, channel_id);
+	configs[n].burst_auto = false;
+	configs[n].src_burst_size = configs[n].dst_burst_size = 1;
+	configs[n].src_burst_len = configs[n].dst_burst_len = 1;
+	n++;
+
+	// from and to a peripheral
+	pl330_vfio_dev_defconfig(env->pl330, &configs[n], DEV2MEM, 3);
+	configs[n].iova_src = env->src.iova;
+	configs[n].iova_dst = env->dst.iova;
+	configs[n].size = 4096;
+	configs[n].chan_id = channel_id;
+	configs[n++].int_fin = true;
+	pl330_vfio_dev_defconfig(env->pl330, &configs[n], MEM2DEV, 4);
+	configs[n].iova_src = env->src.iova;
+	configs[n].iova_dst = env->dst.iova;
+	configs[n].size = 48;
+	configs[n].req_type = SINGLE;
+	configs[n].chan_id = channel_id;
+	configs[n++].int_fin = true;
+
+	// 2D, waiting for and signalling an event
+	copy_config(env, &configs[n], 1, 3, 13, channel_id);
+	configs[n].rows = 10;
+	configs[n].src_stride = 24;
+	configs[n].dst_stride = 17;
+	configs[n].wait_event = event;
+	configs[n++].signal_event = event;
+
+	null = fopen("/dev/null", "w");
+	if(!null) {
+		printf("test failed! - /dev/null\n");
+		ret = 1;
+	}
+
+	for(i = 0; !ret && i < n; i++) {
+		len = generate_cmds_from_request(env->pl330, cmds,
+								&configs[i]);
+		if(len <= 0 || pl330_prog_check(cmds, len) ||
+				pl330_disasm(null, cmds, len) != (__u32)len) {
+			printf("test failed! - program %d, %d bytes\n", i, len);
+			ret = 1;
+			break;
+		}
+
+		// without its DMAEND, and with bytes after it
+		if(check_rejected(cmds, len - 1, "doesn't end with DMAEND")) {
+			printf("test failed! - program %d cut\n", i);
+			ret = 1;
+		}
+		cmds[len] = cmds[len - 1];
+		if(check_rejected(cmds, len + 1, "1 bytes after DMAEND")) {
+			printf("test failed! - program %d with a tail\n", i);
+			ret = 1;
+		}
+	}
+
+	if(null) {
+		fclose(null);
+	}
+	pl330_vfio_free_event(env->pl330, event);
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return ret;
+}
+
+#define DISPATCH_BATCH			(CHANNEL_QUEUE_LEN / 2)
+#define DISPATCH_ROUNDS			20
+
+static void chan_callback(void *user_data)
+{
+	__atomic_add_fetch((int *)user_data, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * batches of copies on every channel, every other one completed by a
+ * hybrid spin: the spinner and the irq thread find the events of many
+ * channels pending at once, each has to be dispatched exactly once
+ * */
+static int test_dispatch(struct test_env *env)
+{
+	int chans[MODEL_NUM_CHANNELS], done[MODEL_NUM_CHANNELS];
+	struct req_config config;
+	int b, i, c, n, w, total, ret = 0;
+	u64 off;
+
+	memset(done, 0, sizeof(done));
+
+	for(n = 0; n < MODEL_NUM_CHANNELS; n++) {
+		chans[n] = pl330_vfio_request_channel(env->pl330);
+		if(chans[n] < 0) {
+			printf("test failed! - no channels available\n");
+			ret = 1;
+			goto release;
+		}
+	}
+
+	for(b = 0, total = 0; !ret && b < DISPATCH_ROUNDS; b++) {
+		memset(env->dst.vaddr, 0, (MODEL_NUM_CHANNELS + 1) * 0x10000);
+
+		for(i = 0; !ret && i < DISPATCH_BATCH * n; i++) {
+			c = i % n;
+			off = (c + 1) * 0x10000 + i / n * 1024;
+			copy_config(env, &config, off + b, off, 512 + i,
+								chans[c]);
+			config.c_mode = (i + i / n) % 2 ? COMPLETION_HYBRID :
+							COMPLETION_IRQ;
+			config.callback = chan_callback;
+			config.user_data = &done[c];
+			if(pl330_vfio_submit(env->pl330, &config)) {
+				printf("test failed! - submit %d\n", i);
+				ret = 1;
+			}
+		}
+		total += DISPATCH_BATCH;
+
+		for(w = 0; w < WAIT_MODEL_MS; w++) {
+			for(c = 0; c < n && __atomic_load_n(&done[c],
+					__ATOMIC_RELAXED) >= total; c++)
+				;
+			if(c == n) {
+				break;
+			}
+			usleep(1000);
+		}
+
+		for(i = 0; !ret && i < DISPATCH_BATCH * n; i++) {
+			off = (i % n + 1) * 0x10000 + i / n * 1024;
+			ret = check_copy(env, off + b, off, 512 + i);
+		}
+	}
+
+	// a second completion of an event would show up by now
+	usleep(10000);
+	for(c = 0; !ret && c < n; c++) {
+		if(done[c] != total) {
+			printf("test failed! - %d callbacks on channel %d, "
+					"%d expected\n", done[c], chans[c], total);
+			ret = 1;
+		}
+	}
+
+release:
+	for(i = 0; i < n; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * threads hammering the controller at once: each one gets its own
+ * index, from 1
+ * */
+#define CONC_THREADS			8
+#define CONC_ROUNDS			2000
+
+struct conc_arg {
+	struct test_env *env;
+	int id;
+	int ret;
+};
+
+static int run_threads(struct test_env *env, void *(*fn)(void *))
+{
+	struct conc_arg args[CONC_THREADS];
+	pthread_t threads[CONC_THREADS];
+	int i, n, ret = 0;
+
+	for(n = 0; n < CONC_THREADS; n++) {
+		args[n].env = env;
+		args[n].id = n + 1;
+		args[n].ret = 0;
+		if(pthread_create(&threads[n], NULL, fn, &args[n])) {
+			printf("test failed! - thread %d not started\n", n);
+			ret = 1;
+			break;
+		}
+	}
+
+	for(i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+		ret |= args[i].ret;
+	}
+
+	return ret;
+}
+
+// thread holding every channel and event, 0 if free
+static int chan_owner[MODEL_NUM_CHANNELS];
+static int event_owner[MODEL_NUM_EVENTS];
+
+/*
+ * claim what the allocator handed out: no other thread may hold it
+ * */
+static int claim(int *owner, int id)
+{
+	int prev = __atomic_exchange_n(owner, id, __ATOMIC_RELAXED);
+
+	if(prev) {
+		printf("test failed! - allocated to threads %d and %d\n",
+								prev, id);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *alloc_thread(void *data)
+{
+	struct conc_arg *arg = data;
+	struct test_env *env = arg->env;
+	int r, chan, event;
+
+	for(r = 0; !arg->ret && r < CONC_ROUNDS; r++) {
+		chan = pl330_vfio_request_channel(env->pl330);
+		event = pl330_vfio_alloc_event(env->pl330);
+
+		if(chan >= 0) {
+			arg->ret |= claim(&chan_owner[chan], arg->id);
+		}
+		if(event >= 0) {
+			arg->ret |= claim(&event_owner[event], arg->id);
+		}
+
+		if(event >= 0) {
+			__atomic_store_n(&event_owner[event], 0,
+							__ATOMIC_RELAXED);
+			pl330_vfio_free_event(env->pl330, event);
+		}
+		if(chan >= 0) {
+			__atomic_store_n(&chan_owner[chan], 0,
+							__ATOMIC_RELAXED);
+			pl330_vfio_release_channel(env->pl330, chan);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * channels and events allocated and released by many threads at once
+ * are never handed out twice, and are all free at the end
+ * */
+static int test_bitmap(struct test_env *env)
+{
+	int chans[MODEL_NUM_CHANNELS];
+	int i, n, events, ret;
+
+	events = free_events(env);
+	memset(chan_owner, 0, sizeof(chan_owner));
+	memset(event_owner, 0, sizeof(event_owner));
+
+	ret = run_threads(env, alloc_thread);
+
+	for(n = 0; n < MODEL_NUM_CHANNELS; n++) {
+		chans[n] = pl330_vfio_request_channel(env->pl330);
+		if(chans[n] < 0) {
+			printf("test failed! - %d channels free\n", n);
+			ret = 1;
+			break;
+		}
+	}
+	for(i = 0; i < n; i++) {
+		pl330_vfio_release_channel(env->pl330, chans[i]);
+	}
+
+	if(free_events(env) != events) {
+		printf("test failed! - %d events free, %d before\n",
+						free_events(env), events);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * polled copies on a channel of its own: every DMAGO goes through the
+ * debug ring together with the ones of the other threads
+ * */
+static void *poll_thread(void *data)
+{
+	struct conc_arg *arg = data;
+	struct test_env *env = arg->env;
+	struct req_config config;
+	u64 off = arg->id * 0x10000;
+	int r, channel_id;
 
-	int ret = ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set);
+	channel_id = pl330_vfio_request_channel(env->pl330);
+	if(channel_id < 0) {
+		printf("test failed! - no channels available\n");
+		arg->ret = 1;
+		return NULL;
+	}
 
-	if (ret) {
-		printf("Failure in %s for IRQ %d\n", __func__, index);
-		exit(1);
+	for(r = 0; !arg->ret && r < CONC_ROUNDS / 10; r++) {
+		memset((uchar *)env->dst.vaddr + off - TEST_GUARD, 0,
+						4096 + 2 * TEST_GUARD);
+
+		copy_config(env, &config, off + r, off, 4096 - r, channel_id);
+		config.c_mode = COMPLETION_POLL;
+		config.int_fin = false;
+		config.callback = NULL;
+		if(pl330_vfio_submit(env->pl330, &config)) {
+			printf("test failed! - thread %d, submit %d\n",
+								arg->id, r);
+			arg->ret = 1;
+			break;
+		}
+
+		arg->ret = check_copy(env, off + r, off, 4096 - r);
 	}
+
+	pl330_vfio_release_channel(env->pl330, channel_id);
+
+	return NULL;
 }
 
-static void vfio_irqfd_init(int device, unsigned int index, int fd)
+static int test_debug_ring(struct test_env *env)
 {
-	struct vfio_irq_set *irq_set;
-	int32_t *pfd;
-	int ret, argsz;
+	return run_threads(env, poll_thread);
+}
 
-	argsz = sizeof(*irq_set) + sizeof(*pfd);
-	irq_set = malloc(argsz);
+/*
+ * more shapes than entries in the program cache: the threads replace
+ * each other's templates while they copy them
+ * */
+#define PROG_SHAPES			200
 
-	if (!irq_set) {
-		printf("Failure in %s allocating memory\n", __func__);
-		exit(1);
+static uchar prog_ref[PROG_SHAPES][TEST_SLOT_SIZE];
+static int prog_ref_len[PROG_SHAPES];
+
+static void prog_config(struct test_env *env, struct req_config *config,
+								int shape)
+{
+	copy_config(env, config, shape % 8, shape % 5, 13 * (shape + 1), 0);
+	config->wait_event = -1;
+	config->signal_event = -1;
+}
+
+/*
+ * every program, copied from a template or generated, is the one
+ * generated without the cache. The buffer holds garbage before, as
+ * if a program had been written in it some other way
+ * */
+static void *prog_thread(void *data)
+{
+	struct conc_arg *arg = data;
+	struct req_config config;
+	uchar cmds[TEST_SLOT_SIZE];
+	int r, shape, len;
+
+	for(r = 0; !arg->ret && r < CONC_ROUNDS; r++) {
+		shape = (r * 7 + arg->id * 31) % PROG_SHAPES;
+		prog_config(arg->env, &config, shape);
+
+		memset(cmds, 0xff, sizeof(cmds));
+		len = generate_cmds_from_request(arg->env->pl330, cmds,
+								&config);
+		if(len != prog_ref_len[shape] ||
+				memcmp(cmds, prog_ref[shape], len)) {
+			printf("test failed! - thread %d, program of shape %d\n",
+							arg->id, shape);
+			arg->ret = 1;
+		}
 	}
 
-	irq_set->argsz = argsz;
-	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
-	irq_set->index = index;
-	irq_set->start = 0;
-	irq_set->count = 1;
-	pfd = (int32_t *)&irq_set->data;
-	*pfd = fd;
+	return NULL;
+}
 
-	ret = ioctl(device, VFIO_DEVICE_SET_IRQS, irq_set);
-	free(irq_set);
+static int test_prog_cache(struct test_env *env)
+{
+	struct req_config config;
+	int shape;
+
+	// the first program of a shape is the one generated
+	for(shape = 0; shape < PROG_SHAPES; shape++) {
+		prog_config(env, &config, shape);
+		prog_ref_len[shape] = generate_cmds_from_request(env->pl330,
+						prog_ref[shape], &config);
+		if(prog_ref_len[shape] <= 0) {
+			printf("test failed! - program of shape %d\n", shape);
+			return 1;
+		}
+	}
 
-	if (ret) {
-		printf("Failure in %s for IRQ %d\n", __func__, index);
-		exit(1);
+	return run_threads(env, prog_thread);
+}
+
+#define GROUP_COPIES			8
+
+/*
+ * a second controller on the model, sharing the IOVAs of the first
+ * */
+static struct pl330_status *second_ctrl(struct test_env *env,
+						struct pl330_model **model)
+{
+	struct pl330_status *pl330;
+	int c;
+
+	*model = pl330_model_create(env->mmu, MODEL_NUM_CHANNELS);
+	if(!*model) {
+		return NULL;
+	}
+
+	pl330 = pl330_vfio_init_model(*model);
+	for(c = 0; c < MODEL_NUM_CHANNELS; c++) {
+		pl330_vfio_add_irq(pl330, pl330_model_irq_eventfd(*model, c), c);
 	}
+	if(pl330_vfio_cmds_pool_init(pl330, env->mmu, TEST_SLOT_SIZE,
+							TEST_NUM_SLOTS)) {
+		pl330_vfio_remove(pl330);
+		pl330_model_destroy(*model);
+		return NULL;
+	}
+	pl330_vfio_start_irq_handler(pl330);
+
+	return pl330;
 }
 
-void done_callback(void *user_data)
+/*
+ * a group of two controllers: with the first one held by a request
+ * waiting for its peripheral, the copies go to the second one
+ * */
+static int test_group(struct test_env *env)
 {
-	printf("done!\n");
+	struct pl330_status *ctrls[2];
+	struct pl330_vfio_group *group;
+	struct pl330_model *model;
+	struct req_config config;
+	int i, n, on_second = 0, ret = 0;
 
-	char *ptr = (char *)user_data;
-	printf("the message is: %s\n", ptr);
+	ctrls[0] = env->pl330;
+	ctrls[1] = second_ctrl(env, &model);
+	if(!ctrls[1]) {
+		printf("test failed! - no second controller\n");
+		return 1;
+	}
+
+	group = pl330_vfio_group_create(ctrls, 2, 1);
+	if(!group) {
+		printf("test failed! - group not created\n");
+		ret = 1;
+		goto remove;
+	}
+
+	// both are idle, the first one takes it
+	pl330_vfio_dev_defconfig(env->pl330, &config, DEV2MEM, 0);
+	config.iova_src = env->src.iova;
+	config.iova_dst = env->dst.iova;
+	config.size = 16;
+	config.int_fin = true;
+	config.callback = count_callback;
+	if(pl330_vfio_group_submit(group, &config) != 0) {
+		printf("test failed! - blocker not on the first controller\n");
+		ret = 1;
+		goto destroy;
+	}
+
+	for(n = 1; n <= GROUP_COPIES; n++) {
+		copy_config(env, &config, n * 8192, n * 8192, 4096 + n, 0);
+		i = pl330_vfio_group_submit(group, &config);
+		if(i < 0) {
+			printf("test failed! - copy %d not submitted\n", n);
+			ret = 1;
+			break;
+		}
+		on_second += i;
+	}
+	if(!on_second) {
+		printf("test failed! - no copy on the second controller\n");
+		ret = 1;
+	}
+
+	pl330_model_periph_request(env->model, 0, true);
+	ret |= wait_callbacks(n);
+	for(i = 1; !ret && i < n; i++) {
+		ret = check_copy(env, i * 8192, i * 8192, 4096 + i);
+	}
+
+destroy:
+	pl330_vfio_group_destroy(group);
+remove:
+	pl330_vfio_remove(ctrls[1]);
+	pl330_model_destroy(model);
+
+	return ret;
+}
+
+/*
+ * a controller removed without its irq thread ever started
+ * */
+static int test_remove(struct test_env *env)
+{
+	struct pl330_model *model;
+
+	model = pl330_model_create(env->mmu, MODEL_NUM_CHANNELS);
+	if(!model) {
+		printf("test failed! - no second model\n");
+		return 1;
+	}
+
+	pl330_vfio_remove(pl330_vfio_init_model(model));
+	pl330_model_destroy(model);
+
+	return 0;
+}
+
+/*
+ * records of every thread, tagged with a controller id of the test,
+ * have to come back from the dump complete and in order
+ * */
+static __u8 trace_ctrl;
+
+static void *trace_thread(void *data)
+{
+	struct conc_arg *arg = data;
+	int r;
+
+	for(r = 0; r < CONC_ROUNDS; r++) {
+		pl330_trace_record(PL330_TRACE_DONE, trace_ctrl, arg->id, r);
+	}
+
+	return NULL;
+}
+
+static int check_trace_dump(FILE *in)
+{
+	struct pl330_trace_header header;
+	struct pl330_trace_thread thread;
+	struct pl330_trace_rec rec;
+	int next[CONC_THREADS + 1];
+	__u64 last_ns;
+	__u32 t, i;
+	int n;
+
+	memset(next, 0, sizeof(next));
+
+	if(fread(&header, sizeof(header), 1, in) != 1 ||
+			memcmp(header.magic, PL330_TRACE_MAGIC,
+						sizeof(header.magic)) ||
+			header.rec_size != sizeof(rec)) {
+		printf("test failed! - bad trace header\n");
+		return 1;
+	}
+
+	for(t = 0; t < header.num_threads; t++) {
+		if(fread(&thread, sizeof(thread), 1, in) != 1) {
+			printf("test failed! - truncated trace\n");
+			return 1;
+		}
+
+		last_ns = 0;
+		for(i = 0; i < thread.count; i++) {
+			if(fread(&rec, sizeof(rec), 1, in) != 1) {
+				printf("test failed! - truncated trace\n");
+				return 1;
+			}
+			if(rec.ns < last_ns) {
+				printf("test failed! - trace out of order\n");
+				return 1;
+			}
+			last_ns = rec.ns;
+
+			if(rec.ctrl != trace_ctrl) {
+				continue;
+			}
+			n = rec.chan;
+			if(n < 1 || n > CONC_THREADS ||
+						rec.arg != (__u32)next[n]) {
+				printf("test failed! - record %u of thread "
+					"%d, %d expected\n", rec.arg, n,
+								next[n]);
+				return 1;
+			}
+			next[n]++;
+		}
+	}
+
+	for(n = 1; n <= CONC_THREADS; n++) {
+		if(next[n] != CONC_ROUNDS) {
+			printf("test failed! - %d records of thread %d\n",
+								next[n], n);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * IOVA blocks of a window of 12 pages, 8 + 4: split to allocate,
+ * merged back with their buddies when freed
+ * */
+static int test_iova(struct test_env *env)
+{
+	struct pl330_dma_buf one, eight, four, more;
+	struct pl330_iommu *mmu;
+	__u64 page = sysconf(_SC_PAGESIZE), len;
+	int ret = 0;
+
+	(void)env;
+
+	mmu = pl330_vfio_iommu_init(-1, 0x100000, 12 * page, 0);
+	if(!mmu) {
+		printf("test failed! - IOVA window of 12 pages\n");
+		return 1;
+	}
+
+	// the 4 pages block split to 1 + 1 + 2, the 8 pages one is left
+	if(pl330_vfio_dma_alloc(mmu, 1, &one) ||
+			pl330_vfio_dma_alloc(mmu, 8 * page, &eight) ||
+			pl330_vfio_dma_alloc(mmu, 3 * page, &four) == 0) {
+		printf("test failed! - blocks not split\n");
+		ret = 1;
+	}
+
+	// a lookup anywhere in a mapping, none past its end
+	if(!ret && (pl330_vfio_iova_to_vaddr(mmu, eight.iova + 5 * page + 3,
+			&len) != (char *)eight.vaddr + 5 * page + 3 ||
+			len != 3 * page - 3 ||
+			pl330_vfio_iova_to_vaddr(mmu, one.iova + page, &len))) {
+		printf("test failed! - IOVA lookup\n");
+		ret = 1;
+	}
+
+	// 1 + 1 + 2 merged back to 4
+	if(!ret && (pl330_vfio_dma_free(mmu, &one) ||
+			pl330_vfio_dma_alloc(mmu, 3 * page, &four))) {
+		printf("test failed! - blocks not merged\n");
+		ret = 1;
+	}
+
+	// the IOVA of the freed one is the new one's
+	if(!ret && pl330_vfio_iova_to_vaddr(mmu, one.iova, &len) !=
+								four.vaddr) {
+		printf("test failed! - freed IOVA not reused\n");
+		ret = 1;
+	}
+
+	// everything back, 8 + 4 again but never 12
+	if(!ret && (pl330_vfio_dma_free(mmu, &four) ||
+			pl330_vfio_dma_free(mmu, &eight) ||
+			pl330_vfio_dma_alloc(mmu, 12 * page, &more) == 0 ||
+			pl330_vfio_dma_alloc(mmu, 8 * page, &eight) ||
+			pl330_vfio_dma_alloc(mmu, 4 * page, &four) ||
+			pl330_vfio_dma_alloc(mmu, 1, &more) == 0)) {
+		printf("test failed! - window not whole after the frees\n");
+		ret = 1;
+	}
+
+	pl330_vfio_iommu_destroy(mmu);
+
+	return ret;
+}
+
+/*
+ * the trace rings of many threads, written at once and dumped
+ * */
+static int test_trace(struct test_env *env)
+{
+	char path[] = "/tmp/pl330_trace_XXXXXX";
+	FILE *in;
+	int fd, ret;
+
+	trace_ctrl = pl330_trace_ctrl_id();
+
+	ret = run_threads(env, trace_thread);
+
+	fd = mkstemp(path);
+	if(fd < 0) {
+		printf("test failed! - no temporary file\n");
+		return 1;
+	}
+	close(fd);
+
+	if(pl330_trace_dump(path)) {
+		printf("test failed! - trace dump\n");
+		ret = 1;
+	} else {
+		in = fopen(path, "r");
+		if(!in) {
+			printf("test failed! - trace dump not readable\n");
+			ret = 1;
+		} else {
+			ret |= check_trace_dump(in);
+			fclose(in);
+		}
+	}
+	unlink(path);
+
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(struct test_env *env);
+} model_tests[] = {
+	{ "program checks", test_prog_check },
+	{ "scatter-gather", test_scatter_gather },
+	{ "queue", test_queue },
+	{ "striped copy", test_striped },
+	{ "poll and hybrid", test_poll_hybrid },
+	{ "odd sizes and alignments", test_odd_sizes },
+	{ "burst tuning", test_burst_tuning },
+	{ "chunked copies", test_chunks },
+	{ "peripheral transfers", test_periph },
+	{ "fill", test_fill },
+	{ "2D transfers", test_2d },
+	{ "dependency chain", test_chain },
+	{ "tokens", test_tokens },
+	{ "stats", test_stats },
+	{ "simultaneous completions", test_dispatch },
+	{ "concurrent allocation", test_bitmap },
+	{ "concurrent polling", test_debug_ring },
+	{ "program cache", test_prog_cache },
+	{ "group of controllers", test_group },
+	{ "remove without irq thread", test_remove },
+	{ "IOVA allocator", test_iova },
+	{ "trace", test_trace },
+};
+
+/*
+ * a new controller on the model, with the buffers of the tests
+ * */
+static int run_model_tests(struct pl330_iommu *mmu)
+{
+	struct test_env env;
+	unsigned int i;
+	int c, ret, failed = 0;
+
+	env.model = pl330_model_create(mmu, MODEL_NUM_CHANNELS);
+	if(!env.model) {
+		printf("Could not create the model\n");
+		return 1;
+	}
+
+	env.mmu = mmu;
+	env.pl330 = pl330_vfio_init_model(env.model);
+	for(c = 0; c < MODEL_NUM_CHANNELS; c++) {
+		pl330_vfio_add_irq(env.pl330,
+				pl330_model_irq_eventfd(env.model, c), c);
+	}
+
+	if(pl330_vfio_cmds_pool_init(env.pl330, mmu, TEST_SLOT_SIZE,
+							TEST_NUM_SLOTS)) {
+		printf("Could not map the commands pool\n");
+		return 1;
+	}
+
+	if(pl330_vfio_dma_alloc(mmu, TEST_BUF_SIZE, &env.src) ||
+		pl330_vfio_dma_alloc(mmu, TEST_BUF_SIZE, &env.dst)) {
+		printf("Could not map DMA memory\n");
+		return 1;
+	}
+
+	pl330_vfio_start_irq_handler(env.pl330);
+
+	for(i = 0; i < sizeof(model_tests) / sizeof(model_tests[0]); i++) {
+		for(c = 0; c < TEST_BUF_SIZE; c++) {
+			((uchar *)env.src.vaddr)[c] = rand();
+		}
+		memset(env.dst.vaddr, 0, TEST_BUF_SIZE);
+		callbacks = 0;
+
+		ret = model_tests[i].run(&env);
+		if(pl330_vfio_inflight(env.pl330)) {
+			printf("test failed! - %u requests left in flight\n",
+					pl330_vfio_inflight(env.pl330));
+			ret = 1;
+		}
+
+		printf("%s: %s\n", model_tests[i].name, ret ? "failed" : "ok");
+		failed |= ret;
+	}
+
+	pl330_vfio_remove(env.pl330);
+	pl330_vfio_dma_free(mmu, &env.src);
+	pl330_vfio_dma_free(mmu, &env.dst);
+	pl330_model_destroy(env.model);
+
+	return failed;
+}
+
+/*
+ * same test, on the software model of the controller, then the
+ * model tests
+ * */
+static int test_on_model()
+{
+	struct pl330_iommu *mmu;
+	struct pl330_model *model;
+	struct pl330_status *pl330;
+	int i, ret;
+
+	mmu = pl330_vfio_iommu_init(-1, IOVA_BASE, IOVA_SIZE, 0);
+	model = pl330_model_create(mmu, MODEL_NUM_CHANNELS);
+	if(!mmu || !model) {
+		printf("Could not create the model\n");
+		return 1;
+	}
+
+	pl330 = pl330_vfio_init_model(model);
+	for(i = 0; i < MODEL_NUM_CHANNELS; i++) {
+		pl330_vfio_add_irq(pl330, pl330_model_irq_eventfd(model, i), i);
+	}
+
+	ret = run_copy_test(pl330, mmu);
+
+	pl330_vfio_remove(pl330);
+	pl330_model_destroy(model);
+
+	ret |= run_model_tests(mmu);
+
+	pl330_vfio_iommu_destroy(mmu);
+
+	return ret;
 }
 
 int main(int argc, char **argv)
 {
 	int container, group, device;
-	unsigned int i;
 
 	struct vfio_group_status group_status = { .argsz = sizeof(group_status) };
 	struct vfio_iommu_type1_info iommu_info = { .argsz = sizeof(iommu_info) };
-	// source memory area the DMA controller will read from
-	struct vfio_iommu_type1_dma_map dma_map_src = { .argsz = sizeof(dma_map_src) };
-	// destination memory area the DMA controller will read to
-	struct vfio_iommu_type1_dma_map dma_map_dst = { .argsz = sizeof(dma_map_dst) };
-	/*
-	 * memory area where the DMA controller will grub the instructions
-	 * to execute. We will tell to the controller how to reach these
-	 * instructions through the DEBUG registers.
-	 */
-	struct vfio_iommu_type1_dma_map dma_map_inst = { .argsz = sizeof(dma_map_inst) };
+	// IOVA space of the container
+	struct pl330_iommu *mmu;
+	// the controller
+	struct pl330_status *pl330;
 
 	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
 
 	int ret;
 
+	if (argc == 2 && !strcmp(argv[1], "-m")) {
+		return test_on_model();
+	}
+
 	if (argc != 3) {
 		printf("Usage: ./vfio-dt /dev/vfio/${group_id} device_id\n");
+		printf("       ./vfio-dt -m (on the software model)\n");
 		return 2;
 	}
 
@@ -136,40 +2393,11 @@ int main(int argc, char **argv)
 	/* Get addition IOMMU info */
 	ioctl(container, VFIO_IOMMU_GET_INFO, &iommu_info);
 
-	// easy and safer map
-	int size_to_map = getpagesize();
-
-	// source map for the dma copy
-	dma_map_src.vaddr = (u64)((uintptr_t)mmap(NULL, size_to_map, PROT_READ | PROT_WRITE,
-			     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0));
-	dma_map_src.size = size_to_map;
-	dma_map_src.iova = 0;
-	dma_map_src.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE
-						   | VFIO_DMA_MAP_FLAG_EXEC;
-
-	// destination map for the dma copy
-	dma_map_dst.vaddr = (u64)((uintptr_t)mmap(NULL, size_to_map, PROT_READ | PROT_WRITE,
-			     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0));
-	dma_map_dst.size = size_to_map;
-	dma_map_dst.iova = dma_map_src.size;
-	dma_map_dst.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE
-						   | VFIO_DMA_MAP_FLAG_EXEC;
-
-	// memory which stores the commands executed by the dma controller
-	int cmds_len = size_to_map;
-	dma_map_inst.vaddr = (u64)((uintptr_t)mmap(NULL, cmds_len, PROT_READ | PROT_WRITE,
-			     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0));
-	dma_map_inst.size = cmds_len;
-	dma_map_inst.iova = dma_map_src.size + dma_map_dst.size;
-	dma_map_inst.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE
-						    | VFIO_DMA_MAP_FLAG_EXEC;
-
-	ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map_src);
-	ret |= ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map_dst);
-	ret |= ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map_inst);
-
-	if(ret) {
-		printf("Could not map DMA memory\n");
+	mmu = pl330_vfio_iommu_init(container, IOVA_BASE, IOVA_SIZE,
+				VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE
+						| VFIO_DMA_MAP_FLAG_EXEC);
+	if(!mmu) {
+		printf("Could not init the IOVA space\n");
 		return 1;
 	}
 
@@ -210,6 +2438,9 @@ int main(int argc, char **argv)
 	if (base_regs != MAP_FAILED)
 		printf("  - Successful MMAP to address %p\n", base_regs);
 
+	// init the controller before adding irq
+	pl330 = pl330_vfio_init(base_regs);
+
 #ifdef IRQ
 	struct vfio_irq_info irq = { .argsz = sizeof(irq) };
 	struct vfio_irq_set set = { .argsz = sizeof(set) };
@@ -237,10 +2468,8 @@ int main(int argc, char **argv)
 
 	vfio_irqfd_init(device, irq.index, irqfd);
 
-	// init the controller before adding irq
-	pl330_vfio_init(base_regs);
 	// add the irq to the pl330 controller
-	pl330_vfio_add_irq(irqfd, irq.index);
+	pl330_vfio_add_irq(pl330, irqfd, irq.index);
 
 	// we should get 0 triggered interrupts
 	ret = read(irqfd, &e, sizeof(e));
@@ -250,64 +2479,7 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	int *src_ptr = (int *)((uintptr_t)dma_map_src.vaddr);
-	int *dst_ptr = (int *)((uintptr_t)dma_map_dst.vaddr);
-
-	// fill with random data
-	int c;
-	int tot = dma_map_src.size/sizeof(*src_ptr);
-	srand(time(NULL));
-	for(c = 0; c < tot; c++) {
-		src_ptr[c] = rand();
-	}
-
-	printf("source value: 0x%x\n", *src_ptr);
-	printf("destination value: 0x%x\n", *dst_ptr);
-
-	printf("start thread\n");
-
-	// irq handler after setting up irqs
-	pl330_vfio_start_irq_handler();
-
-	struct req_config config;
-	pl330_vfio_mem2mem_defconfig(&config);
-
-	config.iova_src = dma_map_src.iova;
-	config.iova_dst = dma_map_dst.iova;
-	config.size	= dma_map_src.size;
-	config.int_fin  = true;
-
-	int channel_id;
-	channel_id = pl330_vfio_request_channel();
-	if(channel_id < 0) {
-		printf("fail! No channels available!\n");
-		return -1;
-	} else {
-		printf("channel %d allocated\n", channel_id);
-		config.chan_id = channel_id;
-	}
-
-	config.callback = done_callback;
-	char msg[] = "transfer completed";
-	config.user_data = msg;
-
-	generate_cmds_from_request((uchar *)((uintptr_t)dma_map_inst.vaddr), &config);
-	pl330_vfio_submit_req((uchar *)((uintptr_t)dma_map_inst.vaddr), dma_map_inst.iova,
-								&config);
-
-	for(c = 0; c < tot; c++) {
-		if(src_ptr[c] != dst_ptr[c]) {
-			printf("test failed! - %d - 0x%x - 0x%x\n", c, src_ptr[c], dst_ptr[c]);
-		}
-	}
-
-	pl330_vfio_reset();
-
-	/*
-	 * check result
-	 */
-	printf("source value: 0x%x\n", *((uint *)src_ptr));
-	printf("destination value: 0x%x\n", *((uint *)dst_ptr));
+	ret = run_copy_test(pl330, mmu);
 
 	// halt controller: check the various thread are finished and remove TODO
 #ifdef IRQ
@@ -316,8 +2488,9 @@ int main(int argc, char **argv)
 	close(irqfd);
 #endif
 
-	pl330_vfio_release_channel(channel_id);
+	pl330_vfio_remove(pl330);
+	pl330_vfio_iommu_destroy(mmu);
 
-	return 0;
+	return ret;
 }
 